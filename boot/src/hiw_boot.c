@@ -34,7 +34,8 @@ void hiw_boot_on_request(hiw_request* req, hiw_response* resp) { hiw_app_state.c
 void hiw_boot_on_servlet_start(hiw_servlet_thread* st) { hiw_app_state.config.servlet_start_func(st); }
 
 /**
- * @brief Function called when a signal is received from the OS
+ * @brief Function called when a signal is received from the OS. The server stops accepting new clients, and the
+ *        servlet drains the connections that are in-flight before the application exits
  * @param sig
  */
 void hiw_boot_signal(int sig)
@@ -113,6 +114,12 @@ int hiw_boot_pre_start(int argc, char** argv)
 int main(const int argc, char** argv)
 {
 	signal(SIGINT, hiw_boot_signal);
+	signal(SIGTERM, hiw_boot_signal);
+#if defined(SIGPIPE)
+	// Connections that are closed while a response is sent, for example when draining the servlet, must not
+	// terminate the application
+	signal(SIGPIPE, SIG_IGN);
+#endif
 	if (!hiw_init(hiw_init_config_default))
 		return 1;
 	const int ret = hiw_boot_pre_start(argc, argv);
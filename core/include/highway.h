@@ -8,7 +8,11 @@
 
 #include "hiw_std.h"
 #include "hiw_thread.h"
+#include "hiw_fiber.h"
 #include "hiw_socket.h"
+#include "hiw_poller.h"
+#include "hiw_uring.h"
+#include "hiw_timer.h"
 #include "hiw_server.h"
 #include "hiw_logger.h"
 #include "hiw_mimetypes.h"
@@ -0,0 +1,114 @@
+//
+// Part of the highway project, under the MIT License
+// See the LICENSE file in the project root for license terms
+//
+
+#ifndef hiw_FIBER_H
+#define hiw_FIBER_H
+
+#include "hiw_socket.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the default stack size of a fiber, in bytes
+#if !defined(HIW_FIBER_DEFAULT_STACK_SIZE)
+#define HIW_FIBER_DEFAULT_STACK_SIZE (64 * 1024)
+#endif
+
+// the smallest stack size of a fiber, in bytes
+#if !defined(HIW_FIBER_MIN_STACK_SIZE)
+#define HIW_FIBER_MIN_STACK_SIZE (16 * 1024)
+#endif
+
+typedef struct hiw_fiber hiw_fiber;
+
+// Function called when a fiber is resumed for the first time. The fiber is done when the function returns
+typedef void (*hiw_fiber_fn)(hiw_fiber*);
+
+/**
+ * @brief Create a new fiber. A fiber runs on it's own stack, but on the thread that resumes it, and it's only
+ *        suspended when it yields. A fiber is expected to be resumed by the same thread until it's done
+ * @param func The function called when the fiber is resumed for the first time
+ * @param data User-data associated with the fiber
+ * @param stack_size The size of the fiber's stack, in bytes. 0 uses HIW_FIBER_DEFAULT_STACK_SIZE
+ * @return A new fiber; NULL if fibers are not supported on this platform
+ */
+HIW_PUBLIC extern hiw_fiber* hiw_fiber_new(hiw_fiber_fn func, void* data, int stack_size);
+
+/**
+ * @brief Delete the fiber and it's stack. A fiber that's suspended is never resumed again, so anything it's stack
+ *        is referring to is left as-is
+ * @param f The fiber
+ */
+HIW_PUBLIC extern void hiw_fiber_delete(hiw_fiber* f);
+
+/**
+ * @brief Reuse the stack of a fiber that's done, so that it runs a new function
+ * @param f The fiber
+ * @param func The function called when the fiber is resumed for the first time
+ * @param data User-data associated with the fiber
+ */
+HIW_PUBLIC extern void hiw_fiber_reset(hiw_fiber* f, hiw_fiber_fn func, void* data);
+
+/**
+ * @brief Switch to the supplied fiber and run it until it yields or is done
+ * @param f The fiber
+ * @return true if the fiber is done; false if it has yielded
+ */
+HIW_PUBLIC extern bool hiw_fiber_resume(hiw_fiber* f);
+
+/**
+ * @brief Suspend the calling fiber and switch back to the thread that resumed it
+ */
+HIW_PUBLIC extern void hiw_fiber_yield();
+
+/**
+ * @brief Suspend the calling fiber until the supplied socket is ready. The fiber's scheduler, the code resuming the
+ *        fiber, is expected to get the socket using hiw_fiber_get_wait and to resume the fiber when the socket is
+ *        ready, or when the wait has timed out. Spurious wake-ups are allowed, so the caller is expected to retry
+ * @param s The socket
+ * @param write true if waiting for the socket to become writable
+ * @param timeout The timeout, in milliseconds. 0 is infinite
+ * @return false if the wait timed out
+ */
+HIW_PUBLIC extern bool hiw_fiber_wait(SOCKET s, bool write, unsigned int timeout);
+
+/**
+ * @brief Get what a suspended fiber is waiting for
+ * @param f The fiber
+ * @param s Where to put the socket
+ * @param write Where to put true if the fiber is waiting for the socket to become writable
+ * @param timeout Where to put the timeout, in milliseconds. 0 is infinite
+ * @return true if the fiber is waiting for a socket; false if it has yielded without waiting
+ */
+HIW_PUBLIC extern bool hiw_fiber_get_wait(const hiw_fiber* f, SOCKET* s, bool* write, unsigned int* timeout);
+
+/**
+ * @brief Mark the wait of a suspended fiber as timed out, so that hiw_fiber_wait returns false when the fiber is
+ *        resumed
+ * @param f The fiber
+ */
+HIW_PUBLIC extern void hiw_fiber_timeout(hiw_fiber* f);
+
+/**
+ * @return The fiber running on the calling thread; NULL if the calling thread is not running a fiber
+ */
+HIW_PUBLIC extern hiw_fiber* hiw_fiber_current();
+
+/**
+ * @return The user-data associated with the fiber
+ */
+HIW_PUBLIC extern void* hiw_fiber_get_data(const hiw_fiber* f);
+
+/**
+ * @return true if the fiber's function has returned
+ */
+HIW_PUBLIC extern bool hiw_fiber_is_done(const hiw_fiber* f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // hiw_FIBER_H
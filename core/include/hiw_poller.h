@@ -0,0 +1,100 @@
+//
+// Part of the highway project, under the MIT License
+// See the LICENSE file in the project root for license terms
+//
+
+#ifndef hiw_POLLER_H
+#define hiw_POLLER_H
+
+#include "hiw_socket.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Wait for the socket to become readable
+#define hiw_poller_flags_read (1 << 0)
+
+// Wait for the socket to become writable
+#define hiw_poller_flags_write (1 << 1)
+
+// Only report the socket once. The socket has to be re-armed with hiw_poller_modify to be reported again
+#define hiw_poller_flags_oneshot (1 << 2)
+
+// Only wake up one of the pollers waiting for the same socket. This is used when multiple pollers share
+// the same listening socket. Cannot be combined with hiw_poller_flags_oneshot
+#define hiw_poller_flags_exclusive (1 << 3)
+
+// Reported when the remote peer closed the connection or if an error occurred on the socket
+#define hiw_poller_flags_hangup (1 << 4)
+
+typedef struct hiw_poller hiw_poller;
+
+/**
+ * @brief An event reported by the poller
+ */
+struct HIW_PUBLIC hiw_poller_event
+{
+	// The user-data associated with the socket when it was added to the poller
+	void* data;
+
+	// What happened to the socket
+	int flags;
+};
+
+typedef struct hiw_poller_event hiw_poller_event;
+
+/**
+ * @brief Create a new poller
+ * @return A new poller; NULL if polling is not supported on this platform
+ */
+HIW_PUBLIC extern hiw_poller* hiw_poller_new();
+
+/**
+ * @brief Delete the poller. The sockets added to the poller are not closed
+ * @param p The poller
+ */
+HIW_PUBLIC extern void hiw_poller_delete(hiw_poller* p);
+
+/**
+ * @brief Start watching the supplied socket
+ * @param p The poller
+ * @param s The socket
+ * @param flags What to wait for
+ * @param data User-data reported when an event occurs on the socket
+ * @return true if the socket was added
+ */
+HIW_PUBLIC extern bool hiw_poller_add(hiw_poller* p, SOCKET s, int flags, void* data);
+
+/**
+ * @brief Change what the poller is waiting for. This is also used to re-arm a oneshot socket
+ * @param p The poller
+ * @param s The socket
+ * @param flags What to wait for
+ * @param data User-data reported when an event occurs on the socket
+ * @return true if the socket was modified
+ */
+HIW_PUBLIC extern bool hiw_poller_modify(hiw_poller* p, SOCKET s, int flags, void* data);
+
+/**
+ * @brief Stop watching the supplied socket
+ * @param p The poller
+ * @param s The socket
+ */
+HIW_PUBLIC extern void hiw_poller_remove(hiw_poller* p, SOCKET s);
+
+/**
+ * @brief Wait for events on the sockets watched by the poller
+ * @param p The poller
+ * @param events Where to put the events
+ * @param n The maximum number of events
+ * @param timeout The timeout, in milliseconds. -1 is infinite
+ * @return The number of events; -1 if an error occurred
+ */
+HIW_PUBLIC extern int hiw_poller_wait(hiw_poller* p, hiw_poller_event* events, int n, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // hiw_POLLER_H
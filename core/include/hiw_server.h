@@ -8,20 +8,92 @@
 
 #include "hiw_socket.h"
 #include "hiw_std.h"
+#include "hiw_timer.h"
+#include "hiw_uring.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * The I/O backend used when accepting clients and when receiving and sending data
+ */
+enum HIW_PUBLIC hiw_server_io_backend
+{
+	// Use the socket functions directly. This is the default value
+	HIW_SERVER_IO_BACKEND_SOCKET = 0,
+
+	// Use one io_uring per servlet thread. Falls back to the socket backend if io_uring is not supported by the
+	// kernel. Only supported on Linux and by servlet threads running in blocking mode
+	HIW_SERVER_IO_BACKEND_URING
+};
+
+typedef enum hiw_server_io_backend hiw_server_io_backend;
+
+/**
+ * What the server does with a new client when accepting it would exceed the maximum number of connections
+ */
+enum HIW_PUBLIC hiw_server_overflow_policy
+{
+	// Send the overflow response to the new client and close the connection. This is the default value
+	HIW_SERVER_OVERFLOW_REJECT = 0,
+
+	// Close the connection that has been idle for the longest time, and accept the new client instead. The new client
+	// is rejected if no connection is idle
+	HIW_SERVER_OVERFLOW_EVICT_IDLE
+};
+
+typedef enum hiw_server_overflow_policy hiw_server_overflow_policy;
+
+// the default maximum number of connections served at the same time. 0 is unlimited
+#if !defined(HIW_SERVER_DEFAULT_MAX_CONNECTIONS)
+#define HIW_SERVER_DEFAULT_MAX_CONNECTIONS (0)
+#endif
+
+// the default maximum number of connections from the same ip address. 0 is unlimited
+#if !defined(HIW_SERVER_DEFAULT_MAX_CONNECTIONS_PER_IP)
+#define HIW_SERVER_DEFAULT_MAX_CONNECTIONS_PER_IP (0)
+#endif
+
+// the default bytes sent to a client that's rejected because there are too many connections
+#if !defined(HIW_SERVER_DEFAULT_OVERFLOW_RESPONSE)
+#define HIW_SERVER_DEFAULT_OVERFLOW_RESPONSE                                                                           \
+	"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\nRetry-After: 1\r\n\r\n"
+#endif
+
 struct HIW_PUBLIC hiw_server_config
 {
 	// underlying server socket config
 	hiw_socket_config socket_config;
+
+	// the I/O backend
+	hiw_server_io_backend io_backend;
+
+	// maximum number of connections served at the same time. 0 is unlimited
+	int max_connections;
+
+	// maximum number of connections from the same ip address. 0 is unlimited. Not used by unix domain sockets
+	int max_connections_per_ip;
+
+	// what to do with a new client when there are too many connections
+	hiw_server_overflow_policy overflow_policy;
+
+	// bytes sent to a rejected client before the connection is closed. The bytes are sent without waiting for the
+	// client, so they should fit in the socket's send buffer. Nothing is sent if empty
+	hiw_string overflow_response;
 };
 
 // Default configuration for a highway server
 #define hiw_server_config_default                                                                                      \
-	(hiw_server_config) { .socket_config = hiw_socket_config_default }
+	(hiw_server_config)                                                                                                \
+	{                                                                                                                  \
+		.socket_config = hiw_socket_config_default, .io_backend = HIW_SERVER_IO_BACKEND_SOCKET,                        \
+		.max_connections = HIW_SERVER_DEFAULT_MAX_CONNECTIONS,                                                         \
+		.max_connections_per_ip = HIW_SERVER_DEFAULT_MAX_CONNECTIONS_PER_IP,                                           \
+		.overflow_policy = HIW_SERVER_OVERFLOW_REJECT,                                                                 \
+		.overflow_response = {HIW_SERVER_DEFAULT_OVERFLOW_RESPONSE,                                                    \
+							  hiw_string_const_len(HIW_SERVER_DEFAULT_OVERFLOW_RESPONSE)}                              \
+	}
 
 enum HIW_PUBLIC hiw_server_error
 {
@@ -39,10 +111,51 @@ enum HIW_PUBLIC hiw_server_error
 };
 
 typedef enum hiw_server_error hiw_server_error;
+
+/**
+ * Connection counters of a server
+ */
+struct HIW_PUBLIC hiw_server_stats
+{
+	// Number of connections that are currently open
+	int connections;
+
+	// Number of new clients that have been rejected because there were too many connections
+	unsigned long long rejected;
+
+	// Number of idle connections that have been closed to make room for new clients
+	unsigned long long evicted;
+};
+
+typedef struct hiw_server_stats hiw_server_stats;
 typedef struct hiw_server_config hiw_server_config;
 typedef struct hiw_server hiw_server;
 typedef struct hiw_client hiw_client;
 
+// maximum number of clients kept by a client cache
+#if !defined(HIW_CLIENT_CACHE_SIZE)
+#define HIW_CLIENT_CACHE_SIZE (32)
+#endif
+
+/**
+ * Clients that are no longer used, kept so that they can be reused when accepting new clients instead of allocating
+ * new memory. A cache is not thread-safe and is expected to be owned by one thread only
+ */
+struct HIW_PUBLIC hiw_client_cache
+{
+	// The first client in the cache
+	hiw_client* first;
+
+	// Number of clients in the cache
+	int count;
+};
+
+typedef struct hiw_client_cache hiw_client_cache;
+
+// An empty client cache
+#define hiw_client_cache_default                                                                                       \
+	(hiw_client_cache) { .first = NULL, .count = 0 }
+
 /**
  * @return true if the supplied error is considered an actual error
  */
@@ -60,6 +173,12 @@ HIW_PUBLIC extern hiw_server* hiw_server_new(const hiw_server_config* config);
  */
 HIW_PUBLIC hiw_server_error hiw_server_start(hiw_server* s);
 
+/**
+ * @param s the server
+ * @return the configuration used by the server
+ */
+HIW_PUBLIC const hiw_server_config* hiw_server_get_config(const hiw_server* s);
+
 /**
  * @return user-data associated with the server
  */
@@ -89,6 +208,12 @@ HIW_PUBLIC extern void hiw_server_delete(hiw_server* s);
  */
 HIW_PUBLIC extern bool hiw_server_is_running(hiw_server* s);
 
+/**
+ * @param s the server
+ * @return the connection counters of the server
+ */
+HIW_PUBLIC extern hiw_server_stats hiw_server_get_stats(hiw_server* s);
+
 /**
  * Accept a new client
  *
@@ -98,13 +223,131 @@ HIW_PUBLIC extern bool hiw_server_is_running(hiw_server* s);
 HIW_PUBLIC extern hiw_client* hiw_server_accept(hiw_server* s);
 
 /**
- * Get the address of the client
+ * Accept a new client from the supplied shard
+ *
+ * @param s the server
+ * @param shard the shard. 0 is the server socket created when the server started
+ * @param cache clients to reuse before allocating a new client. Can be NULL
+ * @return A client if a new connection is established; NULL otherwise
+ */
+HIW_PUBLIC extern hiw_client* hiw_server_accept_shard(hiw_server* s, int shard, hiw_client_cache* cache);
+
+/**
+ * Accept a new client from the supplied shard using the supplied io_uring. The client will receive and send all data
+ * using the same ring, so the client must be served by the thread owning the ring
+ *
+ * @param s the server
+ * @param shard the shard. 0 is the server socket created when the server started
+ * @param ring the ring owned by the calling thread
+ * @param cache clients to reuse before allocating a new client. Can be NULL
+ * @return A client if a new connection is established; NULL otherwise
+ */
+HIW_PUBLIC extern hiw_client* hiw_server_accept_uring(hiw_server* s, int shard, hiw_uring* ring,
+													  hiw_client_cache* cache);
+
+/**
+ * Add server sockets listening on the same address and port as the server socket. The operating system distributes
+ * new clients over all shards, which allows each thread to accept clients from it's own accept queue. The server
+ * must be started before shards can be added
+ *
+ * @param s the server
+ * @param count the number of shards to add
+ * @return a potential error. Shards are not supported on platforms without SO_REUSEPORT
+ */
+HIW_PUBLIC extern hiw_server_error hiw_server_add_shards(hiw_server* s, int count);
+
+/**
+ * Accept each new client on the shard associated with the cpu that received the client's packets, instead of letting
+ * the operating system distribute new clients over the shards. A thread that accepts clients from a shard, while
+ * pinned to the shard's cpu, then serves it's clients on the same cpu as the network interrupt
+ *
+ * @param s the server
+ * @param cpus the cpus. Shard i is associated with cpus[i % count]
+ * @param count the number of cpus
+ * @return a potential error. Only supported on Linux
+ */
+HIW_PUBLIC extern hiw_server_error hiw_server_steer_shards(hiw_server* s, const int* cpus, int count);
+
+/**
+ * @param s the server
+ * @return the number of shards, including the server socket created when the server started
+ */
+HIW_PUBLIC extern int hiw_server_get_shard_count(const hiw_server* s);
+
+/**
+ * Get the listening socket of a shard
+ *
+ * @param s the server
+ * @param shard the shard. 0 is the server socket created when the server started
+ * @return the listening socket; INVALID_SOCKET if the server is not started
+ */
+HIW_PUBLIC extern SOCKET hiw_server_get_shard_socket(const hiw_server* s, int shard);
+
+/**
+ * Get the underlying server socket
+ *
+ * @param s the server
+ * @return the listening socket; INVALID_SOCKET if the server is not started
+ */
+HIW_PUBLIC extern SOCKET hiw_server_get_socket(const hiw_server* s);
+
+/**
+ * Get the address of the client. The address is formatted the first time it's requested
  *
  * @param c the client
  * @return the address
  */
 HIW_PUBLIC extern const char* hiw_client_get_address(hiw_client* c);
 
+/**
+ * Get the underlying client socket
+ *
+ * @param c the client
+ * @return the client socket
+ */
+HIW_PUBLIC extern SOCKET hiw_client_get_socket(const hiw_client* c);
+
+/**
+ * Enable or disable non-blocking mode for the client. Receiving and sending data using the hiw_client functions
+ * will wait for the socket to become ready, using the configured timeouts, even if the client is non-blocking
+ *
+ * @param c the client
+ * @param nonblocking true if the underlying socket should be non-blocking
+ * @return true if the mode was changed
+ */
+HIW_PUBLIC extern bool hiw_client_set_nonblocking(hiw_client* c, bool nonblocking);
+
+/**
+ * Set a deadline for all data received from the client. Receiving data fails when the deadline has passed, no matter
+ * how much data the client has sent so far. The read timeout is still used when waiting for data
+ *
+ * @param c the client
+ * @param timeout the number of milliseconds, from now, until the deadline. 0 removes the deadline
+ */
+HIW_PUBLIC extern void hiw_client_set_read_deadline(hiw_client* c, unsigned int timeout);
+
+/**
+ * Set a deadline for all data sent to the client. Sending data fails when the deadline has passed. The write timeout
+ * is still used when waiting for the client to receive data
+ *
+ * @param c the client
+ * @param timeout the number of milliseconds, from now, until the deadline. 0 removes the deadline
+ *
+ * A blocking send that has started is not interrupted by the deadline, so the deadline is only checked each time the
+ * client is waiting for the socket to become writable
+ */
+HIW_PUBLIC extern void hiw_client_set_write_deadline(hiw_client* c, unsigned int timeout);
+
+/**
+ * Mark the client as idle, i.e. it's waiting for the client's next request. The server might close an idle client's
+ * connection to make room for new clients, if the overflow policy is HIW_SERVER_OVERFLOW_EVICT_IDLE. An evicted
+ * connection is shut down, which wakes up whoever is waiting for the client
+ *
+ * @param c the client
+ * @param idle true if the client is idle
+ */
+HIW_PUBLIC extern void hiw_client_set_idle(hiw_client* c, bool idle);
+
 /**
  * Disconnect client
  *
@@ -119,6 +362,22 @@ HIW_PUBLIC extern void hiw_client_disconnect(hiw_client* c);
  */
 HIW_PUBLIC extern void hiw_client_delete(hiw_client* c);
 
+/**
+ * Close the client's socket and put the client into the supplied cache, so that it can be reused by the next accepted
+ * client. The client is deleted if the cache is full
+ *
+ * @param c the client
+ * @param cache the cache. Can be NULL
+ */
+HIW_PUBLIC extern void hiw_client_recycle(hiw_client* c, hiw_client_cache* cache);
+
+/**
+ * Delete all clients in the supplied cache
+ *
+ * @param cache the cache
+ */
+HIW_PUBLIC extern void hiw_client_cache_release(hiw_client_cache* cache);
+
 /**
  * Receive data from the supplier client
  *
@@ -139,6 +398,42 @@ HIW_PUBLIC extern int hiw_client_send(hiw_client* c, const char* src, int len);
  */
 HIW_PUBLIC extern int hiw_client_sendall(hiw_client* c, const char* src, int len);
 
+/**
+ * Send the content of all supplied memory blocks to this client. The memory blocks are sent using as few system calls
+ * as possible
+ *
+ * @param c the client
+ * @param views the memory blocks. The views are modified to keep track of what's sent
+ * @param count the number of memory blocks. At most HIW_SOCKET_MAX_SEND_VIEWS
+ * @param more true if more data is sent to the client right after this call
+ * @return the number of bytes sent; -1 if the send failed
+ */
+HIW_PUBLIC extern int hiw_client_sendallv(hiw_client* c, hiw_memory_view* views, int count, bool more);
+
+/**
+ * Send the content of a file to this client
+ *
+ * @param c the client
+ * @param fd the file descriptor of the file
+ * @param offset where in the file to start reading
+ * @param len the number of bytes to send
+ * @return the number of bytes sent; -1 if the send failed
+ */
+HIW_PUBLIC extern int hiw_client_sendfile(hiw_client* c, int fd, long long offset, int len);
+
+/**
+ * Send all bytes to this client without copying them into the socket buffer. Falls back to hiw_client_sendall if
+ * zero-copy sends are not supported
+ *
+ * @param c the client
+ * @param src the source buffer
+ * @param len the number of bytes to send
+ * @return the number of bytes sent; -1 if the send failed
+ *
+ * This call returns when the client has acknowledged all bytes, which means that the memory can be reused
+ */
+HIW_PUBLIC extern int hiw_client_sendall_zerocopy(hiw_client* c, const char* src, int len);
+
 #ifdef __cplusplus
 }
 #endif
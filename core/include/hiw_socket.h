@@ -16,6 +16,7 @@
 #include <ws2tcpip.h>
 
 #define hiw_socket_close(s) closesocket(s)
+#define hiw_socket_release(s) closesocket(s)
 #else
 
 #include <arpa/inet.h>
@@ -28,6 +29,7 @@
 #include <netinet/tcp.h>
 
 #define hiw_socket_close(s) shutdown(s, SHUT_RDWR)
+#define hiw_socket_release(s) close(s)
 #define SOCKET int
 #define INVALID_SOCKET -1
 #endif
@@ -45,9 +47,58 @@ extern "C" {
 // the default write timeout if nothing else is specified. 0 is infinite
 #define HIW_SOCKET_DEFAULT_WRITE_TIMEOUT (0)
 
+// the default maximum number of connections waiting to be accepted
+#if !defined(HIW_SOCKET_DEFAULT_BACKLOG)
+#define HIW_SOCKET_DEFAULT_BACKLOG (500)
+#endif
+
+// the default size of the socket receive buffer, in bytes. 0 uses the operating system default
+#if !defined(HIW_SOCKET_DEFAULT_RECV_BUFFER_SIZE)
+#define HIW_SOCKET_DEFAULT_RECV_BUFFER_SIZE (0)
+#endif
+
+// the default size of the socket send buffer, in bytes. 0 uses the operating system default
+#if !defined(HIW_SOCKET_DEFAULT_SEND_BUFFER_SIZE)
+#define HIW_SOCKET_DEFAULT_SEND_BUFFER_SIZE (0)
+#endif
+
+// the default number of seconds a new connection is kept from being accepted while waiting for the first request
+// bytes. 0 is disabled
+#if !defined(HIW_SOCKET_DEFAULT_DEFER_ACCEPT)
+#define HIW_SOCKET_DEFAULT_DEFER_ACCEPT (0)
+#endif
+
+// the default maximum number of pending TCP fast open requests. 0 is disabled
+#if !defined(HIW_SOCKET_DEFAULT_FASTOPEN_QUEUE)
+#define HIW_SOCKET_DEFAULT_FASTOPEN_QUEUE (0)
+#endif
+
+// should the accepted sockets acknowledge received data immediately by default
+#if !defined(HIW_SOCKET_DEFAULT_QUICKACK)
+#define HIW_SOCKET_DEFAULT_QUICKACK (0)
+#endif
+
+// the default number of microseconds to busy poll the network device when waiting for data. 0 is disabled
+#if !defined(HIW_SOCKET_DEFAULT_BUSY_POLL)
+#define HIW_SOCKET_DEFAULT_BUSY_POLL (0)
+#endif
+
 // How much are allowed to send in one TCP packet
 #define HIW_SOCKET_SEND_CHUNK_SIZE (4096)
 
+// maximum number of memory blocks sent with one call to hiw_socket_sendv
+#define HIW_SOCKET_MAX_SEND_VIEWS (8)
+
+// flags used when sending data. Sending to a socket that's shut down fails instead of raising SIGPIPE
+#if defined(MSG_NOSIGNAL)
+#define HIW_SOCKET_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define HIW_SOCKET_SEND_FLAGS 0
+#endif
+
+// storage large enough for both IPv4 and IPv6 socket addresses
+typedef struct sockaddr_storage hiw_socket_addr;
+
 typedef enum hiw_socket_ip_version
 {
 	// Allow only IPv4 connections
@@ -66,6 +117,11 @@ struct HIW_PUBLIC hiw_socket_config
 	// listen address
 	hiw_string address;
 
+	// path of a unix domain socket to listen on, instead of the address and port. A path beginning with '@' is bound
+	// in the abstract namespace (Linux only). A stale socket file left by an earlier run is removed. Not supported on
+	// Windows
+	hiw_string unix_path;
+
 	// The port
 	unsigned short port;
 
@@ -77,6 +133,29 @@ struct HIW_PUBLIC hiw_socket_config
 
 	// what ip version is allowed
 	hiw_socket_ip_version ip_version;
+
+	// maximum number of connections waiting to be accepted
+	int backlog;
+
+	// size of the receive buffer (SO_RCVBUF). Accepted sockets inherit the size. 0 uses the operating system default
+	int recv_buffer_size;
+
+	// size of the send buffer (SO_SNDBUF). Accepted sockets inherit the size. 0 uses the operating system default
+	int send_buffer_size;
+
+	// number of seconds a new connection is kept from being accepted while waiting for the first request bytes
+	// (TCP_DEFER_ACCEPT). 0 is disabled. Only supported on Linux
+	int defer_accept;
+
+	// maximum number of pending TCP fast open requests (TCP_FASTOPEN). 0 is disabled
+	int fastopen_queue;
+
+	// should accepted sockets acknowledge received data immediately (TCP_QUICKACK). Only supported on Linux
+	bool quickack;
+
+	// number of microseconds to busy poll the network device when waiting for data (SO_BUSY_POLL). Accepted sockets
+	// inherit the value. 0 is disabled. Only supported on Linux
+	int busy_poll;
 };
 
 typedef struct hiw_socket_config hiw_socket_config;
@@ -85,8 +164,13 @@ typedef struct hiw_socket_config hiw_socket_config;
 #define hiw_socket_config_default                                                                                      \
 	(hiw_socket_config)                                                                                                \
 	{                                                                                                                  \
-		.address = {NULL, 0}, .port = HIW_SOCKET_DEFAULT_PORT, .read_timeout = HIW_SOCKET_DEFAULT_READ_TIMEOUT,        \
-		.write_timeout = HIW_SOCKET_DEFAULT_WRITE_TIMEOUT, .ip_version = HIW_SOCKET_IPV4_AND_6                         \
+		.address = {NULL, 0}, .unix_path = {NULL, 0}, .port = HIW_SOCKET_DEFAULT_PORT,                                 \
+		.read_timeout = HIW_SOCKET_DEFAULT_READ_TIMEOUT, .write_timeout = HIW_SOCKET_DEFAULT_WRITE_TIMEOUT,            \
+		.ip_version = HIW_SOCKET_IPV4_AND_6, .backlog = HIW_SOCKET_DEFAULT_BACKLOG,                                    \
+		.recv_buffer_size = HIW_SOCKET_DEFAULT_RECV_BUFFER_SIZE,                                                       \
+		.send_buffer_size = HIW_SOCKET_DEFAULT_SEND_BUFFER_SIZE, .defer_accept = HIW_SOCKET_DEFAULT_DEFER_ACCEPT,      \
+		.fastopen_queue = HIW_SOCKET_DEFAULT_FASTOPEN_QUEUE, .quickack = HIW_SOCKET_DEFAULT_QUICKACK,                  \
+		.busy_poll = HIW_SOCKET_DEFAULT_BUSY_POLL                                                                      \
 	}
 
 /**
@@ -119,6 +203,60 @@ HIW_PUBLIC int hiw_socket_recv(SOCKET s, char* dest, int len);
  */
 HIW_PUBLIC int hiw_socket_send(SOCKET s, const char* dest, int len);
 
+/**
+ * Send the content of multiple memory blocks with one call
+ *
+ * @param s The socket
+ * @param views The memory blocks to send
+ * @param count The number of memory blocks. At most HIW_SOCKET_MAX_SEND_VIEWS
+ * @param more true if more data is sent right after this call. The operating system is then allowed to wait for
+ *             more data before sending a partially filled TCP segment
+ * @return The number of bytes sent; -1 if the socket failed to send any bytes
+ */
+HIW_PUBLIC int hiw_socket_sendv(SOCKET s, const hiw_memory_view* views, int count, bool more);
+
+/**
+ * Send the content of a file to the supplied socket. On Linux, the content is sent directly from the page cache
+ * without being copied into user-space memory
+ *
+ * @param s The socket
+ * @param fd The file descriptor of the file
+ * @param offset Where in the file to start reading
+ * @param len The number of bytes to send
+ * @return The number of bytes sent; -1 if the socket failed to send any bytes
+ */
+HIW_PUBLIC int hiw_socket_sendfile(SOCKET s, int fd, long long offset, int len);
+
+/**
+ * Allow bytes to be sent from the supplied socket without copying them into the socket buffer
+ *
+ * @param s The socket
+ * @return true if zero-copy sends are supported by the platform and the socket
+ */
+HIW_PUBLIC bool hiw_socket_set_zerocopy(SOCKET s);
+
+/**
+ * Send bytes without copying them into the socket buffer. The memory must be left untouched until the send is reported
+ * as completed by hiw_socket_zerocopy_reap
+ *
+ * @param s The socket
+ * @param src The source buffer
+ * @param len The number of bytes to send
+ * @param zerocopy Set to true if the send has to be reaped; false if the bytes were copied
+ * @return The number of bytes sent; -1 if the socket failed to send any bytes
+ */
+HIW_PUBLIC int hiw_socket_send_zerocopy(SOCKET s, const char* src, int len, bool* zerocopy);
+
+/**
+ * Read the zero-copy sends that are completed by the kernel
+ *
+ * @param s The socket
+ * @param wait true if this call should wait until at least one send is completed
+ * @param timeout The timeout, in milliseconds, when waiting. 0 is infinite
+ * @return The number of completed sends; -1 if the wait timed out or the socket failed
+ */
+HIW_PUBLIC int hiw_socket_zerocopy_reap(SOCKET s, bool wait, unsigned int timeout);
+
 enum HIW_PUBLIC hiw_socket_error
 {
 	// No error happened
@@ -138,7 +276,10 @@ enum HIW_PUBLIC hiw_socket_error
 	HIW_SOCKET_ERROR_LISTEN,
 
 	// Could not accept incoming socket request
-	HIW_SOCKET_ERROR_ACCEPT
+	HIW_SOCKET_ERROR_ACCEPT,
+
+	// The socket is non-blocking and the operation would have blocked. Try again later
+	HIW_SOCKET_ERROR_WOULD_BLOCK
 };
 
 typedef enum hiw_socket_error hiw_socket_error;
@@ -153,14 +294,65 @@ typedef enum hiw_socket_error hiw_socket_error;
 HIW_PUBLIC SOCKET hiw_socket_listen(const hiw_socket_config* config, hiw_socket_error* err);
 
 /**
- * Create a socket and listen for incoming connections
+ * Accept a new client socket
  *
- * @param server_socket
+ * @param server_socket the listening server socket
  * @param config
+ * @param addr where to put the address of the client. Can be NULL
  * @param err
  * @return
  */
-HIW_PUBLIC SOCKET hiw_socket_accept(SOCKET server_socket, const hiw_socket_config* config, hiw_socket_error* err);
+HIW_PUBLIC SOCKET hiw_socket_accept(SOCKET server_socket, const hiw_socket_config* config, hiw_socket_addr* addr,
+									hiw_socket_error* err);
+
+/**
+ * Apply the tuning options that are not inherited from the listening socket to an accepted socket. This is done
+ * by hiw_socket_accept, but has to be done manually for sockets accepted in other ways
+ *
+ * @param s the accepted socket
+ * @param config
+ */
+HIW_PUBLIC void hiw_socket_tune_client(SOCKET s, const hiw_socket_config* config);
+
+/**
+ * @brief Enable or disable non-blocking mode on the supplied socket
+ * @param s The socket
+ * @param nonblocking true if the socket should be non-blocking
+ * @return true if the socket mode was changed successfully
+ */
+HIW_PUBLIC bool hiw_socket_set_nonblocking(SOCKET s, bool nonblocking);
+
+/**
+ * @return true if the last socket operation failed because a non-blocking socket would have blocked
+ */
+HIW_PUBLIC bool hiw_socket_would_block();
+
+/**
+ * @brief Wait for the supplied socket to become readable or writable
+ * @param s The socket
+ * @param write true if we are waiting for the socket to become writable; false if readable
+ * @param timeout The timeout, in milliseconds. 0 is infinite
+ * @return true if the socket is ready; false if the timeout was reached or an error occurred
+ */
+HIW_PUBLIC bool hiw_socket_wait(SOCKET s, bool write, unsigned int timeout);
+
+/**
+ * @brief Check, without waiting, if the supplied socket has data that can be received
+ * @param s The socket
+ * @return true if a receive would not block. A closed connection is also considered readable
+ */
+HIW_PUBLIC bool hiw_socket_readable(SOCKET s);
+
+/**
+ * @brief Select which of the sockets bound to the same port, using SO_REUSEPORT, accepts a new connection based on the
+ *        cpu that received the connection's packets. A connection received on cpus[i] is accepted by the i'th socket
+ *        that started listening. Connections received on other cpus are spread over the sockets by cpu index
+ * @param s One of the listening sockets bound to the port
+ * @param cpus The cpu of each socket bound to the port
+ * @param count The number of sockets bound to the port
+ * @return true if successful. Only supported on Linux
+ */
+HIW_PUBLIC bool hiw_socket_steer_by_cpu(SOCKET s, const int* cpus, int count);
 
 #ifdef __cplusplus
 }
@@ -22,10 +22,28 @@ extern "C" {
 #define HIW_THREAD_WORKER_WAIT_DEFAULT_TIMEOUT (30000)
 #endif
 
+// Default time that work is allowed to wait for a thread pool worker before the thread pool grows
+#if !defined(HIW_THREAD_POOL_GROW_LATENCY_DEFAULT)
+#define HIW_THREAD_POOL_GROW_LATENCY_DEFAULT (10)
+#endif
+
+// Default time that a thread pool worker is allowed to be idle before the thread pool shrinks
+#if !defined(HIW_THREAD_POOL_IDLE_TIMEOUT_DEFAULT)
+#define HIW_THREAD_POOL_IDLE_TIMEOUT_DEFAULT (60000)
+#endif
+
+// The maximum number of context keys, allocated using hiw_thread_context_key_new, that a process is allowed to have
+#if !defined(HIW_THREAD_CONTEXT_MAX_KEYS)
+#define HIW_THREAD_CONTEXT_MAX_KEYS (32)
+#endif
+
 typedef struct hiw_thread_context hiw_thread_context;
 typedef struct hiw_thread hiw_thread;
 typedef struct hiw_thread_pool_config hiw_thread_pool_config;
 typedef struct hiw_thread_pool hiw_thread_pool;
+typedef struct hiw_thread_pool_task hiw_thread_pool_task;
+typedef struct hiw_thread_pool_handle hiw_thread_pool_handle;
+typedef struct hiw_thread_pool_wait_group hiw_thread_pool_wait_group;
 
 /**
  * @brief context that can be used to recursively supply generic data to a thread
@@ -50,6 +68,9 @@ struct HIW_PUBLIC hiw_thread_context
 // a function definition for a highway thread
 typedef void (*hiw_thread_fn)(hiw_thread*);
 
+// a function definition for work that's producing a result
+typedef void* (*hiw_thread_pool_result_fn)(hiw_thread*);
+
 /**
  * Create memory for a new thread
  *
@@ -81,6 +102,15 @@ HIW_PUBLIC hiw_thread* hiw_thread_main();
  */
 HIW_PUBLIC void hiw_thread_set_func(hiw_thread* t, hiw_thread_fn fn);
 
+/**
+ * @brief Pin the supplied thread to a cpu. The thread is pinned before it starts running, which means that memory
+ *        first touched by the thread, such as it's stack, is allocated from the memory node local to the cpu. You are
+ *        not allowed to set the cpu if the thread is already running
+ * @param t the thread
+ * @param cpu the cpu index. -1 allows the thread to run on any cpu, which is the default
+ */
+HIW_PUBLIC void hiw_thread_set_cpu(hiw_thread* t, int cpu);
+
 /**
  * @brief set user data associated with the supplied thread
  * @param t the thread to set the data to
@@ -118,7 +148,7 @@ HIW_PUBLIC hiw_thread_context* hiw_thread_context_push(hiw_thread* t, hiw_thread
 HIW_PUBLIC hiw_thread_context* hiw_thread_context_pop(hiw_thread* t);
 
 /**
- * @brief Clear all context values from the thread
+ * @brief Clear all context values, including the values of the context slots, from the thread
  * @param t the thread
  */
 HIW_PUBLIC void hiw_thread_context_clear(hiw_thread* t);
@@ -131,6 +161,33 @@ HIW_PUBLIC void hiw_thread_context_clear(hiw_thread* t);
  */
 HIW_PUBLIC void* hiw_thread_context_find(const hiw_thread* t, const void* key);
 
+/**
+ * @brief Allocate a new context key, representing a numbered context slot that exists on all threads. Keys are expected
+ *        to be allocated once, for example when the application starts, and are never released
+ * @return The new key; -1 if all HIW_THREAD_CONTEXT_MAX_KEYS keys are already allocated
+ *
+ * Unlike values pushed using hiw_thread_context_push, a value in a context slot is found in constant time, which
+ * makes slots the better choice for per-thread objects, such as database connections, that are looked up often
+ */
+HIW_PUBLIC int hiw_thread_context_key_new();
+
+/**
+ * @brief Set the value of a context slot on the supplied thread
+ * @param t the thread
+ * @param key A key allocated using hiw_thread_context_key_new
+ * @param value the value. NULL clears the slot
+ * @return the previous value of the slot
+ */
+HIW_PUBLIC void* hiw_thread_context_set(hiw_thread* t, int key, void* value);
+
+/**
+ * @brief Get the value of a context slot from the supplied thread
+ * @param t the thread
+ * @param key A key allocated using hiw_thread_context_key_new
+ * @return The value, if one is set; NULL otherwise
+ */
+HIW_PUBLIC void* hiw_thread_context_get(const hiw_thread* t, int key);
+
 /**
  * Start the supplied thread
  *
@@ -149,29 +206,50 @@ HIW_PUBLIC void hiw_thread_delete(hiw_thread* t);
  */
 struct HIW_PUBLIC hiw_thread_pool_config
 {
-	// The number of threads running at this moment
+	// The number of threads started with the thread pool. The thread pool never shrinks below this
 	int count;
 
-	// The maximum number of threads allowed to run
+	// The maximum number of threads allowed to run. The thread pool grows up to this many threads when work is
+	// waiting for a worker. Values less than count are treated as count
 	int max_count;
 
 	// allow the thread pool to shrink as load goes down
 	bool allow_shrink;
 
+	// Number of milliseconds that work is allowed to wait for a worker before another thread is started. Another thread
+	// is started right away if 0
+	int grow_latency;
+
+	// Number of milliseconds a thread is allowed to be idle before it's stopped, if the thread pool is allowed to
+	// shrink
+	int idle_timeout;
+
+	// The maximum number of tasks waiting to be executed. Pushing work fails, or blocks, when the queues are full. 0
+	// if the queues are unbounded
+	int capacity;
+
 	// Function called as the thread is starting up, but before the main function is executed.
 	// Please note that you are expected to call "hiw_thread_pool_main" manually
 	hiw_thread_fn on_start;
 
 	// Timeout that a thread pool worker is allowed to process work until forcefully shutdown
 	int worker_timeout;
+
+	// The cpus the workers are pinned to. Worker i is pinned to cpus[i % cpu_count]. NULL if the workers are allowed to
+	// run on any cpu
+	const int* cpus;
+
+	// The number of cpus in the cpus array
+	int cpu_count;
 };
 
 // default configuration
 #define hiw_thread_pool_config_default                                                                                 \
 	(hiw_thread_pool_config)                                                                                           \
 	{                                                                                                                  \
-		.count = 0, .max_count = 0, .allow_shrink = false, .on_start = NULL,                                           \
-		.worker_timeout = HIW_THREAD_WORKER_WAIT_DEFAULT_TIMEOUT                                                       \
+		.count = 0, .max_count = 0, .allow_shrink = false, .grow_latency = HIW_THREAD_POOL_GROW_LATENCY_DEFAULT,      \
+		.idle_timeout = HIW_THREAD_POOL_IDLE_TIMEOUT_DEFAULT, .capacity = 0, .on_start = NULL,                         \
+		.worker_timeout = HIW_THREAD_WORKER_WAIT_DEFAULT_TIMEOUT, .cpus = NULL, .cpu_count = 0                         \
 	}
 
 
@@ -195,13 +273,209 @@ extern HIW_PUBLIC void hiw_thread_pool_delete(hiw_thread_pool* pool);
 extern HIW_PUBLIC bool hiw_thread_pool_start(hiw_thread_pool* pool);
 
 /**
- * @brief Push new work to be executed as soon as already pushed work is done
+ * @brief Push new work to be executed as soon as possible. Work pushed by a thread pool worker is queued on the worker
+ *        itself, and work pushed by any other thread is handed to a sleeping worker, or to the workers in turn. Idle
+ *        workers steal queued work from busy workers, so that work is never waiting behind slow work while a worker is
+ *        idle. The work is queued even if the thread pool's queues are full
  * @param pool The thread pool
  * @param func The function to be called
  * @param data User data associated with the call
  */
 extern HIW_PUBLIC void hiw_thread_pool_push(hiw_thread_pool* pool, hiw_thread_fn func, void* data);
 
+/**
+ * @brief Push new work to be executed as soon as possible, unless the thread pool's queues are full
+ * @param pool The thread pool
+ * @param func The function to be called
+ * @param data User data associated with the call
+ * @return true if the work is pushed; false if the queues are full
+ */
+extern HIW_PUBLIC bool hiw_thread_pool_try_push(hiw_thread_pool* pool, hiw_thread_fn func, void* data);
+
+/**
+ * @brief Push new work to be executed as soon as possible. Waits for room if the thread pool's queues are full
+ * @param pool The thread pool
+ * @param func The function to be called
+ * @param data User data associated with the call
+ * @param timeout The number of milliseconds to wait for room in the queues
+ * @return true if the work is pushed; false if the queues stayed full, or if the thread pool is not running
+ */
+extern HIW_PUBLIC bool hiw_thread_pool_push_timeout(hiw_thread_pool* pool, hiw_thread_fn func, void* data,
+													int timeout);
+
+/**
+ * @brief work that's pushed to a thread pool using memory owned by the caller
+ */
+struct HIW_PUBLIC hiw_thread_pool_task
+{
+	// function to execute. The thread's user-data is set to the task's data while the function is called
+	hiw_thread_fn func;
+
+	// user-data used when running the function
+	void* data;
+
+	// used by the thread pool while the task is queued
+	hiw_thread_pool_task* next;
+
+	// used by the thread pool while the task is queued
+	int flags;
+};
+
+/**
+ * @brief Push a task to be executed as soon as possible. No memory is allocated and no lock is taken, unless a
+ *        sleeping worker has to be woken up. The task is queued even if the thread pool's queues are full
+ * @param pool The thread pool
+ * @param task The task. The memory is owned by the caller and must be kept alive until the task's function is called.
+ *             The thread pool does not touch the task after it's function is called, so the function is allowed to
+ *             free or reuse the task
+ */
+extern HIW_PUBLIC void hiw_thread_pool_push_task(hiw_thread_pool* pool, hiw_thread_pool_task* task);
+
+/**
+ * @brief Push a task to be executed as soon as possible. Waits for room if the thread pool's queues are full
+ * @param pool The thread pool
+ * @param task The task. The memory is owned by the caller, see hiw_thread_pool_push_task
+ * @param timeout The number of milliseconds to wait for room in the queues. 0 if the function should not wait
+ * @return true if the task is pushed; false if the queues stayed full, or if the thread pool is not running
+ */
+extern HIW_PUBLIC bool hiw_thread_pool_push_task_timeout(hiw_thread_pool* pool, hiw_thread_pool_task* task,
+														 int timeout);
+
+/**
+ * @brief Push tasks to be executed as soon as possible. The tasks are queued together and only one sleeping worker
+ *        is woken up, which wakes up more workers if needed
+ * @param pool The thread pool
+ * @param tasks The tasks. The memory is owned by the caller, see hiw_thread_pool_push_task
+ * @param count The number of tasks
+ * @return The number of tasks pushed, starting with the first one. Less than count if the queues are full
+ */
+extern HIW_PUBLIC int hiw_thread_pool_push_batch(hiw_thread_pool* pool, hiw_thread_pool_task* tasks, int count);
+
+/**
+ * @brief handle to work that's pushed to a thread pool, used to wait for the work to be done and to get it's result.
+ *        The memory is owned by the caller
+ */
+struct HIW_PUBLIC hiw_thread_pool_handle
+{
+	// the task pushed to the thread pool
+	hiw_thread_pool_task task;
+
+	// function to execute. The thread's user-data is set to data while the function is called
+	hiw_thread_pool_result_fn func;
+
+	// user-data used when running the function
+	void* data;
+
+	// the value returned by the function
+	void* result;
+
+	// the thread pool running the work
+	hiw_thread_pool* pool;
+
+	// the wait group the work is part of; NULL if none
+	hiw_thread_pool_wait_group* group;
+
+	// used by the thread pool to tell if the work is done
+	int state;
+};
+
+/**
+ * @brief counter of work that's not done yet, used to wait for many tasks at once. The memory is owned by the caller
+ */
+struct HIW_PUBLIC hiw_thread_pool_wait_group
+{
+	// the thread pool running the work
+	hiw_thread_pool* pool;
+
+	// used by the thread pool to count the work that's not done yet
+	int count;
+};
+
+/**
+ * @brief Push work to be executed as soon as possible, like hiw_thread_pool_push_task, and track it using the
+ *        supplied handle
+ * @param pool The thread pool
+ * @param handle The handle. Must be kept alive until the work is done
+ * @param func The function to be called. The value it returns is the result of the work
+ * @param data User data associated with the call
+ */
+extern HIW_PUBLIC void hiw_thread_pool_submit(hiw_thread_pool* pool, hiw_thread_pool_handle* handle,
+											  hiw_thread_pool_result_fn func, void* data);
+
+/**
+ * @param handle The handle
+ * @return true if the work is done
+ */
+extern HIW_PUBLIC bool hiw_thread_pool_handle_is_done(const hiw_thread_pool_handle* handle);
+
+/**
+ * @param handle The handle
+ * @return The result of the work; NULL if the work is not done yet
+ */
+extern HIW_PUBLIC void* hiw_thread_pool_handle_result(const hiw_thread_pool_handle* handle);
+
+/**
+ * @brief Wait for the work to be done. A thread pool worker executes other queued work while it's waiting
+ * @param handle The handle
+ * @return The result of the work
+ */
+extern HIW_PUBLIC void* hiw_thread_pool_handle_wait(hiw_thread_pool_handle* handle);
+
+/**
+ * @brief Wait for the work to be done, but not longer than the supplied timeout
+ * @param handle The handle
+ * @param timeout The number of milliseconds to wait
+ * @return true if the work is done
+ */
+extern HIW_PUBLIC bool hiw_thread_pool_handle_wait_timeout(hiw_thread_pool_handle* handle, int timeout);
+
+/**
+ * @brief Initialize a wait group for work executed by the supplied thread pool
+ * @param group The wait group
+ * @param pool The thread pool
+ */
+extern HIW_PUBLIC void hiw_thread_pool_wait_group_init(hiw_thread_pool_wait_group* group, hiw_thread_pool* pool);
+
+/**
+ * @brief Add work that's not done yet. Use this when work is pushed without hiw_thread_pool_wait_group_submit, and
+ *        call hiw_thread_pool_wait_group_done when each piece of work is done
+ * @param group The wait group
+ * @param count The amount of work
+ */
+extern HIW_PUBLIC void hiw_thread_pool_wait_group_add(hiw_thread_pool_wait_group* group, int count);
+
+/**
+ * @brief Tell the wait group that one piece of work is done
+ * @param group The wait group
+ */
+extern HIW_PUBLIC void hiw_thread_pool_wait_group_done(hiw_thread_pool_wait_group* group);
+
+/**
+ * @brief Push work, like hiw_thread_pool_submit, as part of the supplied wait group
+ * @param group The wait group
+ * @param handle The handle. Must be kept alive until the work is done
+ * @param func The function to be called. The value it returns is the result of the work
+ * @param data User data associated with the call
+ */
+extern HIW_PUBLIC void hiw_thread_pool_wait_group_submit(hiw_thread_pool_wait_group* group,
+														 hiw_thread_pool_handle* handle,
+														 hiw_thread_pool_result_fn func, void* data);
+
+/**
+ * @brief Wait for all work in the wait group to be done. A thread pool worker executes other queued work while it's
+ *        waiting
+ * @param group The wait group
+ */
+extern HIW_PUBLIC void hiw_thread_pool_wait_group_wait(hiw_thread_pool_wait_group* group);
+
+/**
+ * @brief Wait for all work in the wait group to be done, but not longer than the supplied timeout
+ * @param group The wait group
+ * @param timeout The number of milliseconds to wait
+ * @return true if all work is done
+ */
+extern HIW_PUBLIC bool hiw_thread_pool_wait_group_wait_timeout(hiw_thread_pool_wait_group* group, int timeout);
+
 /**
  * @brief Get the thread pool responsible for running the supplied thread
  */
@@ -220,6 +494,18 @@ extern HIW_PUBLIC void hiw_thread_pool_worker_main(hiw_thread* t);
  */
 typedef struct hiw_thread_critical_sec hiw_thread_critical_sec;
 
+/**
+ * @brief Create and initialize a new critical section
+ * @return A new critical section
+ */
+extern HIW_PUBLIC hiw_thread_critical_sec* hiw_thread_critical_sec_new();
+
+/**
+ * @brief Release and delete a critical section created by hiw_thread_critical_sec_new
+ * @param c The critical section
+ */
+extern HIW_PUBLIC void hiw_thread_critical_sec_delete(hiw_thread_critical_sec* c);
+
 /**
  * @brief Initialize a critical section
  * @param c The critical section
@@ -0,0 +1,126 @@
+//
+// Part of the highway project, under the MIT License
+// See the LICENSE file in the project root for license terms
+//
+
+#ifndef hiw_TIMER_H
+#define hiw_TIMER_H
+
+#include "hiw_std.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the resolution of a timer wheel, in milliseconds. Timers expire at most this much later than requested
+#if !defined(HIW_TIMER_RESOLUTION)
+#define HIW_TIMER_RESOLUTION (10)
+#endif
+
+// number of levels in a timer wheel. Each level covers 64 times the time span of the level below it
+#define HIW_TIMER_LEVELS (4)
+
+// number of slots in each level of a timer wheel
+#define HIW_TIMER_SLOTS (64)
+
+typedef struct hiw_timer hiw_timer;
+typedef struct hiw_timer_link hiw_timer_link;
+typedef struct hiw_timer_wheel hiw_timer_wheel;
+
+// Function called when a timer expires. The timer is no longer armed when the function is called, so it can be
+// added again from within the function
+typedef void (*hiw_timer_fn)(hiw_timer*);
+
+/**
+ * @brief Links a timer into a slot of a timer wheel
+ */
+struct HIW_PUBLIC hiw_timer_link
+{
+	hiw_timer_link* prev;
+	hiw_timer_link* next;
+};
+
+/**
+ * @brief A timer. The memory of the timer is owned by the caller, which means that adding and cancelling a timer
+ *        never allocates any memory
+ */
+struct HIW_PUBLIC hiw_timer
+{
+	// The link into the wheel. Must be the first field
+	hiw_timer_link link;
+
+	// When the timer expires, in wheel ticks
+	unsigned long long expires;
+
+	// The function called when the timer expires
+	hiw_timer_fn func;
+
+	// User-data associated with the timer
+	void* data;
+};
+
+// initialize a timer that's not armed
+#define hiw_timer_init(fn, userdata)                                                                                   \
+	(hiw_timer)                                                                                                        \
+	{                                                                                                                  \
+		.link = {NULL, NULL}, .expires = 0, .func = fn, .data = userdata                                               \
+	}
+
+/**
+ * @return A monotonic time, in milliseconds
+ */
+HIW_PUBLIC extern unsigned long long hiw_timer_now();
+
+/**
+ * @brief Create a new timer wheel. A timer wheel is not thread-safe and is expected to be owned by one thread only
+ * @param now The current time, in milliseconds, as returned by hiw_timer_now
+ * @return A new timer wheel
+ */
+HIW_PUBLIC extern hiw_timer_wheel* hiw_timer_wheel_new(unsigned long long now);
+
+/**
+ * @brief Delete the timer wheel. Timers that are still armed are left untouched and are no longer armed
+ * @param w The timer wheel
+ */
+HIW_PUBLIC extern void hiw_timer_wheel_delete(hiw_timer_wheel* w);
+
+/**
+ * @brief Arm the supplied timer. A timer that is already armed is moved to the new expiry time
+ * @param w The timer wheel
+ * @param t The timer
+ * @param timeout The number of milliseconds, from the last time the wheel was advanced, until the timer expires
+ */
+HIW_PUBLIC extern void hiw_timer_wheel_add(hiw_timer_wheel* w, hiw_timer* t, unsigned int timeout);
+
+/**
+ * @brief Cancel the supplied timer. Nothing happens if the timer is not armed
+ * @param t The timer
+ */
+HIW_PUBLIC extern void hiw_timer_cancel(hiw_timer* t);
+
+/**
+ * @return true if the supplied timer is armed
+ */
+HIW_PUBLIC extern bool hiw_timer_is_armed(const hiw_timer* t);
+
+/**
+ * @brief Advance the time of the wheel and call the function of all timers that have expired
+ * @param w The timer wheel
+ * @param now The current time, in milliseconds, as returned by hiw_timer_now
+ * @return The number of timers that expired
+ */
+HIW_PUBLIC extern int hiw_timer_wheel_advance(hiw_timer_wheel* w, unsigned long long now);
+
+/**
+ * @brief Get how long the owner of the wheel can wait before the wheel has to be advanced again
+ * @param w The timer wheel
+ * @param max The maximum number of milliseconds to return
+ * @return The number of milliseconds until the wheel has to be advanced, but never more than max
+ */
+HIW_PUBLIC extern int hiw_timer_wheel_next_timeout(const hiw_timer_wheel* w, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // hiw_TIMER_H
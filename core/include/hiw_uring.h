@@ -0,0 +1,108 @@
+//
+// Part of the highway project, under the MIT License
+// See the LICENSE file in the project root for license terms
+//
+
+#ifndef hiw_URING_H
+#define hiw_URING_H
+
+#include "hiw_socket.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// default number of submission queue entries for a ring
+#if !defined(HIW_URING_DEFAULT_ENTRIES)
+#define HIW_URING_DEFAULT_ENTRIES (64)
+#endif
+
+// how often, in milliseconds, a ring waiting for new clients on a unix domain server socket wakes up to see if the
+// server is stopped. Shutting down a unix domain server socket doesn't complete an accept that's already submitted
+#if !defined(HIW_URING_UNIX_ACCEPT_TIMEOUT)
+#define HIW_URING_UNIX_ACCEPT_TIMEOUT (500)
+#endif
+
+// maximum number of buffers that can be registered to a ring
+#define HIW_URING_MAX_BUFFERS (8)
+
+/**
+ * @brief An io_uring instance. A ring is not thread-safe and is expected to be owned by one thread only
+ */
+typedef struct hiw_uring hiw_uring;
+
+/**
+ * @brief Create a new ring
+ * @param entries The number of submission queue entries
+ * @return A new ring; NULL if io_uring is not supported by the platform or the kernel
+ */
+HIW_PUBLIC extern hiw_uring* hiw_uring_new(unsigned int entries);
+
+/**
+ * @brief Delete the supplied ring. Sockets that are accepted, but not yet returned by hiw_uring_accept, are closed
+ * @param r The ring
+ */
+HIW_PUBLIC extern void hiw_uring_delete(hiw_uring* r);
+
+/**
+ * @brief Register memory buffers with the ring. Receiving into, or sending from, registered memory avoids
+ *        mapping the memory for each operation
+ * @param r The ring
+ * @param buffers The buffers
+ * @param count The number of buffers
+ * @return true if the buffers are registered
+ *
+ * The memory must be kept alive for as long as the ring is alive
+ */
+HIW_PUBLIC extern bool hiw_uring_register_buffers(hiw_uring* r, const hiw_memory_view* buffers, int count);
+
+/**
+ * @brief Accept a new client socket. A multishot accept is armed on the server socket while the ring is waiting,
+ *        so that connections arriving in a burst are accepted with one submission
+ * @param r The ring
+ * @param server_socket The listening server socket
+ * @param timeout The timeout, in milliseconds. 0 is infinite
+ * @return The client socket; INVALID_SOCKET if the accept failed or timed out
+ */
+HIW_PUBLIC extern SOCKET hiw_uring_accept(hiw_uring* r, SOCKET server_socket, unsigned int timeout);
+
+/**
+ * @brief Receive bytes from the supplied socket
+ * @param r The ring
+ * @param s The socket
+ * @param dest The destination buffer
+ * @param len The maximum number of bytes to receive
+ * @param timeout The timeout, in milliseconds. 0 is infinite
+ * @return The number of bytes received; -1 if the receive failed
+ */
+HIW_PUBLIC extern int hiw_uring_recv(hiw_uring* r, SOCKET s, char* dest, int len, unsigned int timeout);
+
+/**
+ * @brief Send bytes to the supplied socket
+ * @param r The ring
+ * @param s The socket
+ * @param src The source buffer
+ * @param len The number of bytes to send
+ * @param timeout The timeout, in milliseconds. 0 is infinite
+ * @return The number of bytes sent; -1 if the send failed
+ */
+HIW_PUBLIC extern int hiw_uring_send(hiw_uring* r, SOCKET s, const char* src, int len, unsigned int timeout);
+
+/**
+ * @brief Send the content of multiple memory blocks with one operation
+ * @param r The ring
+ * @param s The socket
+ * @param views The memory blocks to send
+ * @param count The number of memory blocks. At most HIW_SOCKET_MAX_SEND_VIEWS
+ * @param more true if more data is sent right after this call
+ * @param timeout The timeout, in milliseconds. 0 is infinite
+ * @return The number of bytes sent; -1 if the send failed
+ */
+HIW_PUBLIC extern int hiw_uring_sendv(hiw_uring* r, SOCKET s, const hiw_memory_view* views, int count, bool more,
+									  unsigned int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // hiw_URING_H
@@ -0,0 +1,432 @@
+//
+// Part of the highway project, under the MIT License
+// See the LICENSE file in the project root for license terms
+//
+
+#include "hiw_fiber.h"
+#include "hiw_logger.h"
+#include <assert.h>
+
+// The context switch is hand-written on x86-64 and aarch64. Other platforms fall back to ucontext, which is also used
+// if HIW_FIBER_UCONTEXT is defined. Windows has native fibers
+#if defined(HIW_WINDOWS)
+#define HIW_FIBER_WINDOWS 1
+#elif !defined(HIW_FIBER_UCONTEXT) && defined(__x86_64__)
+#define HIW_FIBER_X86_64 1
+#elif !defined(HIW_FIBER_UCONTEXT) && defined(__aarch64__)
+#define HIW_FIBER_AARCH64 1
+#elif !defined(HIW_FIBER_UCONTEXT)
+#define HIW_FIBER_UCONTEXT 1
+#endif
+
+#if defined(HIW_WINDOWS)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(HIW_FIBER_UCONTEXT)
+#include <ucontext.h>
+#endif
+
+/**
+ * Fiber instance
+ */
+struct hiw_fiber
+{
+#if defined(HIW_FIBER_WINDOWS)
+	// The native fiber
+	LPVOID handle;
+
+	// The native fiber of the thread, or fiber, that resumed this fiber
+	LPVOID caller;
+#elif defined(HIW_FIBER_UCONTEXT)
+	// The context of the fiber, while it's suspended
+	ucontext_t context;
+
+	// The context of the thread that resumed the fiber, while the fiber is running
+	ucontext_t caller;
+#else
+	// The stack pointer of the fiber, while it's suspended. The registers are saved on the fiber's stack
+	void* sp;
+
+	// The stack pointer of the thread that resumed the fiber, while the fiber is running
+	void* caller_sp;
+#endif
+
+	// The memory of the fiber's stack, including the guard page. NULL if the stack is owned by the operating system
+	char* stack;
+
+	// The number of bytes in the stack memory
+	size_t stack_size;
+
+	// The function called when the fiber is resumed for the first time
+	hiw_fiber_fn func;
+
+	// User-data associated with the fiber
+	void* data;
+
+	// The fiber that was running when this fiber was resumed. NULL if it was resumed by the thread itself
+	hiw_fiber* parent;
+
+	// Has the fiber's function returned
+	bool done;
+
+	// Is the fiber suspended while waiting for a socket
+	bool waiting;
+
+	// Has the wait timed out
+	bool timed_out;
+
+	// The socket the fiber is waiting for
+	SOCKET wait_socket;
+
+	// Is the fiber waiting for the socket to become writable
+	bool wait_write;
+
+	// The timeout of the wait, in milliseconds. 0 is infinite
+	unsigned int wait_timeout;
+};
+
+// The fiber running on the calling thread. NULL if the thread is not running a fiber
+static _Thread_local hiw_fiber* hiw_fiber_running = NULL;
+
+#if defined(HIW_FIBER_WINDOWS)
+// The native fiber of the thread, which is created the first time the thread resumes a fiber
+static _Thread_local LPVOID hiw_fiber_thread = NULL;
+#endif
+
+#if defined(HIW_FIBER_X86_64) || defined(HIW_FIBER_AARCH64)
+
+#if defined(__APPLE__)
+#define HIW_FIBER_ASM_NAME(name) "_" name
+#define HIW_FIBER_ASM_DECL(name) ".globl _" name "\n.private_extern _" name "\n"
+#else
+#define HIW_FIBER_ASM_NAME(name) name
+#define HIW_FIBER_ASM_DECL(name) ".globl " name "\n.hidden " name "\n.type " name ", %function\n"
+#endif
+
+/**
+ * @brief Save the callee-saved registers of the calling context on it's stack and restore the registers of another
+ *        context from it's stack
+ * @param from Where to put the stack pointer of the calling context
+ * @param to The stack pointer of the context to switch to
+ */
+extern void hiw_internal_fiber_switch(void** from, void* to);
+
+#if defined(HIW_FIBER_X86_64)
+
+// The sse and x87 control words, six callee-saved registers and the return address
+#define HIW_FIBER_FRAME_SIZE (64)
+
+// Offset of the return address in a saved frame
+#define HIW_FIBER_FRAME_RETURN (56)
+
+// Bytes above the first frame of a new fiber, so that the stack is aligned as if hiw_internal_fiber_main was called
+#define HIW_FIBER_FRAME_PADDING (8)
+
+__asm__(".text\n" HIW_FIBER_ASM_DECL("hiw_internal_fiber_switch") HIW_FIBER_ASM_NAME("hiw_internal_fiber_switch") ":\n"
+		"	pushq %rbp\n"
+		"	pushq %rbx\n"
+		"	pushq %r12\n"
+		"	pushq %r13\n"
+		"	pushq %r14\n"
+		"	pushq %r15\n"
+		"	subq $8, %rsp\n"
+		"	stmxcsr (%rsp)\n"
+		"	fnstcw 4(%rsp)\n"
+		"	movq %rsp, (%rdi)\n"
+		"	movq %rsi, %rsp\n"
+		"	ldmxcsr (%rsp)\n"
+		"	fldcw 4(%rsp)\n"
+		"	addq $8, %rsp\n"
+		"	popq %r15\n"
+		"	popq %r14\n"
+		"	popq %r13\n"
+		"	popq %r12\n"
+		"	popq %rbx\n"
+		"	popq %rbp\n"
+		"	ret\n");
+
+#else
+
+// Twelve general purpose registers, including the frame pointer and the link register, and eight floating point
+// registers. Rounded up to keep the stack 16-byte aligned
+#define HIW_FIBER_FRAME_SIZE (176)
+
+// Offset of the link register in a saved frame
+#define HIW_FIBER_FRAME_RETURN (88)
+
+// Bytes above the first frame of a new fiber. The link register is not pushed, so the stack is already aligned
+#define HIW_FIBER_FRAME_PADDING (0)
+
+__asm__(".text\n" HIW_FIBER_ASM_DECL("hiw_internal_fiber_switch") HIW_FIBER_ASM_NAME("hiw_internal_fiber_switch") ":\n"
+		"	sub sp, sp, #176\n"
+		"	stp x19, x20, [sp, #0]\n"
+		"	stp x21, x22, [sp, #16]\n"
+		"	stp x23, x24, [sp, #32]\n"
+		"	stp x25, x26, [sp, #48]\n"
+		"	stp x27, x28, [sp, #64]\n"
+		"	stp x29, x30, [sp, #80]\n"
+		"	stp d8, d9, [sp, #96]\n"
+		"	stp d10, d11, [sp, #112]\n"
+		"	stp d12, d13, [sp, #128]\n"
+		"	stp d14, d15, [sp, #144]\n"
+		"	mov x9, sp\n"
+		"	str x9, [x0]\n"
+		"	mov sp, x1\n"
+		"	ldp x19, x20, [sp, #0]\n"
+		"	ldp x21, x22, [sp, #16]\n"
+		"	ldp x23, x24, [sp, #32]\n"
+		"	ldp x25, x26, [sp, #48]\n"
+		"	ldp x27, x28, [sp, #64]\n"
+		"	ldp x29, x30, [sp, #80]\n"
+		"	ldp d8, d9, [sp, #96]\n"
+		"	ldp d10, d11, [sp, #112]\n"
+		"	ldp d12, d13, [sp, #128]\n"
+		"	ldp d14, d15, [sp, #144]\n"
+		"	add sp, sp, #176\n"
+		"	ret\n");
+
+#endif
+#endif
+
+/**
+ * @brief Switch from the supplied fiber back to the thread, or fiber, that resumed it
+ * @param f The running fiber
+ */
+void hiw_internal_fiber_suspend(hiw_fiber* const f)
+{
+#if defined(HIW_FIBER_WINDOWS)
+	SwitchToFiber(f->caller);
+#elif defined(HIW_FIBER_UCONTEXT)
+	swapcontext(&f->context, &f->caller);
+#else
+	hiw_internal_fiber_switch(&f->sp, f->caller_sp);
+#endif
+}
+
+/**
+ * @brief The first function called on the stack of a new fiber. The fiber's function is called again each time the
+ *        fiber is resumed after it's reset, so this function never returns
+ */
+void hiw_internal_fiber_main()
+{
+	hiw_fiber* const f = hiw_fiber_running;
+	while (1)
+	{
+		f->func(f);
+		f->done = true;
+		hiw_internal_fiber_suspend(f);
+	}
+}
+
+#if defined(HIW_FIBER_WINDOWS)
+VOID CALLBACK hiw_internal_fiber_proc(LPVOID param)
+{
+	(void)param;
+	hiw_internal_fiber_main();
+}
+#endif
+
+hiw_fiber* hiw_fiber_new(const hiw_fiber_fn func, void* const data, int stack_size)
+{
+	assert(func != NULL && "expected 'func' to exist");
+	if (stack_size <= 0)
+		stack_size = HIW_FIBER_DEFAULT_STACK_SIZE;
+	if (stack_size < HIW_FIBER_MIN_STACK_SIZE)
+		stack_size = HIW_FIBER_MIN_STACK_SIZE;
+
+	hiw_fiber* const f = hiw_malloc(sizeof(hiw_fiber));
+	f->func = func;
+	f->data = data;
+	f->parent = NULL;
+	f->done = false;
+	f->waiting = false;
+	f->timed_out = false;
+	f->wait_socket = INVALID_SOCKET;
+	f->wait_write = false;
+	f->wait_timeout = 0;
+
+#if defined(HIW_FIBER_WINDOWS)
+	f->stack = NULL;
+	f->stack_size = 0;
+	f->caller = NULL;
+	f->handle = CreateFiber(stack_size, hiw_internal_fiber_proc, f);
+	if (f->handle == NULL)
+	{
+		log_errorf("could not create fiber: error(%lu)", GetLastError());
+		free(f);
+		return NULL;
+	}
+#else
+	// The stack is mapped with a guard page below it, so that a stack overflow crashes instead of overwriting memory
+	// that belongs to someone else. The pages are only committed when they are used
+	const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	f->stack_size = (((size_t)stack_size + page_size - 1) & ~(page_size - 1)) + page_size;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_STACK)
+	flags |= MAP_STACK;
+#endif
+	f->stack = mmap(NULL, f->stack_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (f->stack == MAP_FAILED)
+	{
+		log_errorf("could not allocate fiber stack: error(%d)", errno);
+		free(f);
+		return NULL;
+	}
+	mprotect(f->stack, page_size, PROT_NONE);
+
+#if defined(HIW_FIBER_UCONTEXT)
+	getcontext(&f->context);
+	f->context.uc_stack.ss_sp = f->stack + page_size;
+	f->context.uc_stack.ss_size = f->stack_size - page_size;
+	f->context.uc_link = NULL;
+	makecontext(&f->context, hiw_internal_fiber_main, 0);
+#else
+	// The first switch to the fiber restores an empty frame and returns into hiw_internal_fiber_main, as if it was
+	// called from the top of the stack
+	char* const top = (char*)((uintptr_t)(f->stack + f->stack_size) & ~(uintptr_t)15);
+	char* const frame = top - HIW_FIBER_FRAME_SIZE - HIW_FIBER_FRAME_PADDING;
+	memset(frame, 0, HIW_FIBER_FRAME_SIZE + HIW_FIBER_FRAME_PADDING);
+	*(void**)(frame + HIW_FIBER_FRAME_RETURN) = (void*)hiw_internal_fiber_main;
+#if defined(HIW_FIBER_X86_64)
+	// Default sse control and status register and x87 control word
+	*(unsigned int*)frame = 0x1F80;
+	*(unsigned short*)(frame + 4) = 0x037F;
+#endif
+	f->sp = frame;
+	f->caller_sp = NULL;
+#endif
+#endif
+
+	log_debugf("hiw_fiber(%p) created with a %d bytes stack", f, stack_size);
+	return f;
+}
+
+void hiw_fiber_delete(hiw_fiber* const f)
+{
+	assert(f != NULL && "expected 'f' to exist");
+	assert(f != hiw_fiber_running && "expected 'f' to not be running");
+	if (f == NULL || f == hiw_fiber_running)
+		return;
+#if defined(HIW_FIBER_WINDOWS)
+	DeleteFiber(f->handle);
+#else
+	munmap(f->stack, f->stack_size);
+#endif
+	free(f);
+}
+
+void hiw_fiber_reset(hiw_fiber* const f, const hiw_fiber_fn func, void* const data)
+{
+	assert(f != NULL && "expected 'f' to exist");
+	assert(f->done && "expected 'f' to be done");
+	assert(func != NULL && "expected 'func' to exist");
+	if (f == NULL || !f->done)
+		return;
+	f->func = func;
+	f->data = data;
+	f->done = false;
+	f->waiting = false;
+	f->timed_out = false;
+}
+
+bool hiw_fiber_resume(hiw_fiber* const f)
+{
+	assert(f != NULL && "expected 'f' to exist");
+	assert(!f->done && "expected 'f' to not be done");
+	if (f == NULL || f->done)
+		return true;
+
+	f->parent = hiw_fiber_running;
+	hiw_fiber_running = f;
+#if defined(HIW_FIBER_WINDOWS)
+	if (f->parent != NULL)
+	{
+		f->caller = f->parent->handle;
+	}
+	else
+	{
+		if (hiw_fiber_thread == NULL)
+			hiw_fiber_thread = IsThreadAFiber() ? GetCurrentFiber() : ConvertThreadToFiber(NULL);
+		f->caller = hiw_fiber_thread;
+	}
+	SwitchToFiber(f->handle);
+#elif defined(HIW_FIBER_UCONTEXT)
+	swapcontext(&f->caller, &f->context);
+#else
+	hiw_internal_fiber_switch(&f->caller_sp, f->sp);
+#endif
+	hiw_fiber_running = f->parent;
+	f->parent = NULL;
+	return f->done;
+}
+
+void hiw_fiber_yield()
+{
+	hiw_fiber* const f = hiw_fiber_running;
+	assert(f != NULL && "expected to be called from a fiber");
+	if (f == NULL)
+		return;
+	f->waiting = false;
+	hiw_internal_fiber_suspend(f);
+}
+
+bool hiw_fiber_wait(const SOCKET s, const bool write, const unsigned int timeout)
+{
+	// The thread itself has no scheduler to yield to, so it blocks instead
+	hiw_fiber* const f = hiw_fiber_running;
+	if (f == NULL)
+		return hiw_socket_wait(s, write, timeout);
+
+	f->wait_socket = s;
+	f->wait_write = write;
+	f->wait_timeout = timeout;
+	f->timed_out = false;
+	f->waiting = true;
+	hiw_internal_fiber_suspend(f);
+	f->waiting = false;
+	return !f->timed_out;
+}
+
+bool hiw_fiber_get_wait(const hiw_fiber* const f, SOCKET* const s, bool* const write, unsigned int* const timeout)
+{
+	assert(f != NULL && "expected 'f' to exist");
+	if (f == NULL || !f->waiting)
+		return false;
+	*s = f->wait_socket;
+	*write = f->wait_write;
+	*timeout = f->wait_timeout;
+	return true;
+}
+
+void hiw_fiber_timeout(hiw_fiber* const f)
+{
+	assert(f != NULL && "expected 'f' to exist");
+	if (f == NULL)
+		return;
+	f->timed_out = true;
+}
+
+hiw_fiber* hiw_fiber_current() { return hiw_fiber_running; }
+
+void* hiw_fiber_get_data(const hiw_fiber* const f)
+{
+	assert(f != NULL && "expected 'f' to exist");
+	if (f == NULL)
+		return NULL;
+	return f->data;
+}
+
+bool hiw_fiber_is_done(const hiw_fiber* const f)
+{
+	assert(f != NULL && "expected 'f' to exist");
+	if (f == NULL)
+		return true;
+	return f->done;
+}
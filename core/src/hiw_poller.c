@@ -0,0 +1,152 @@
+//
+// Part of the highway project, under the MIT License
+// See the LICENSE file in the project root for license terms
+//
+
+#include "hiw_poller.h"
+#include "hiw_logger.h"
+#include <assert.h>
+#include <errno.h>
+
+#if defined(HIW_LINUX)
+#include <sys/epoll.h>
+#endif
+
+// maximum number of events fetched from the OS in one call
+#define HIW_POLLER_MAX_EVENTS (64)
+
+/**
+ * Poller instance
+ */
+struct hiw_poller
+{
+#if defined(HIW_LINUX)
+	// the epoll file descriptor
+	int fd;
+#endif
+};
+
+#if defined(HIW_LINUX)
+
+/**
+ * @brief Convert highway poller flags into epoll flags
+ */
+unsigned int hiw_internal_poller_to_epoll(const int flags)
+{
+	unsigned int events = EPOLLRDHUP;
+	if (hiw_bit_test(flags, hiw_poller_flags_read))
+		events |= EPOLLIN;
+	if (hiw_bit_test(flags, hiw_poller_flags_write))
+		events |= EPOLLOUT;
+	if (hiw_bit_test(flags, hiw_poller_flags_oneshot))
+		events |= EPOLLONESHOT;
+	if (hiw_bit_test(flags, hiw_poller_flags_exclusive))
+	{
+		// EPOLLRDHUP is not allowed together with EPOLLEXCLUSIVE
+		events &= ~EPOLLRDHUP;
+		events |= EPOLLEXCLUSIVE;
+	}
+	return events;
+}
+
+hiw_poller* hiw_poller_new()
+{
+	const int fd = epoll_create1(EPOLL_CLOEXEC);
+	if (fd < 0)
+	{
+		log_errorf("could not create poller: error(%d)", errno);
+		return NULL;
+	}
+
+	hiw_poller* const p = hiw_malloc(sizeof(hiw_poller));
+	p->fd = fd;
+	return p;
+}
+
+void hiw_poller_delete(hiw_poller* const p)
+{
+	assert(p != NULL && "expected 'p' to exist");
+	if (p == NULL)
+		return;
+	close(p->fd);
+	free(p);
+}
+
+bool hiw_poller_add(hiw_poller* const p, const SOCKET s, const int flags, void* const data)
+{
+	struct epoll_event ev = {.events = hiw_internal_poller_to_epoll(flags), .data.ptr = data};
+	if (epoll_ctl(p->fd, EPOLL_CTL_ADD, s, &ev) < 0)
+	{
+		log_errorf("could not add socket to poller: error(%d)", errno);
+		return false;
+	}
+	return true;
+}
+
+bool hiw_poller_modify(hiw_poller* const p, const SOCKET s, const int flags, void* const data)
+{
+	struct epoll_event ev = {.events = hiw_internal_poller_to_epoll(flags), .data.ptr = data};
+	if (epoll_ctl(p->fd, EPOLL_CTL_MOD, s, &ev) < 0)
+	{
+		log_errorf("could not modify socket in poller: error(%d)", errno);
+		return false;
+	}
+	return true;
+}
+
+void hiw_poller_remove(hiw_poller* const p, const SOCKET s)
+{
+	// the socket might already be removed automatically if it was closed
+	epoll_ctl(p->fd, EPOLL_CTL_DEL, s, NULL);
+}
+
+int hiw_poller_wait(hiw_poller* const p, hiw_poller_event* const events, int n, const int timeout)
+{
+	struct epoll_event os_events[HIW_POLLER_MAX_EVENTS];
+	if (n > HIW_POLLER_MAX_EVENTS)
+		n = HIW_POLLER_MAX_EVENTS;
+
+	const int count = epoll_wait(p->fd, os_events, n, timeout);
+	if (count < 0)
+	{
+		// a signal interrupted the wait, which is the same as a timeout
+		if (errno == EINTR)
+			return 0;
+		log_errorf("could not wait for poller events: error(%d)", errno);
+		return -1;
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		const unsigned int os_flags = os_events[i].events;
+		int flags = 0;
+		if (os_flags & EPOLLIN)
+			flags |= hiw_poller_flags_read;
+		if (os_flags & EPOLLOUT)
+			flags |= hiw_poller_flags_write;
+		if (os_flags & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+			flags |= hiw_poller_flags_hangup;
+		events[i] = (hiw_poller_event){.data = os_events[i].data.ptr, .flags = flags};
+	}
+	return count;
+}
+
+#else
+
+hiw_poller* hiw_poller_new()
+{
+	log_error("hiw_poller is not supported on this platform");
+	return NULL;
+}
+
+void hiw_poller_delete(hiw_poller* const p) { free(p); }
+
+bool hiw_poller_add(hiw_poller* const p, const SOCKET s, const int flags, void* const data) { return false; }
+
+bool hiw_poller_modify(hiw_poller* const p, const SOCKET s, const int flags, void* const data) { return false; }
+
+void hiw_poller_remove(hiw_poller* const p, const SOCKET s) {}
+
+int hiw_poller_wait(hiw_poller* const p, hiw_poller_event* const events, const int n, const int timeout) { return -1; }
+
+#endif
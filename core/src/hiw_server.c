@@ -4,9 +4,39 @@
 //
 
 #include "hiw_server.h"
+#include "hiw_fiber.h"
 #include "hiw_logger.h"
 #include <assert.h>
 #include <hiw_thread.h>
+#include <string.h>
+
+// number of buckets in the table used when counting connections per ip address
+#if !defined(HIW_SERVER_IP_BUCKETS)
+#define HIW_SERVER_IP_BUCKETS (256)
+#endif
+
+/**
+ * Number of connections from one ip address
+ */
+typedef struct hiw_server_ip hiw_server_ip;
+
+struct hiw_server_ip
+{
+	// the address family; AF_INET or AF_INET6
+	int family;
+
+	// the address. Only the first 4 bytes are used by an ipv4 address
+	unsigned char addr[16];
+
+	// number of connections from the address
+	int count;
+
+	// the bucket containing the address
+	int bucket;
+
+	// the next address in the same bucket
+	hiw_server_ip* next;
+};
 
 /**
  * Server instance
@@ -19,11 +49,41 @@ struct hiw_server
 	// Server socket
 	SOCKET socket;
 
+	// Additional server sockets listening on the same port. Each shard has it's own accept queue
+	SOCKET* shards;
+
+	// Number of additional server sockets
+	int shard_count;
+
 	// Server is running?
 	atomic_bool running;
 
 	// user data associated with the server
 	void* userdata;
+
+	// are the connections limited. The lock and the admission state below are only used if true
+	bool limited;
+
+	// Number of connections that are currently open
+	atomic_int connections;
+
+	// Number of rejected clients
+	atomic_ullong rejected;
+
+	// Number of evicted connections
+	atomic_ullong evicted;
+
+	// protects the connection counters per ip address and the idle clients
+	hiw_thread_critical_sec* lock;
+
+	// connections per ip address, if the connections per ip address are limited
+	hiw_server_ip* ips[HIW_SERVER_IP_BUCKETS];
+
+	// the client that has been idle for the longest time
+	hiw_client* idle_first;
+
+	// the client that became idle most recently
+	hiw_client* idle_last;
 };
 
 /**
@@ -37,8 +97,51 @@ struct hiw_client
 	// ip version used by the client
 	hiw_socket_ip_version ip_version;
 
-	// the address to the client
+	// timeout used when waiting for data on a non-blocking socket
+	unsigned int read_timeout;
+
+	// timeout used when waiting to write data on a non-blocking socket
+	unsigned int write_timeout;
+
+	// when receiving data fails, in milliseconds as returned by hiw_timer_now. 0 if there's no deadline
+	unsigned long long read_deadline;
+
+	// when sending data fails, in milliseconds as returned by hiw_timer_now. 0 if there's no deadline
+	unsigned long long write_deadline;
+
+	// is the client socket non-blocking
+	bool nonblocking;
+
+	// are zero-copy sends enabled on the socket. 0 if not tried yet and -1 if not supported
+	int zerocopy;
+
+	// the ring used when receiving and sending data. NULL if the socket functions are used directly
+	hiw_uring* uring;
+
+	// the address of the client, as returned when the client was accepted. The address family is AF_UNSPEC if the
+	// address is not known
+	hiw_socket_addr addr;
+
+	// the address to the client. Formatted the first time it's requested
 	char address[INET6_ADDRSTRLEN];
+
+	// the server that has accepted the client. NULL when the connection is no longer counted by the server
+	hiw_server* server;
+
+	// the connections from the same ip address. NULL if not counted
+	hiw_server_ip* ip;
+
+	// is the client in the server's list of idle clients
+	bool idle;
+
+	// the client that became idle before this client
+	hiw_client* idle_prev;
+
+	// the client that became idle after this client
+	hiw_client* idle_next;
+
+	// the next client in a client cache
+	hiw_client* next;
 };
 
 bool hiw_server_is_error(hiw_server_error err) { return err != HIW_SERVER_ERROR_SUCCESS; }
@@ -49,7 +152,17 @@ hiw_server* hiw_server_new(const hiw_server_config* config)
 	impl->config = *config;
 	impl->userdata = NULL;
 	impl->socket = INVALID_SOCKET;
+	impl->shards = NULL;
+	impl->shard_count = 0;
 	impl->running = false;
+	impl->limited = config->max_connections > 0 || config->max_connections_per_ip > 0;
+	impl->connections = 0;
+	impl->rejected = 0;
+	impl->evicted = 0;
+	impl->lock = impl->limited ? hiw_thread_critical_sec_new() : NULL;
+	for (int i = 0; i < HIW_SERVER_IP_BUCKETS; ++i)
+		impl->ips[i] = NULL;
+	impl->idle_first = impl->idle_last = NULL;
 	return impl;
 }
 
@@ -71,6 +184,14 @@ hiw_server_error hiw_server_start(hiw_server* s)
 	return HIW_SERVER_ERROR_SUCCESS;
 }
 
+const hiw_server_config* hiw_server_get_config(const hiw_server* const s)
+{
+	assert(s != NULL && "expected 's' to exist");
+	if (s == NULL)
+		return NULL;
+	return &s->config;
+}
+
 void* hiw_server_get_userdata(const hiw_server* const s)
 {
 	assert(s != NULL && "expected 's' to exist");
@@ -104,6 +225,10 @@ void hiw_server_stop(hiw_server* const s)
 			hiw_socket_close(s->socket);
 			s->socket = INVALID_SOCKET;
 		}
+
+		// Wake up everyone waiting for new clients on the shards. The shards are released when the server is deleted
+		for (int i = 0; i < s->shard_count; ++i)
+			hiw_socket_close(s->shards[i]);
 	}
 	log_debugf("hiw_server(%p) highway server stopped", s);
 }
@@ -120,6 +245,21 @@ void hiw_server_delete(hiw_server* const s)
 		hiw_socket_close(s->socket);
 		s->socket = INVALID_SOCKET;
 	}
+	for (int i = 0; i < s->shard_count; ++i)
+		hiw_socket_release(s->shards[i]);
+	if (s->shards != NULL)
+		free(s->shards);
+	for (int i = 0; i < HIW_SERVER_IP_BUCKETS; ++i)
+	{
+		while (s->ips[i] != NULL)
+		{
+			hiw_server_ip* const next = s->ips[i]->next;
+			free(s->ips[i]);
+			s->ips[i] = next;
+		}
+	}
+	if (s->lock != NULL)
+		hiw_thread_critical_sec_delete(s->lock);
 	free(s);
 }
 
@@ -131,7 +271,273 @@ bool hiw_server_is_running(hiw_server* const s)
 	return s->running;
 }
 
-hiw_client* hiw_server_accept(hiw_server* const s)
+hiw_server_stats hiw_server_get_stats(hiw_server* const s)
+{
+	assert(s != NULL && "expected 's' to exist");
+	if (s == NULL)
+		return (hiw_server_stats){.connections = 0, .rejected = 0, .evicted = 0};
+	return (hiw_server_stats){.connections = s->connections, .rejected = s->rejected, .evicted = s->evicted};
+}
+
+/**
+ * Get the connections from the supplied address. The address is added if there are no connections from it yet. Must
+ * be called while holding the server's lock
+ *
+ * @param s the server
+ * @param addr the address
+ * @return the connections from the address; NULL if the address is not an ip address
+ */
+hiw_server_ip* hiw_internal_server_ip_get(hiw_server* const s, const hiw_socket_addr* const addr)
+{
+	const unsigned char* bytes;
+	int len;
+	if (addr->ss_family == AF_INET)
+	{
+		bytes = (const unsigned char*)&((const struct sockaddr_in*)addr)->sin_addr;
+		len = 4;
+	}
+	else if (addr->ss_family == AF_INET6)
+	{
+		bytes = (const unsigned char*)&((const struct sockaddr_in6*)addr)->sin6_addr;
+		len = 16;
+	}
+	else
+	{
+		return NULL;
+	}
+
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < len; ++i)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	const int bucket = (int)(hash % HIW_SERVER_IP_BUCKETS);
+
+	for (hiw_server_ip* ip = s->ips[bucket]; ip != NULL; ip = ip->next)
+	{
+		if (ip->family == addr->ss_family && memcmp(ip->addr, bytes, len) == 0)
+			return ip;
+	}
+
+	hiw_server_ip* const ip = hiw_malloc(sizeof(hiw_server_ip));
+	ip->family = addr->ss_family;
+	memset(ip->addr, 0, sizeof(ip->addr));
+	memcpy(ip->addr, bytes, len);
+	ip->count = 0;
+	ip->bucket = bucket;
+	ip->next = s->ips[bucket];
+	s->ips[bucket] = ip;
+	return ip;
+}
+
+/**
+ * Remove the supplied address from the table if there are no more connections from it. Must be called while holding
+ * the server's lock
+ *
+ * @param s the server
+ * @param ip the connections from the address
+ */
+void hiw_internal_server_ip_remove_unused(hiw_server* const s, hiw_server_ip* const ip)
+{
+	if (ip->count > 0)
+		return;
+	for (hiw_server_ip** link = &s->ips[ip->bucket]; *link != NULL; link = &(*link)->next)
+	{
+		if (*link == ip)
+		{
+			*link = ip->next;
+			free(ip);
+			return;
+		}
+	}
+}
+
+/**
+ * Remove the supplied client from the server's list of idle clients. Must be called while holding the server's lock
+ *
+ * @param s the server
+ * @param c the client
+ */
+void hiw_internal_server_idle_unlink(hiw_server* const s, hiw_client* const c)
+{
+	if (c->idle_prev != NULL)
+		c->idle_prev->idle_next = c->idle_next;
+	else
+		s->idle_first = c->idle_next;
+	if (c->idle_next != NULL)
+		c->idle_next->idle_prev = c->idle_prev;
+	else
+		s->idle_last = c->idle_prev;
+	c->idle_prev = c->idle_next = NULL;
+	c->idle = false;
+}
+
+/**
+ * Shut down the connection that has been idle for the longest time. The connection is still counted until it's owner
+ * has closed it. Must be called while holding the server's lock
+ *
+ * @param s the server
+ * @param ip only evict a connection from this address; NULL to evict a connection from any address
+ * @return true if a connection was evicted
+ */
+bool hiw_internal_server_evict(hiw_server* const s, const hiw_server_ip* const ip)
+{
+	for (hiw_client* c = s->idle_first; c != NULL; c = c->idle_next)
+	{
+		if (ip != NULL && c->ip != ip)
+			continue;
+		log_debugf("hiw_server(%p) evicting idle client %p", s, c);
+		hiw_internal_server_idle_unlink(s, c);
+		hiw_socket_close(c->socket);
+		s->evicted++;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Decide if a newly accepted client is served. A rejected client is sent the overflow response and is then closed
+ *
+ * @param s the server
+ * @param client_socket the accepted socket
+ * @param addr the address of the client. The address is fetched from the socket if it's needed and the address family
+ *             is AF_UNSPEC
+ * @param ip set to the connections from the client's address; NULL if they are not counted
+ * @return true if the client is served
+ */
+bool hiw_internal_server_admit(hiw_server* const s, const SOCKET client_socket, hiw_socket_addr* const addr,
+							   hiw_server_ip** const ip)
+{
+	*ip = NULL;
+	if (!s->limited)
+	{
+		s->connections++;
+		return true;
+	}
+
+	const hiw_server_config* const config = &s->config;
+	if (config->max_connections_per_ip > 0 && addr->ss_family == AF_UNSPEC)
+	{
+		socklen_t len = sizeof(*addr);
+		if (getpeername(client_socket, (struct sockaddr*)addr, &len) < 0)
+			addr->ss_family = AF_UNSPEC;
+	}
+
+	const bool evict = config->overflow_policy == HIW_SERVER_OVERFLOW_EVICT_IDLE;
+	bool admitted = true;
+	bool evicted = false;
+	hiw_thread_critical_sec_enter(s->lock);
+	hiw_server_ip* const client_ip =
+		config->max_connections_per_ip > 0 ? hiw_internal_server_ip_get(s, addr) : NULL;
+	if (client_ip != NULL && client_ip->count >= config->max_connections_per_ip)
+		admitted = evicted = evict && hiw_internal_server_evict(s, client_ip);
+
+	// Evicting a connection from the same address also makes room for the new client in total
+	if (admitted && !evicted && config->max_connections > 0 && s->connections >= config->max_connections)
+		admitted = evict && hiw_internal_server_evict(s, NULL);
+
+	if (admitted)
+	{
+		s->connections++;
+		if (client_ip != NULL)
+			client_ip->count++;
+		*ip = client_ip;
+	}
+	else if (client_ip != NULL)
+	{
+		hiw_internal_server_ip_remove_unused(s, client_ip);
+	}
+	hiw_thread_critical_sec_exit(s->lock);
+
+	if (!admitted)
+	{
+		log_debugf("hiw_server(%p) too many connections, rejecting client", s);
+		s->rejected++;
+		if (config->overflow_response.length > 0)
+			hiw_socket_send(client_socket, config->overflow_response.begin, config->overflow_response.length);
+		hiw_socket_release(client_socket);
+	}
+	return admitted;
+}
+
+/**
+ * Stop counting the client's connection. Must be called before the client's socket is closed, so that the socket is
+ * never evicted after it's been reused by another connection
+ *
+ * @param c the client
+ */
+void hiw_internal_client_release(hiw_client* const c)
+{
+	hiw_server* const s = c->server;
+	if (s == NULL)
+		return;
+	c->server = NULL;
+	if (s->limited)
+	{
+		hiw_thread_critical_sec_enter(s->lock);
+		if (c->idle)
+			hiw_internal_server_idle_unlink(s, c);
+		if (c->ip != NULL)
+		{
+			c->ip->count--;
+			hiw_internal_server_ip_remove_unused(s, c->ip);
+			c->ip = NULL;
+		}
+		hiw_thread_critical_sec_exit(s->lock);
+	}
+	s->connections--;
+}
+
+/**
+ * Create a client for a newly accepted client socket
+ *
+ * @param s the server
+ * @param client_socket the accepted socket
+ * @param addr the address of the client; NULL if not known
+ * @param ip the connections from the client's address, as returned by hiw_internal_server_admit
+ * @param cache clients to reuse before allocating a new client. Can be NULL
+ * @return a new client
+ */
+hiw_client* hiw_internal_server_client_new(hiw_server* const s, const SOCKET client_socket,
+										   const hiw_socket_addr* const addr, hiw_server_ip* const ip,
+										   hiw_client_cache* const cache)
+{
+	hiw_client* client;
+	if (cache != NULL && cache->first != NULL)
+	{
+		client = cache->first;
+		cache->first = client->next;
+		cache->count--;
+	}
+	else
+	{
+		client = hiw_malloc(sizeof(hiw_client));
+	}
+
+	client->socket = client_socket;
+	client->ip_version = s->config.socket_config.ip_version;
+	client->read_timeout = s->config.socket_config.read_timeout;
+	client->write_timeout = s->config.socket_config.write_timeout;
+	client->read_deadline = 0;
+	client->write_deadline = 0;
+	client->nonblocking = false;
+	client->zerocopy = 0;
+	client->uring = NULL;
+	if (addr != NULL)
+		client->addr = *addr;
+	else
+		client->addr.ss_family = AF_UNSPEC;
+	client->address[0] = 0;
+	client->server = s;
+	client->ip = ip;
+	client->idle = false;
+	client->idle_prev = client->idle_next = NULL;
+	client->next = NULL;
+	return client;
+}
+
+hiw_client* hiw_server_accept(hiw_server* const s) { return hiw_server_accept_shard(s, 0, NULL); }
+
+hiw_client* hiw_server_accept_shard(hiw_server* const s, const int shard, hiw_client_cache* const cache)
 {
 	assert(s != NULL && "expected 's' to exist");
 	if (s == NULL)
@@ -142,36 +548,160 @@ hiw_client* hiw_server_accept(hiw_server* const s)
 		return NULL;
 	}
 
-	log_debugf("server(%p) accepting a new client", s);
-	hiw_socket_error err = HIW_SOCKET_ERROR_SUCCESS;
-	const SOCKET client_socket = hiw_socket_accept(s->socket, &s->config.socket_config, &err);
-	if (client_socket == INVALID_SOCKET)
+	log_debugf("server(%p) accepting a new client on shard %d", s, shard);
+	hiw_socket_addr addr;
+	hiw_server_ip* ip;
+	SOCKET client_socket;
+	do
 	{
-		log_debugf("hiw_server(%p) failed to accept socket", s);
+		hiw_socket_error err = HIW_SOCKET_ERROR_SUCCESS;
+		client_socket = hiw_socket_accept(hiw_server_get_shard_socket(s, shard), &s->config.socket_config, &addr, &err);
+		if (client_socket == INVALID_SOCKET)
+		{
+			// no pending connections on a non-blocking server socket is not an error
+			if (err != HIW_SOCKET_ERROR_WOULD_BLOCK)
+				log_debugf("hiw_server(%p) failed to accept socket", s);
+			return NULL;
+		}
+	} while (!hiw_internal_server_admit(s, client_socket, &addr, &ip));
+
+	return hiw_internal_server_client_new(s, client_socket, &addr, ip, cache);
+}
+
+hiw_client* hiw_server_accept_uring(hiw_server* const s, const int shard, hiw_uring* const ring,
+									hiw_client_cache* const cache)
+{
+	assert(s != NULL && "expected 's' to exist");
+	assert(ring != NULL && "expected 'ring' to exist");
+	if (s == NULL || ring == NULL)
+		return NULL;
+	if (s->running == false)
+	{
+		log_error("failed to accept client: server is shutting down");
 		return NULL;
 	}
 
-	hiw_client* const client = hiw_malloc(sizeof(hiw_client));
-	client->socket = client_socket;
-	client->ip_version = s->config.socket_config.ip_version;
+	log_debugf("server(%p) accepting a new client on shard %d using hiw_uring(%p)", s, shard, ring);
+	// The accept times out just like a blocking accept would, because of the read timeout set on the server socket
+	unsigned int timeout = s->config.socket_config.read_timeout;
+	if (timeout == 0 && s->config.socket_config.unix_path.length > 0)
+		timeout = HIW_URING_UNIX_ACCEPT_TIMEOUT;
+	// The address is not returned by a multishot accept. It's fetched from the socket if it's requested
+	hiw_socket_addr addr;
+	hiw_server_ip* ip;
+	SOCKET client_socket;
+	do
+	{
+		client_socket = hiw_uring_accept(ring, hiw_server_get_shard_socket(s, shard), timeout);
+		if (client_socket == INVALID_SOCKET)
+		{
+			log_debugf("hiw_server(%p) failed to accept socket", s);
+			return NULL;
+		}
+		addr.ss_family = AF_UNSPEC;
+	} while (!hiw_internal_server_admit(s, client_socket, &addr, &ip));
 
-	// get the actual IP address from the socket
-	if (s->config.socket_config.ip_version == HIW_SOCKET_IPV4)
+	hiw_socket_tune_client(client_socket, &s->config.socket_config);
+	hiw_client* const client = hiw_internal_server_client_new(s, client_socket, &addr, ip, cache);
+	client->uring = ring;
+	return client;
+}
+
+SOCKET hiw_server_get_socket(const hiw_server* const s)
+{
+	assert(s != NULL && "expected 's' to exist");
+	if (s == NULL)
+		return INVALID_SOCKET;
+	return s->socket;
+}
+
+hiw_server_error hiw_server_add_shards(hiw_server* const s, const int count)
+{
+	assert(s != NULL && "expected 's' to exist");
+	if (s == NULL)
+		return HIW_SERVER_ERROR_MEMORY;
+	if (s->running == false)
+		return HIW_SERVER_ERROR_SOCKET;
+
+	// Binding the same path again would replace the socket file, instead of sharing the incoming connections
+	if (s->config.socket_config.unix_path.length > 0)
 	{
-		struct sockaddr_in addr = {};
-		socklen_t len = sizeof(addr);
-		getpeername(client_socket, (struct sockaddr*)&addr, &len);
-		inet_ntop(AF_INET, &addr.sin_addr, client->address, sizeof(client->address));
+		log_warnf("hiw_server(%p) unix domain sockets can't be sharded", s);
+		return HIW_SERVER_ERROR_SOCKET;
 	}
-	else
+
+#if defined(SO_REUSEPORT)
+	SOCKET* const shards = realloc(s->shards, sizeof(SOCKET) * (s->shard_count + count));
+	if (shards == NULL)
+		return HIW_SERVER_ERROR_MEMORY;
+	s->shards = shards;
+
+	// The kernel distributes incoming connections over all sockets bound to the same port
+	for (int i = 0; i < count; ++i)
 	{
-		struct sockaddr_in6 addr = {};
-		socklen_t len = sizeof(addr);
-		getpeername(client_socket, (struct sockaddr*)&addr, &len);
-		inet_ntop(AF_INET6, &addr.sin6_addr, client->address, sizeof(client->address));
+		hiw_socket_error err;
+		const SOCKET shard = hiw_socket_listen(&s->config.socket_config, &err);
+		if (err != HIW_SOCKET_ERROR_SUCCESS)
+		{
+			log_errorf("hiw_server(%p) failed to add server socket shard", s);
+
+			// Shards that are listening will get clients assigned to them, so all shards must be accepted
+			// by someone. Remove the shards added by this call
+			for (int j = 0; j < i; ++j)
+				hiw_socket_release(s->shards[--s->shard_count]);
+			return HIW_SERVER_ERROR_SOCKET;
+		}
+		s->shards[s->shard_count++] = shard;
 	}
+	log_debugf("hiw_server(%p) added %d server socket shards", s, count);
+	return HIW_SERVER_ERROR_SUCCESS;
+#else
+	log_errorf("hiw_server(%p) server socket shards are not supported on this platform", s);
+	return HIW_SERVER_ERROR_SOCKET;
+#endif
+}
 
-	return client;
+hiw_server_error hiw_server_steer_shards(hiw_server* const s, const int* const cpus, const int count)
+{
+	assert(s != NULL && "expected 's' to exist");
+	assert(cpus != NULL && "expected 'cpus' to exist");
+	if (s == NULL || cpus == NULL || count <= 0)
+		return HIW_SERVER_ERROR_MEMORY;
+	if (s->running == false)
+		return HIW_SERVER_ERROR_SOCKET;
+
+	// The original server socket is the first socket that started listening on the port, followed by the shards in
+	// the order they were added
+	const int shard_count = s->shard_count + 1;
+	int* const shard_cpus = hiw_malloc(sizeof(int) * shard_count);
+	for (int i = 0; i < shard_count; ++i)
+		shard_cpus[i] = cpus[i % count];
+	const bool steered = hiw_socket_steer_by_cpu(s->socket, shard_cpus, shard_count);
+	free(shard_cpus);
+	if (!steered)
+		return HIW_SERVER_ERROR_SOCKET;
+
+	log_debugf("hiw_server(%p) steering new clients over %d server socket shards", s, shard_count);
+	return HIW_SERVER_ERROR_SUCCESS;
+}
+
+int hiw_server_get_shard_count(const hiw_server* const s)
+{
+	assert(s != NULL && "expected 's' to exist");
+	if (s == NULL)
+		return 0;
+	return s->shard_count + 1;
+}
+
+SOCKET hiw_server_get_shard_socket(const hiw_server* const s, const int shard)
+{
+	assert(s != NULL && "expected 's' to exist");
+	assert(shard >= 0 && shard <= s->shard_count && "expected 'shard' to be a valid shard");
+	if (s == NULL || shard < 0 || shard > s->shard_count)
+		return INVALID_SOCKET;
+	if (shard == 0)
+		return s->socket;
+	return s->shards[shard - 1];
 }
 
 const char* hiw_client_get_address(hiw_client* c)
@@ -179,17 +709,147 @@ const char* hiw_client_get_address(hiw_client* c)
 	assert(c != NULL && "expected 'c' to exist");
 	if (c == NULL)
 		return "";
+	if (c->address[0] != 0)
+		return c->address;
+
+	if (c->addr.ss_family == AF_UNSPEC)
+	{
+		socklen_t len = sizeof(c->addr);
+		if (getpeername(c->socket, (struct sockaddr*)&c->addr, &len) < 0)
+			c->addr.ss_family = AF_UNSPEC;
+	}
+
+	if (c->addr.ss_family == AF_INET)
+		inet_ntop(AF_INET, &((struct sockaddr_in*)&c->addr)->sin_addr, c->address, sizeof(c->address));
+	else if (c->addr.ss_family == AF_INET6)
+		inet_ntop(AF_INET6, &((struct sockaddr_in6*)&c->addr)->sin6_addr, c->address, sizeof(c->address));
+#if !defined(HIW_WINDOWS)
+	else if (c->addr.ss_family == AF_UNIX)
+		*hiw_std_copy0("unix", c->address, sizeof(c->address)) = 0;
+#endif
 	return c->address;
 }
 
+SOCKET hiw_client_get_socket(const hiw_client* const c)
+{
+	assert(c != NULL && "expected 'c' to exist");
+	if (c == NULL)
+		return INVALID_SOCKET;
+	return c->socket;
+}
+
+bool hiw_client_set_nonblocking(hiw_client* const c, const bool nonblocking)
+{
+	assert(c != NULL && "expected 'c' to exist");
+	if (c == NULL)
+		return false;
+	if (!hiw_socket_set_nonblocking(c->socket, nonblocking))
+		return false;
+	c->nonblocking = nonblocking;
+	return true;
+}
+
+void hiw_client_set_read_deadline(hiw_client* const c, const unsigned int timeout)
+{
+	assert(c != NULL && "expected 'c' to exist");
+	if (c == NULL)
+		return;
+	c->read_deadline = timeout > 0 ? hiw_timer_now() + timeout : 0;
+}
+
+void hiw_client_set_write_deadline(hiw_client* const c, const unsigned int timeout)
+{
+	assert(c != NULL && "expected 'c' to exist");
+	if (c == NULL)
+		return;
+	c->write_deadline = timeout > 0 ? hiw_timer_now() + timeout : 0;
+}
+
+/**
+ * Get the timeout to use when waiting for the socket, so that the wait never lasts longer than the deadline
+ *
+ * @param timeout the configured timeout. 0 is infinite
+ * @param deadline the deadline. 0 if there's no deadline
+ * @param result the timeout to use
+ * @return false if the deadline has passed
+ */
+bool hiw_internal_client_timeout(const unsigned int timeout, const unsigned long long deadline,
+								 unsigned int* const result)
+{
+	*result = timeout;
+	if (deadline == 0)
+		return true;
+	const unsigned long long now = hiw_timer_now();
+	if (now >= deadline)
+	{
+		log_debugf("deadline passed %llu ms ago", now - deadline);
+		return false;
+	}
+	const unsigned long long remaining = deadline - now;
+	if (timeout == 0 || remaining < timeout)
+		*result = (unsigned int)remaining;
+	return true;
+}
+
+/**
+ * Wait for the client's socket to become ready
+ *
+ * @param c the client
+ * @param write true if waiting for the socket to become writable
+ * @return false if the wait timed out or the deadline has passed
+ */
+bool hiw_internal_client_wait(const hiw_client* const c, const bool write)
+{
+	unsigned int timeout;
+	if (write ? !hiw_internal_client_timeout(c->write_timeout, c->write_deadline, &timeout)
+			  : !hiw_internal_client_timeout(c->read_timeout, c->read_deadline, &timeout))
+		return false;
+
+	// A fiber yields to it's scheduler instead of blocking the thread, which is then free to run other fibers
+	if (hiw_fiber_current() != NULL)
+		return hiw_fiber_wait(c->socket, write, timeout);
+	return hiw_socket_wait(c->socket, write, timeout);
+}
+
+void hiw_client_set_idle(hiw_client* const c, const bool idle)
+{
+	assert(c != NULL && "expected 'c' to exist");
+	if (c == NULL)
+		return;
+
+	// Only connections that might be evicted are kept track of
+	hiw_server* const s = c->server;
+	if (s == NULL || !s->limited || s->config.overflow_policy != HIW_SERVER_OVERFLOW_EVICT_IDLE)
+		return;
+
+	hiw_thread_critical_sec_enter(s->lock);
+	if (idle && !c->idle)
+	{
+		c->idle_prev = s->idle_last;
+		c->idle_next = NULL;
+		if (s->idle_last != NULL)
+			s->idle_last->idle_next = c;
+		else
+			s->idle_first = c;
+		s->idle_last = c;
+		c->idle = true;
+	}
+	else if (!idle && c->idle)
+	{
+		hiw_internal_server_idle_unlink(s, c);
+	}
+	hiw_thread_critical_sec_exit(s->lock);
+}
+
 void hiw_client_disconnect(hiw_client* c)
 {
 	assert(c != NULL && "expected 'c' to exist");
 	if (c == NULL)
 		return;
+	hiw_internal_client_release(c);
 	if (c->socket != INVALID_SOCKET)
 	{
-		hiw_socket_close(c->socket);
+		hiw_socket_release(c->socket);
 		c->socket = INVALID_SOCKET;
 	}
 }
@@ -199,20 +859,76 @@ void hiw_client_delete(hiw_client* const c)
 	assert(c != NULL && "expected 'c' to exist");
 	if (c == NULL)
 		return;
+	hiw_internal_client_release(c);
 	if (c->socket != INVALID_SOCKET)
 	{
-		hiw_socket_close(c->socket);
+		hiw_socket_release(c->socket);
 		c->socket = INVALID_SOCKET;
 	}
 	free(c);
 }
 
+void hiw_client_recycle(hiw_client* const c, hiw_client_cache* const cache)
+{
+	assert(c != NULL && "expected 'c' to exist");
+	if (c == NULL)
+		return;
+	if (cache == NULL || cache->count >= HIW_CLIENT_CACHE_SIZE)
+	{
+		hiw_client_delete(c);
+		return;
+	}
+	hiw_internal_client_release(c);
+	if (c->socket != INVALID_SOCKET)
+	{
+		hiw_socket_release(c->socket);
+		c->socket = INVALID_SOCKET;
+	}
+	c->next = cache->first;
+	cache->first = c;
+	cache->count++;
+}
+
+void hiw_client_cache_release(hiw_client_cache* const cache)
+{
+	assert(cache != NULL && "expected 'cache' to exist");
+	if (cache == NULL)
+		return;
+	while (cache->first != NULL)
+	{
+		hiw_client* const next = cache->first->next;
+		free(cache->first);
+		cache->first = next;
+	}
+	cache->count = 0;
+}
+
 int hiw_client_recv(hiw_client* const c, char* const dest, const int len)
 {
 	assert(c != NULL && "expected 'c' to exist");
 	if (c == NULL)
 		return -1;
-	return hiw_socket_recv(c->socket, dest, len);
+	if (c->uring != NULL)
+	{
+		unsigned int timeout;
+		if (!hiw_internal_client_timeout(c->read_timeout, c->read_deadline, &timeout))
+			return -1;
+		return hiw_uring_recv(c->uring, c->socket, dest, len, timeout);
+	}
+
+	// A blocking socket only knows about the read timeout, so wait for the data here if there's a deadline
+	if (!c->nonblocking && c->read_deadline != 0 && !hiw_internal_client_wait(c, false))
+		return -1;
+	while (1)
+	{
+		const int ret = hiw_socket_recv(c->socket, dest, len);
+		if (ret >= 0 || !c->nonblocking || !hiw_socket_would_block())
+			return ret;
+
+		// the socket is non-blocking, so wait for more data to arrive as if the socket was a blocking socket
+		if (!hiw_internal_client_wait(c, false))
+			return -1;
+	}
 }
 
 int hiw_client_send(hiw_client* const c, const char* const src, const int len)
@@ -220,7 +936,27 @@ int hiw_client_send(hiw_client* const c, const char* const src, const int len)
 	assert(c != NULL && "expected 'c' to exist");
 	if (c == NULL)
 		return -1;
-	return hiw_socket_send(c->socket, src, len);
+	if (c->uring != NULL)
+	{
+		unsigned int timeout;
+		if (!hiw_internal_client_timeout(c->write_timeout, c->write_deadline, &timeout))
+			return -1;
+		return hiw_uring_send(c->uring, c->socket, src, len, timeout);
+	}
+
+	// A blocking socket only knows about the write timeout, so wait for the socket here if there's a deadline
+	if (!c->nonblocking && c->write_deadline != 0 && !hiw_internal_client_wait(c, true))
+		return -1;
+	while (1)
+	{
+		const int ret = hiw_socket_send(c->socket, src, len);
+		if (ret >= 0 || !c->nonblocking || !hiw_socket_would_block())
+			return ret;
+
+		// the socket is non-blocking, so wait for the send buffer to drain as if the socket was a blocking socket
+		if (!hiw_internal_client_wait(c, true))
+			return -1;
+	}
 }
 
 int hiw_client_sendall(hiw_client* const c, const char* src, int len)
@@ -231,10 +967,146 @@ int hiw_client_sendall(hiw_client* const c, const char* src, int len)
 	int bytes_left = len;
 	while (bytes_left > 0)
 	{
-		const int ret = hiw_socket_send(c->socket, src, bytes_left);
+		const int ret = hiw_client_send(c, src, bytes_left);
 		if (ret <= 0)
 			return -1;
 		bytes_left -= ret;
+		src += ret;
+	}
+	return len;
+}
+
+int hiw_client_sendallv(hiw_client* const c, hiw_memory_view* views, int count, const bool more)
+{
+	assert(c != NULL && "expected 'c' to exist");
+	if (c == NULL)
+		return -1;
+
+	int total = 0;
+	while (count > 0)
+	{
+		int ret;
+		if (c->uring != NULL)
+		{
+			unsigned int timeout;
+			if (!hiw_internal_client_timeout(c->write_timeout, c->write_deadline, &timeout))
+				return -1;
+			ret = hiw_uring_sendv(c->uring, c->socket, views, count, more, timeout);
+		}
+		else
+		{
+			if (!c->nonblocking && c->write_deadline != 0 && !hiw_internal_client_wait(c, true))
+				return -1;
+			ret = hiw_socket_sendv(c->socket, views, count, more);
+			if (ret < 0 && c->nonblocking && hiw_socket_would_block())
+			{
+				// the socket is non-blocking, so wait for the send buffer to drain as if the socket was a blocking
+				// socket
+				if (!hiw_internal_client_wait(c, true))
+					return -1;
+				continue;
+			}
+		}
+		if (ret <= 0)
+			return -1;
+		total += ret;
+
+		// Skip the views that are sent and move past what's sent from a partially sent view
+		while (count > 0 && ret >= views->length)
+		{
+			ret -= views->length;
+			views++;
+			count--;
+		}
+		if (count > 0)
+		{
+			views->begin = (const char*)views->begin + ret;
+			views->length -= ret;
+		}
+	}
+	return total;
+}
+
+int hiw_client_sendfile(hiw_client* const c, const int fd, long long offset, const int len)
+{
+	assert(c != NULL && "expected 'c' to exist");
+	if (c == NULL)
+		return -1;
+
+	// The file is sent using the socket directly, even if the client is using io_uring, since io_uring has no
+	// equivalent operation that doesn't require a pipe
+	int bytes_left = len;
+	while (bytes_left > 0)
+	{
+		if (!c->nonblocking && c->write_deadline != 0 && !hiw_internal_client_wait(c, true))
+			return -1;
+		const int ret = hiw_socket_sendfile(c->socket, fd, offset, bytes_left);
+		if (ret < 0 && c->nonblocking && hiw_socket_would_block())
+		{
+			// the socket is non-blocking, so wait for the send buffer to drain as if the socket was a blocking socket
+			if (!hiw_internal_client_wait(c, true))
+				return -1;
+			continue;
+		}
+		if (ret <= 0)
+			return -1;
+		bytes_left -= ret;
+		offset += ret;
+	}
+	return len;
+}
+
+int hiw_client_sendall_zerocopy(hiw_client* const c, const char* src, const int len)
+{
+	assert(c != NULL && "expected 'c' to exist");
+	if (c == NULL)
+		return -1;
+
+	// Zero-copy is enabled the first time it's used, and the ordinary send is used if it's not supported
+	if (c->uring == NULL && c->zerocopy == 0)
+		c->zerocopy = hiw_socket_set_zerocopy(c->socket) ? 1 : -1;
+	if (c->uring != NULL || c->zerocopy < 0)
+		return hiw_client_sendall(c, src, len);
+
+	int pending = 0;
+	int bytes_left = len;
+	while (bytes_left > 0)
+	{
+		if (!c->nonblocking && c->write_deadline != 0 && !hiw_internal_client_wait(c, true))
+			return -1;
+		bool zerocopy;
+		const int ret = hiw_socket_send_zerocopy(c->socket, src, bytes_left, &zerocopy);
+		if (ret < 0 && c->nonblocking && hiw_socket_would_block())
+		{
+			// Completions are reported as socket errors, so reap them before waiting. Otherwise the wait would
+			// wake up immediately
+			const int completed = hiw_socket_zerocopy_reap(c->socket, false, 0);
+			if (completed < 0 || !hiw_internal_client_wait(c, true))
+				return -1;
+			pending -= completed;
+			continue;
+		}
+		if (ret <= 0)
+			return -1;
+		if (zerocopy)
+			pending++;
+		bytes_left -= ret;
+		src += ret;
+	}
+
+	// The kernel keeps referring to the memory until the client has acknowledged the bytes
+	while (pending > 0)
+	{
+		unsigned int timeout;
+		const int completed = hiw_internal_client_timeout(c->write_timeout, c->write_deadline, &timeout)
+								  ? hiw_socket_zerocopy_reap(c->socket, true, timeout)
+								  : -1;
+		if (completed < 0)
+		{
+			log_debugf("hiw_client(%p) failed waiting for %d zero-copy sends to complete", c, pending);
+			return -1;
+		}
+		pending -= completed;
 	}
 	return len;
 }
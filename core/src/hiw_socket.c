@@ -3,9 +3,31 @@
 // See the LICENSE file in the project root for license terms
 //
 
+// accept4 is a GNU extension
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "hiw_socket.h"
 #include "hiw_logger.h"
 #include <assert.h>
+#include <errno.h>
+
+#if defined(HIW_WINDOWS)
+#include <io.h>
+#else
+#include <poll.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <sys/sendfile.h>
+#endif
 
 hiw_socket_error hiw_socket_set_timeout(SOCKET sock, unsigned int read_timeout, unsigned int write_timeout)
 {
@@ -90,7 +112,141 @@ int hiw_socket_send(const SOCKET s, const char* dest, int len)
 		return -1;
 	if (len == 0)
 		return 0;
-	return send(s, dest, len, 0);
+	return send(s, dest, len, HIW_SOCKET_SEND_FLAGS);
+}
+
+int hiw_socket_sendv(const SOCKET s, const hiw_memory_view* const views, const int count, const bool more)
+{
+	assert(views != NULL && "expected 'views' to exist");
+	assert(count <= HIW_SOCKET_MAX_SEND_VIEWS && "expected at most HIW_SOCKET_MAX_SEND_VIEWS views");
+	if (views == NULL || count > HIW_SOCKET_MAX_SEND_VIEWS)
+		return -1;
+	if (count == 0)
+		return 0;
+
+#if defined(HIW_WINDOWS)
+	WSABUF buffers[HIW_SOCKET_MAX_SEND_VIEWS];
+	for (int i = 0; i < count; ++i)
+		buffers[i] = (WSABUF){.buf = (char*)views[i].begin, .len = views[i].length};
+	DWORD sent = 0;
+	if (WSASend(s, buffers, count, &sent, 0, NULL, NULL) != 0)
+		return -1;
+	return (int)sent;
+#else
+	struct iovec iov[HIW_SOCKET_MAX_SEND_VIEWS];
+	for (int i = 0; i < count; ++i)
+		iov[i] = (struct iovec){.iov_base = (void*)views[i].begin, .iov_len = views[i].length};
+	const struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+
+	int flags = HIW_SOCKET_SEND_FLAGS;
+#if defined(MSG_MORE)
+	// Allow the operating system to wait for more data, instead of sending a partial TCP segment
+	if (more)
+		flags |= MSG_MORE;
+#endif
+	return (int)sendmsg(s, &msg, flags);
+#endif
+}
+
+int hiw_socket_sendfile(const SOCKET s, const int fd, const long long offset, const int len)
+{
+	if (len <= 0)
+		return 0;
+
+#if defined(__linux__)
+	// The content is copied from the page cache directly into the socket buffer
+	off_t off = (off_t)offset;
+	return (int)sendfile(s, fd, &off, len);
+#else
+	// Read the file content into a temporary buffer. Only the bytes that are actually sent are considered consumed
+	char buf[HIW_SOCKET_SEND_CHUNK_SIZE];
+	const int n = len < (int)sizeof(buf) ? len : (int)sizeof(buf);
+#if defined(HIW_WINDOWS)
+	if (_lseeki64(fd, offset, SEEK_SET) < 0)
+		return -1;
+	const int count = _read(fd, buf, n);
+#else
+	const int count = (int)pread(fd, buf, n, (off_t)offset);
+#endif
+	if (count <= 0)
+		return -1;
+	return hiw_socket_send(s, buf, count);
+#endif
+}
+
+bool hiw_socket_set_zerocopy(const SOCKET s)
+{
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	const int value = 1;
+	if (setsockopt(s, SOL_SOCKET, SO_ZEROCOPY, &value, sizeof(value)) < 0)
+	{
+		log_debugf("could not enable zero-copy sends on socket: error(%d)", errno);
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+int hiw_socket_send_zerocopy(const SOCKET s, const char* const src, const int len, bool* const zerocopy)
+{
+	*zerocopy = false;
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	const int ret = (int)send(s, src, len, MSG_ZEROCOPY | HIW_SOCKET_SEND_FLAGS);
+	if (ret >= 0)
+	{
+		*zerocopy = true;
+		return ret;
+	}
+	// The kernel can't track more outstanding zero-copy sends on this socket, so copy the bytes instead
+	if (errno != ENOBUFS)
+		return ret;
+#endif
+	return hiw_socket_send(s, src, len);
+}
+
+int hiw_socket_zerocopy_reap(const SOCKET s, const bool wait, const unsigned int timeout)
+{
+#if defined(SO_EE_ORIGIN_ZEROCOPY)
+	if (wait)
+	{
+		// Completions are queued as errors on the socket, which poll reports even if no events are requested
+		struct pollfd pfd = {.fd = s, .events = 0, .revents = 0};
+		const int timeout_ms = timeout == 0 ? -1 : (int)timeout;
+		int result;
+		do
+		{
+			result = poll(&pfd, 1, timeout_ms);
+		} while (result < 0 && errno == EINTR);
+		if (result <= 0)
+			return -1;
+	}
+
+	int completed = 0;
+	while (1)
+	{
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_storage))];
+		struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+		if (recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		// Each notification is a range of send calls, where each send call is numbered in the order they were made
+		for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			const struct sock_extended_err* const err = (const struct sock_extended_err*)CMSG_DATA(cm);
+			if (err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+				completed += (int)(err->ee_data - err->ee_info + 1);
+		}
+	}
+
+	// The socket woke up without completing anything, which means that the socket itself failed
+	if (wait && completed == 0)
+		return -1;
+	return completed;
+#else
+	return wait ? -1 : 0;
+#endif
 }
 
 bool hiw_internal_server_bind_ipv4(const SOCKET sock, const hiw_socket_config* const config)
@@ -151,8 +307,144 @@ bool hiw_internal_server_bind_ipv6(const SOCKET sock, const hiw_socket_config* c
 	return true;
 }
 
+/**
+ * @brief Set a tuning option on the supplied socket. Tuning options are not required for the server to work, so a
+ *        failure is only logged
+ */
+void hiw_internal_socket_tune(const SOCKET s, const int level, const int option, const char* const name, int value)
+{
+	const int result = setsockopt(s, level, option, (const char*)&value, sizeof(value));
+	if (result < 0)
+		log_warnf("could not set socket option %s to %d: error(%d)", name, value, errno);
+}
+
+/**
+ * @brief Apply the tuning options that are set on the listening socket. Buffer sizes must be set before listen is
+ *        called, so that the TCP window scale is negotiated with the size in mind
+ */
+void hiw_internal_socket_tune_listener(const SOCKET s, const hiw_socket_config* const config)
+{
+	if (config->recv_buffer_size > 0)
+		hiw_internal_socket_tune(s, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", config->recv_buffer_size);
+	if (config->send_buffer_size > 0)
+		hiw_internal_socket_tune(s, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", config->send_buffer_size);
+
+	// The rest of the options are only supported by TCP sockets
+	if (config->unix_path.length > 0)
+		return;
+#if defined(TCP_DEFER_ACCEPT)
+	if (config->defer_accept > 0)
+		hiw_internal_socket_tune(s, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", config->defer_accept);
+#endif
+#if defined(TCP_FASTOPEN)
+	if (config->fastopen_queue > 0)
+		hiw_internal_socket_tune(s, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", config->fastopen_queue);
+#endif
+#if defined(SO_BUSY_POLL)
+	if (config->busy_poll > 0)
+		hiw_internal_socket_tune(s, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", config->busy_poll);
+#endif
+}
+
+void hiw_socket_tune_client(const SOCKET s, const hiw_socket_config* const config)
+{
+	// Buffer sizes and busy polling are inherited from the listening socket. Quick acknowledgements are not
+#if defined(TCP_QUICKACK)
+	if (config->quickack && config->unix_path.length == 0)
+		hiw_internal_socket_tune(s, IPPROTO_TCP, TCP_QUICKACK, "TCP_QUICKACK", 1);
+#endif
+}
+
+#if !defined(HIW_WINDOWS)
+
+/**
+ * @brief Create a unix domain server socket
+ * @param config The socket configuration
+ * @param err The error, if any
+ * @return The server socket; INVALID_SOCKET if the socket could not be created
+ */
+SOCKET hiw_internal_socket_listen_unix(const hiw_socket_config* const config, hiw_socket_error* const err)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (config->unix_path.length >= (int)sizeof(addr.sun_path))
+	{
+		log_errorf("unix socket path '%.*s' is too long", config->unix_path.length, config->unix_path.begin);
+		*err = HIW_SOCKET_ERROR_BIND;
+		return INVALID_SOCKET;
+	}
+	*hiw_std_copy(config->unix_path.begin, config->unix_path.length, addr.sun_path, sizeof(addr.sun_path)) = 0;
+
+	// An abstract socket name starts with a null character and is not null-terminated
+	socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + config->unix_path.length;
+	if (addr.sun_path[0] == '@')
+	{
+		addr.sun_path[0] = 0;
+	}
+	else
+	{
+		// The socket file isn't removed when the socket is closed, which prevents the server from binding the same
+		// path again
+		struct stat st;
+		if (lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(addr.sun_path);
+		addr_len += 1;
+	}
+
+	const SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == INVALID_SOCKET)
+	{
+		log_error("could not create server socket");
+		*err = HIW_SOCKET_ERROR_CREATE;
+		return INVALID_SOCKET;
+	}
+
+	*err = hiw_socket_set_timeout(sock, config->read_timeout, config->write_timeout);
+	if (*err != HIW_SOCKET_ERROR_SUCCESS)
+	{
+		hiw_socket_release(sock);
+		return INVALID_SOCKET;
+	}
+
+	hiw_internal_socket_tune_listener(sock, config);
+
+	int result = bind(sock, (struct sockaddr*)&addr, addr_len);
+	if (result < 0)
+	{
+		hiw_socket_release(sock);
+		log_errorf("could not bind socket to '%.*s': error(%d)", config->unix_path.length, config->unix_path.begin,
+				   errno);
+		*err = HIW_SOCKET_ERROR_BIND;
+		return INVALID_SOCKET;
+	}
+
+	result = listen(sock, config->backlog > 0 ? config->backlog : HIW_SOCKET_DEFAULT_BACKLOG);
+	if (result)
+	{
+		hiw_socket_release(sock);
+		log_errorf("could not listen for incoming requests: error(%d)", result);
+		*err = HIW_SOCKET_ERROR_LISTEN;
+		return INVALID_SOCKET;
+	}
+
+	*err = HIW_SOCKET_ERROR_SUCCESS;
+	return sock;
+}
+
+#endif
+
 SOCKET hiw_socket_listen(const hiw_socket_config* config, hiw_socket_error* err)
 {
+	if (config->unix_path.length > 0)
+	{
+#if defined(HIW_WINDOWS)
+		log_error("unix domain sockets are not supported on this platform");
+		*err = HIW_SOCKET_ERROR_CREATE;
+		return INVALID_SOCKET;
+#else
+		return hiw_internal_socket_listen_unix(config, err);
+#endif
+	}
+
 	int af = AF_INET;
 	if (config->ip_version != HIW_SOCKET_IPV4)
 		af = AF_INET6;
@@ -241,6 +533,8 @@ SOCKET hiw_socket_listen(const hiw_socket_config* config, hiw_socket_error* err)
 		return INVALID_SOCKET;
 	}
 
+	hiw_internal_socket_tune_listener(sock, config);
+
 	switch (config->ip_version)
 	{
 	case HIW_SOCKET_IPV4:
@@ -262,7 +556,7 @@ SOCKET hiw_socket_listen(const hiw_socket_config* config, hiw_socket_error* err)
 		break;
 	}
 
-	result = listen(sock, 500);
+	result = listen(sock, config->backlog > 0 ? config->backlog : HIW_SOCKET_DEFAULT_BACKLOG);
 	if (result)
 	{
 		hiw_socket_close(sock);
@@ -275,33 +569,30 @@ SOCKET hiw_socket_listen(const hiw_socket_config* config, hiw_socket_error* err)
 	return sock;
 }
 
-SOCKET hiw_socket_accept(SOCKET server_socket, const hiw_socket_config* config, hiw_socket_error* err)
+SOCKET hiw_socket_accept(SOCKET server_socket, const hiw_socket_config* config, hiw_socket_addr* addr,
+						 hiw_socket_error* err)
 {
-	SOCKET sock = INVALID_SOCKET;
-	struct sockaddr_in addr = {};
-	struct sockaddr_in6 addr_v6 = {};
-
-	if (config->ip_version == HIW_SOCKET_IPV4)
-	{
-		socklen_t addr_len = sizeof(addr);
-		sock = accept(server_socket, (struct sockaddr*)&addr, &addr_len);
-		if (sock == INVALID_SOCKET)
-		{
-			*err = HIW_SOCKET_ERROR_ACCEPT;
-			log_info("Failed to accept client socket");
-			return INVALID_SOCKET;
-		}
-	}
-	else
+	hiw_socket_addr local_addr;
+	if (addr == NULL)
+		addr = &local_addr;
+	socklen_t addr_len = sizeof(*addr);
+
+	// accept4 avoids having to set the close-on-exec flag with a separate system call
+#if defined(SOCK_CLOEXEC)
+	const SOCKET sock = accept4(server_socket, (struct sockaddr*)addr, &addr_len, SOCK_CLOEXEC);
+#else
+	const SOCKET sock = accept(server_socket, (struct sockaddr*)addr, &addr_len);
+#endif
+	if (sock == INVALID_SOCKET)
 	{
-		socklen_t addr_len = sizeof(addr_v6);
-		sock = accept(server_socket, (struct sockaddr*)&addr_v6, &addr_len);
-		if (sock == INVALID_SOCKET)
+		if (hiw_socket_would_block())
 		{
-			*err = HIW_SOCKET_ERROR_ACCEPT;
-			log_info("Failed to accept client socket");
+			*err = HIW_SOCKET_ERROR_WOULD_BLOCK;
 			return INVALID_SOCKET;
 		}
+		*err = HIW_SOCKET_ERROR_ACCEPT;
+		log_info("Failed to accept client socket");
+		return INVALID_SOCKET;
 	}
 
 	*err = hiw_socket_set_timeout(sock, config->read_timeout, config->write_timeout);
@@ -310,5 +601,118 @@ SOCKET hiw_socket_accept(SOCKET server_socket, const hiw_socket_config* config,
 		hiw_socket_close(sock);
 		return INVALID_SOCKET;
 	}
+	hiw_socket_tune_client(sock, config);
 	return sock;
 }
+
+bool hiw_socket_set_nonblocking(const SOCKET s, const bool nonblocking)
+{
+#if defined(HIW_WINDOWS)
+	u_long mode = nonblocking ? 1 : 0;
+	const int result = ioctlsocket(s, FIONBIO, &mode);
+	if (result != 0)
+	{
+		log_errorf("could not change socket blocking mode: error(%d)", result);
+		return false;
+	}
+#else
+	const int flags = fcntl(s, F_GETFL, 0);
+	if (flags < 0)
+	{
+		log_errorf("could not get socket flags: error(%d)", errno);
+		return false;
+	}
+	const int new_flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	if (new_flags != flags && fcntl(s, F_SETFL, new_flags) < 0)
+	{
+		log_errorf("could not change socket blocking mode: error(%d)", errno);
+		return false;
+	}
+#endif
+	return true;
+}
+
+bool hiw_socket_would_block()
+{
+#if defined(HIW_WINDOWS)
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+bool hiw_socket_wait(const SOCKET s, const bool write, const unsigned int timeout)
+{
+	struct pollfd pfd = {.fd = s, .events = write ? POLLOUT : POLLIN, .revents = 0};
+	const int timeout_ms = timeout == 0 ? -1 : (int)timeout;
+	while (1)
+	{
+#if defined(HIW_WINDOWS)
+		const int result = WSAPoll(&pfd, 1, timeout_ms);
+#else
+		const int result = poll(&pfd, 1, timeout_ms);
+		if (result < 0 && errno == EINTR)
+			continue;
+#endif
+		// A hangup or an error is reported as ready, so that the following recv or send call
+		// can report the actual error to the caller
+		return result > 0;
+	}
+}
+
+bool hiw_socket_readable(const SOCKET s)
+{
+	struct pollfd pfd = {.fd = s, .events = POLLIN, .revents = 0};
+#if defined(HIW_WINDOWS)
+	return WSAPoll(&pfd, 1, 0) > 0;
+#else
+	return poll(&pfd, 1, 0) > 0;
+#endif
+}
+
+bool hiw_socket_steer_by_cpu(const SOCKET s, const int* const cpus, const int count)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+	// The program needs two instructions for each socket, plus the instructions before and after them
+	if (cpus == NULL || count <= 0 || count > (BPF_MAXINSNS - 3) / 2)
+		return false;
+
+	struct sock_filter* const code = hiw_malloc(sizeof(struct sock_filter) * (count * 2 + 3));
+	int n = 0;
+
+	// A = the cpu that received the packet
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+	// if (A == cpus[i]) return i. Only the first socket is selected for a cpu that's listed more than once
+	for (int i = 0; i < count; ++i)
+	{
+		bool listed = false;
+		for (int j = 0; j < i && !listed; ++j)
+			listed = cpus[j] == cpus[i];
+		if (listed)
+			continue;
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned int)cpus[i], 0, 1);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (unsigned int)i);
+	}
+
+	// return A % count
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned int)count);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+	const struct sock_fprog program = {.len = (unsigned short)n, .filter = code};
+	const int result = setsockopt(s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+	free(code);
+	if (result < 0)
+	{
+		log_errorf("could not attach the reuseport program: error(%d)", errno);
+		return false;
+	}
+	return true;
+#else
+	(void)s;
+	(void)cpus;
+	(void)count;
+	log_error("steering connections by cpu is not supported on this platform");
+	return false;
+#endif
+}
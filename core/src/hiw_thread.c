@@ -3,9 +3,15 @@
 // See the LICENSE file in the project root for license terms
 //
 
+// pthread_setaffinity_np is a GNU extension
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "hiw_thread.h"
 #include "hiw_logger.h"
 #include "hiw_std.h"
+#include <string.h>
 
 #if defined(HIW_WINDOWS)
 #include <process.h>
@@ -19,6 +25,7 @@
 #ifdef __unix__
 #include <pthread.h>
 #include <limits.h>
+#include <errno.h>
 #define HIW_THREAD_HANDLE pthread_t
 #elif defined(HIW_WINDOWS)
 #include <process.h>
@@ -98,6 +105,12 @@ struct hiw_thread
 	// the leaf context containing the underlying value
 	hiw_thread_context* context;
 
+	// values of the context slots, indexed by the keys allocated using hiw_thread_context_key_new
+	void* slots[HIW_THREAD_CONTEXT_MAX_KEYS];
+
+	// the cpu the thread is pinned to. -1 if the thread is allowed to run on any cpu
+	int cpu;
+
 #if defined(HIW_WINDOWS)
 	// a handle to the thread
 	HANDLE handle;
@@ -107,6 +120,28 @@ struct hiw_thread
 	bool started;
 };
 
+/**
+ * @brief Pin the calling thread to the cpu of the supplied thread, if any
+ * @param t the thread
+ */
+void hiw_thread_pin_current(const hiw_thread* const t)
+{
+	if (t->cpu < 0)
+		return;
+#if defined(HIW_WINDOWS)
+	if (t->cpu >= (int)(sizeof(DWORD_PTR) * 8) ||
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << t->cpu) == 0)
+		log_warnf("hiw_thread(%p) could not be pinned to cpu %d", t, t->cpu);
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(t->cpu, &set);
+	const int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret != 0)
+		log_warnf("hiw_thread(%p) could not be pinned to cpu %d. pthread_setaffinity_np = %d", t, t->cpu, ret);
+#endif
+}
+
 #if defined(HIW_WINDOWS)
 void hiw_thread_entrypoint(void* p)
 #else
@@ -115,6 +150,9 @@ void* hiw_thread_entrypoint(void* const p)
 {
 	hiw_thread* const t = p;
 	log_debugf("hiw_thread(%p) thread entrypoint", t);
+#if defined(HIW_WINDOWS)
+	hiw_thread_pin_current(t);
+#endif
 	(t->func)(t);
 	log_debugf("hiw_thread(%p) thread entrypoint done", t);
 	fflush(stdout);
@@ -134,6 +172,8 @@ hiw_thread* hiw_thread_new(hiw_thread_fn fn)
 	t->data = NULL;
 	t->func = fn;
 	t->context = NULL;
+	memset(t->slots, 0, sizeof(t->slots));
+	t->cpu = -1;
 #if defined(HIW_WINDOWS)
 	t->handle = NULL;
 #else
@@ -181,6 +221,8 @@ hiw_thread* hiw_thread_main()
 							  .data = NULL,
 							  .func = NULL,
 							  .context = NULL,
+							  .slots = {0},
+							  .cpu = -1,
 #if defined(HIW_WINDOWS)
 							  .handle = NULL,
 #else
@@ -202,6 +244,19 @@ void hiw_thread_set_func(hiw_thread* t, hiw_thread_fn fn)
 	t->func = fn;
 }
 
+void hiw_thread_set_cpu(hiw_thread* const t, const int cpu)
+{
+	assert(t != NULL && "expected 't' to exist");
+	if (t == NULL)
+		return;
+	if (t->started && !hiw_bit_test(t->flags, hiw_thread_flags_main))
+	{
+		log_error("you are trying to set thread cpu while it's running");
+		return;
+	}
+	t->cpu = cpu;
+}
+
 void hiw_thread_set_userdata(hiw_thread* const t, void* const data)
 {
 	assert(t != NULL && "expected 't' to exist");
@@ -235,15 +290,10 @@ hiw_thread_context* hiw_thread_context_pop(hiw_thread* const t)
 	return prev;
 }
 
-void hiw_thread_context_clear(hiw_thread* const t) { t->context = NULL; }
-
-void* hiw_thread_context_find_traverse(const hiw_thread_context* const context, const void* const key)
+void hiw_thread_context_clear(hiw_thread* const t)
 {
-	if (context->key == key)
-		return context->value;
-	if (context->parent != NULL)
-		return hiw_thread_context_find_traverse(context->parent, key);
-	return NULL;
+	t->context = NULL;
+	memset(t->slots, 0, sizeof(t->slots));
 }
 
 void* hiw_thread_context_find(const hiw_thread* const t, const void* key)
@@ -251,11 +301,53 @@ void* hiw_thread_context_find(const hiw_thread* const t, const void* key)
 	assert(key != NULL && "expected 'key' to exist");
 	if (key == NULL)
 		return NULL;
-	if (t->context != NULL)
-		return hiw_thread_context_find_traverse(t->context, key);
+	for (const hiw_thread_context* context = t->context; context != NULL; context = context->parent)
+		if (context->key == key)
+			return context->value;
 	return NULL;
 }
 
+// the number of context keys allocated so far. The first key is reserved for the thread pool
+atomic_int hiw_thread_context_key_count = 1;
+
+// the context key used to find the thread pool a worker is part of
+#define hiw_thread_context_key_pool (0)
+
+int hiw_thread_context_key_new()
+{
+	int key = atomic_load_explicit(&hiw_thread_context_key_count, memory_order_relaxed);
+	do
+	{
+		if (key >= HIW_THREAD_CONTEXT_MAX_KEYS)
+		{
+			log_errorf("all %d context keys are already allocated", HIW_THREAD_CONTEXT_MAX_KEYS);
+			return -1;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&hiw_thread_context_key_count, &key, key + 1,
+													memory_order_relaxed, memory_order_relaxed));
+	return key;
+}
+
+void* hiw_thread_context_set(hiw_thread* const t, const int key, void* const value)
+{
+	assert(t != NULL && "expected 't' to exist");
+	assert(key >= 0 && key < HIW_THREAD_CONTEXT_MAX_KEYS && "expected 'key' to be allocated");
+	if (t == NULL || key < 0 || key >= HIW_THREAD_CONTEXT_MAX_KEYS)
+		return NULL;
+	void* const prev = t->slots[key];
+	t->slots[key] = value;
+	return prev;
+}
+
+void* hiw_thread_context_get(const hiw_thread* const t, const int key)
+{
+	assert(t != NULL && "expected 't' to exist");
+	assert(key >= 0 && key < HIW_THREAD_CONTEXT_MAX_KEYS && "expected 'key' to be allocated");
+	if (t == NULL || key < 0 || key >= HIW_THREAD_CONTEXT_MAX_KEYS)
+		return NULL;
+	return t->slots[key];
+}
+
 bool hiw_thread_start(hiw_thread* const t)
 {
 	if (t == NULL)
@@ -270,6 +362,7 @@ bool hiw_thread_start(hiw_thread* const t)
 	{
 		log_debugf("hiw_thread(%p) starting main", t);
 		t->started = true;
+		hiw_thread_pin_current(t);
 		(t->func)(t);
 		log_debugf("hiw_thread(%p) stopped main", t);
 		return true;
@@ -286,7 +379,24 @@ bool hiw_thread_start(hiw_thread* const t)
 			return false;
 		}
 #else
-		const int ret = pthread_create(&t->handle, NULL, hiw_thread_entrypoint, t);
+		// The thread is pinned before it starts running, so that it's stack, and any memory it touches first, is
+		// allocated from the memory node local to the cpu
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (t->cpu >= 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(t->cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+		int ret = pthread_create(&t->handle, &attr, hiw_thread_entrypoint, t);
+		pthread_attr_destroy(&attr);
+		if (ret == EINVAL && t->cpu >= 0)
+		{
+			log_warnf("hiw_thread(%p) could not be pinned to cpu %d", t, t->cpu);
+			ret = pthread_create(&t->handle, NULL, hiw_thread_entrypoint, t);
+		}
 		if (ret != 0)
 		{
 			t->started = false;
@@ -311,25 +421,10 @@ void hiw_thread_delete(hiw_thread* t)
 	free(t);
 }
 
-int HIW_THREAD_POOL_KEY = 0;
-
-typedef struct hiw_thread_pool_work hiw_thread_pool_work;
 typedef struct hiw_thread_pool_worker hiw_thread_pool_worker;
 
-/**
- * @brief work to execute as quickly as possible
- */
-struct hiw_thread_pool_work
-{
-	// function to execute
-	hiw_thread_fn func;
-
-	// user-data used when running the thread
-	void* data;
-
-	// a pointer to the next work in the linked list of work
-	hiw_thread_pool_work* next;
-};
+// the task memory is owned by the thread pool, and is recycled when the task is done
+#define hiw_thread_pool_task_flags_owned (1 << 0)
 
 /**
  * @brief Critical section
@@ -357,6 +452,22 @@ void hiw_thread_critical_sec_release(hiw_thread_critical_sec* const c)
 	critical_section_destroy(&c->mutex);
 }
 
+hiw_thread_critical_sec* hiw_thread_critical_sec_new()
+{
+	hiw_thread_critical_sec* const c = hiw_malloc(sizeof(hiw_thread_critical_sec));
+	hiw_thread_critical_sec_init(c);
+	return c;
+}
+
+void hiw_thread_critical_sec_delete(hiw_thread_critical_sec* const c)
+{
+	assert(c != NULL && "expected 'c' to exist");
+	if (c == NULL)
+		return;
+	hiw_thread_critical_sec_release(c);
+	free(c);
+}
+
 void hiw_thread_critical_sec_enter(hiw_thread_critical_sec* const c) { critical_section_enter(&c->mutex); }
 
 void hiw_thread_critical_sec_exit(hiw_thread_critical_sec* const c) { critical_section_exit(&c->mutex); }
@@ -370,6 +481,11 @@ bool hiw_thread_critical_sec_wait(hiw_thread_critical_sec* const c, const int ti
 	clock_gettime(CLOCK_REALTIME, &ts);
 	ts.tv_sec += timeout / 1000;
 	ts.tv_nsec += (timeout % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
 	return pthread_cond_timedwait(&c->cond, &c->mutex, &ts);
 #endif
 }
@@ -378,6 +494,274 @@ void hiw_thread_critical_sec_notify_one(hiw_thread_critical_sec* const c) { crit
 
 void hiw_thread_critical_sec_notify_all(hiw_thread_critical_sec* const c) { critical_section_broadcast(&c->cond); }
 
+// the initial number of work items a worker's deque can hold before it grows
+#if !defined(HIW_THREAD_POOL_DEQUE_INITIAL_CAPACITY)
+#define HIW_THREAD_POOL_DEQUE_INITIAL_CAPACITY (256)
+#endif
+
+typedef struct hiw_thread_pool_deque_array hiw_thread_pool_deque_array;
+
+/**
+ * @brief circular memory used by a work-stealing deque
+ */
+struct hiw_thread_pool_deque_array
+{
+	// the number of items the array can hold. Always a power of two
+	long long capacity;
+
+	// a smaller array that this array replaced. It's kept until the deque is deleted, since other workers might be
+	// stealing from it
+	hiw_thread_pool_deque_array* retired;
+
+	// the work items
+	_Atomic(hiw_thread_pool_task*) items[];
+};
+
+/**
+ * @brief A Chase-Lev work-stealing deque. The owning worker pushes and takes work at the bottom, while other workers
+ *        steal work from the top
+ */
+struct hiw_thread_pool_deque
+{
+	// where work is stolen from
+	atomic_llong top;
+
+	// where the owner pushes and takes work
+	atomic_llong bottom;
+
+	// the memory
+	_Atomic(hiw_thread_pool_deque_array*) array;
+};
+
+typedef struct hiw_thread_pool_deque hiw_thread_pool_deque;
+
+/**
+ * @param capacity the number of items. Must be a power of two
+ * @return new deque memory
+ */
+hiw_thread_pool_deque_array* hiw_thread_pool_deque_array_new(const long long capacity)
+{
+	hiw_thread_pool_deque_array* const a =
+		hiw_malloc((int)(sizeof(hiw_thread_pool_deque_array) + sizeof(hiw_thread_pool_task*) * capacity));
+	a->capacity = capacity;
+	a->retired = NULL;
+	return a;
+}
+
+void hiw_thread_pool_deque_init(hiw_thread_pool_deque* const d)
+{
+	atomic_init(&d->top, 0);
+	atomic_init(&d->bottom, 0);
+	atomic_init(&d->array, hiw_thread_pool_deque_array_new(HIW_THREAD_POOL_DEQUE_INITIAL_CAPACITY));
+}
+
+void hiw_thread_pool_deque_release(hiw_thread_pool_deque* const d)
+{
+	hiw_thread_pool_deque_array* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+	while (a != NULL)
+	{
+		hiw_thread_pool_deque_array* const retired = a->retired;
+		free(a);
+		a = retired;
+	}
+}
+
+/**
+ * @brief Push work at the bottom of the deque. Only called by the owner
+ * @param d the deque
+ * @param work the work
+ */
+void hiw_thread_pool_deque_push(hiw_thread_pool_deque* const d, hiw_thread_pool_task* const work)
+{
+	const long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	const long long t = atomic_load_explicit(&d->top, memory_order_acquire);
+	hiw_thread_pool_deque_array* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+	if (b - t > a->capacity - 1)
+	{
+		// The deque is full, so the items are copied into memory twice as large
+		hiw_thread_pool_deque_array* const grown = hiw_thread_pool_deque_array_new(a->capacity * 2);
+		for (long long i = t; i < b; ++i)
+		{
+			hiw_thread_pool_task* const item =
+				atomic_load_explicit(&a->items[i & (a->capacity - 1)], memory_order_relaxed);
+			atomic_store_explicit(&grown->items[i & (grown->capacity - 1)], item, memory_order_relaxed);
+		}
+		grown->retired = a;
+		atomic_store_explicit(&d->array, grown, memory_order_release);
+		a = grown;
+	}
+	atomic_store_explicit(&a->items[b & (a->capacity - 1)], work, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Take the most recently pushed work from the bottom of the deque. Only called by the owner
+ * @param d the deque
+ * @return the work; NULL if the deque is empty
+ */
+hiw_thread_pool_task* hiw_thread_pool_deque_take(hiw_thread_pool_deque* const d)
+{
+	const long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	hiw_thread_pool_deque_array* const a = atomic_load_explicit(&d->array, memory_order_relaxed);
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+	if (t > b)
+	{
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	hiw_thread_pool_task* work = atomic_load_explicit(&a->items[b & (a->capacity - 1)], memory_order_relaxed);
+	if (t == b)
+	{
+		// This is the last item, so we're racing against the workers stealing it
+		if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+													 memory_order_relaxed))
+			work = NULL;
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	}
+	return work;
+}
+
+/**
+ * @brief Steal the oldest work from the top of the deque. Called by any worker
+ * @param d the deque
+ * @return the work; NULL if the deque is empty or if another worker stole the work first
+ */
+hiw_thread_pool_task* hiw_thread_pool_deque_steal(hiw_thread_pool_deque* const d)
+{
+	long long t = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	const long long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (t >= b)
+		return NULL;
+
+	hiw_thread_pool_deque_array* const a = atomic_load_explicit(&d->array, memory_order_acquire);
+	hiw_thread_pool_task* const work = atomic_load_explicit(&a->items[t & (a->capacity - 1)], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+		return NULL;
+	return work;
+}
+
+/**
+ * @param d the deque
+ * @return true if the deque might contain work
+ */
+bool hiw_thread_pool_deque_has_work(hiw_thread_pool_deque* const d)
+{
+	return atomic_load_explicit(&d->bottom, memory_order_seq_cst) >
+		   atomic_load_explicit(&d->top, memory_order_seq_cst);
+}
+
+
+/**
+ * @brief A lock-free queue where any thread pushes tasks and one thread at a time pops them. The tasks are linked
+ *        using their own memory, so no memory is allocated when a task is pushed
+ */
+struct hiw_thread_pool_inbox
+{
+	// the most recently pushed task. Updated by the pushing threads
+	_Atomic(hiw_thread_pool_task*) head;
+
+	// the next task to be popped. Only used by the thread holding the consumer flag
+	hiw_thread_pool_task* tail;
+
+	// placeholder that's queued when the inbox is empty, so that head and tail are never NULL
+	hiw_thread_pool_task stub;
+
+	// set by the thread that's popping tasks
+	atomic_flag consumer;
+};
+
+typedef struct hiw_thread_pool_inbox hiw_thread_pool_inbox;
+
+#define hiw_thread_pool_task_next(task) ((_Atomic(hiw_thread_pool_task*)*)&(task)->next)
+
+void hiw_thread_pool_inbox_init(hiw_thread_pool_inbox* const q)
+{
+	q->stub.next = NULL;
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+	atomic_flag_clear(&q->consumer);
+}
+
+/**
+ * @brief Push a task. Called by any thread
+ * @param q the inbox
+ * @param task the task
+ */
+void hiw_thread_pool_inbox_push(hiw_thread_pool_inbox* const q, hiw_thread_pool_task* const task)
+{
+	atomic_store_explicit(hiw_thread_pool_task_next(task), NULL, memory_order_relaxed);
+	hiw_thread_pool_task* const prev = atomic_exchange_explicit(&q->head, task, memory_order_seq_cst);
+	atomic_store_explicit(hiw_thread_pool_task_next(prev), task, memory_order_release);
+}
+
+/**
+ * @brief Push tasks that are already linked together. Called by any thread
+ * @param q the inbox
+ * @param first the first task
+ * @param last the last task
+ */
+void hiw_thread_pool_inbox_push_chain(hiw_thread_pool_inbox* const q, hiw_thread_pool_task* const first,
+									  hiw_thread_pool_task* const last)
+{
+	atomic_store_explicit(hiw_thread_pool_task_next(last), NULL, memory_order_relaxed);
+	hiw_thread_pool_task* const prev = atomic_exchange_explicit(&q->head, last, memory_order_seq_cst);
+	atomic_store_explicit(hiw_thread_pool_task_next(prev), first, memory_order_release);
+}
+
+/**
+ * @brief Pop the oldest task. Only called by the thread holding the consumer flag
+ * @param q the inbox
+ * @return the task; NULL if the inbox is empty, or if a task is being pushed right now
+ */
+hiw_thread_pool_task* hiw_thread_pool_inbox_pop_UNSAFE(hiw_thread_pool_inbox* const q)
+{
+	hiw_thread_pool_task* tail = q->tail;
+	hiw_thread_pool_task* next = atomic_load_explicit(hiw_thread_pool_task_next(tail), memory_order_acquire);
+	if (tail == &q->stub)
+	{
+		if (next == NULL)
+			return NULL;
+		q->tail = tail = next;
+		next = atomic_load_explicit(hiw_thread_pool_task_next(tail), memory_order_acquire);
+	}
+	if (next != NULL)
+	{
+		q->tail = next;
+		return tail;
+	}
+
+	// The tail is the last task, unless a task is being pushed right now. The stub is queued after the last task, so
+	// that the last task can be popped
+	if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+		return NULL;
+	hiw_thread_pool_inbox_push(q, &q->stub);
+	next = atomic_load_explicit(hiw_thread_pool_task_next(tail), memory_order_acquire);
+	if (next == NULL)
+		return NULL;
+	q->tail = next;
+	return tail;
+}
+
+/**
+ * @param q the inbox
+ * @return true if the inbox might contain tasks
+ */
+bool hiw_thread_pool_inbox_has_work(hiw_thread_pool_inbox* const q)
+{
+	hiw_thread_pool_task* const head = atomic_load_explicit(&q->head, memory_order_seq_cst);
+	return head != &q->stub || atomic_load_explicit(hiw_thread_pool_task_next(&q->stub), memory_order_seq_cst) != NULL;
+}
+
+// maximum number of finished tasks owned by the thread pool that a worker keeps for future work
+#if !defined(HIW_THREAD_POOL_MAX_FREE_TASKS)
+#define HIW_THREAD_POOL_MAX_FREE_TASKS (64)
+#endif
+
 /**
  * @brief worker to asynchronously execute work
  */
@@ -389,26 +773,29 @@ struct hiw_thread_pool_worker
 	// thread to run
 	hiw_thread* thread;
 
-	// The next work to execute
-	hiw_thread_pool_work* work_next;
+	// the index of the worker in the thread pool
+	int index;
 
-	// Last work in the work linked list
-	hiw_thread_pool_work* work_last;
+	// is the worker one of the running workers. Inactive workers are not given any new work
+	atomic_bool active;
 
-	// A pointer to memory that we can use for future work
-	hiw_thread_pool_work* work_free;
+	// work pushed by the worker itself. Idle workers are stealing from it
+	hiw_thread_pool_deque deque;
 
-	// previous worker
-	hiw_thread_pool_worker* prev;
+	// work pushed to this worker by threads that are not part of the thread pool
+	hiw_thread_pool_inbox inbox;
 
-	// next worker
-	hiw_thread_pool_worker* next;
+	// finished tasks owned by the thread pool that can be used for future work. Only used by the worker itself
+	hiw_thread_pool_task* task_free;
 
-	// critical section
-	hiw_thread_critical_sec critical_section;
+	// number of tasks in task_free
+	int task_free_count;
+
+	// is the worker waiting for work
+	atomic_bool sleeping;
 
-	// boolean that tells the worker that it's running or not
-	volatile bool running;
+	// critical section, used to put the worker to sleep
+	hiw_thread_critical_sec critical_section;
 };
 
 /**
@@ -419,83 +806,298 @@ struct hiw_thread_pool
 	// thread pool config
 	hiw_thread_pool_config config;
 
-	// The first worker in the thread pool
-	hiw_thread_pool_worker* worker_first;
+	// all workers, running or not. The pool grows by starting inactive workers and shrinks by stopping idle ones, so
+	// that the workers are never moved while other threads are pushing or stealing work
+	hiw_thread_pool_worker** workers;
+
+	// the number of workers, i.e. the maximum number of running workers
+	int worker_count;
+
+	// number of running workers
+	atomic_int active_count;
+
+	// the time when work started waiting for a worker; 0 if a worker is idle
+	_Atomic(hiw_tick_t) busy_since;
+
+	// set while a worker is being started
+	atomic_flag growing;
 
-	// The last worker in the thread pool
-	hiw_thread_pool_worker* worker_last;
+	// the most recently stopped worker. It's thread is joined by the next worker that's started or stopped
+	hiw_thread_pool_worker* retired;
 
-	// critical section, used to lock the list of workers and the free work memory
+	// critical section, used when starting and stopping workers
 	hiw_thread_critical_sec critical_section;
+
+	// the worker that receives the next task pushed by a thread that's not part of the thread pool, if all workers
+	// are busy
+	atomic_uint next_worker;
+
+	// number of workers waiting for work
+	atomic_int sleeping;
+
+	// number of tasks waiting in the queues. Only counted if the queues are bounded
+	atomic_int queued;
+
+	// number of threads waiting for room in the queues
+	atomic_int blocked;
+
+	// critical section, used to put threads to sleep until there's room in the queues
+	hiw_thread_critical_sec backpressure;
+
+	// number of threads waiting for tasks to be done
+	atomic_int waiting;
+
+	// critical section, used to put threads to sleep until tasks are done
+	hiw_thread_critical_sec completion;
+
+	// boolean that tells the workers that the thread pool is running or not
+	atomic_bool running;
 };
 
+// the worker running on the current thread. NULL if the current thread is not a thread pool worker
+static _Thread_local hiw_thread_pool_worker* hiw_thread_pool_current = NULL;
+
 /**
- * @brief Add a new worker in the thread pool
- * @param pool Thread pool
- * @param worker The new Worker
+ * @brief Pop a task from the inbox of the supplied worker, unless another thread is popping tasks from it
+ * @param worker The worker
+ * @return The task; NULL if no task was popped
  */
-void hiw_thread_pool_add_worker(hiw_thread_pool* const pool, hiw_thread_pool_worker* const worker)
+hiw_thread_pool_task* hiw_thread_pool_inbox_pop(hiw_thread_pool_worker* const worker)
 {
-	hiw_thread_critical_sec_enter(&pool->critical_section);
+	if (atomic_flag_test_and_set_explicit(&worker->inbox.consumer, memory_order_acquire))
+		return NULL;
+	hiw_thread_pool_task* const task = hiw_thread_pool_inbox_pop_UNSAFE(&worker->inbox);
+	atomic_flag_clear_explicit(&worker->inbox.consumer, memory_order_release);
+	return task;
+}
 
-	if (pool->worker_last == NULL)
+/**
+ * @brief Steal work from the other workers. The search starts at the worker after the supplied one, so that the
+ *        workers are not all stealing from the same victim
+ * @param worker The worker that's stealing
+ * @return Stolen work; NULL if no work was found
+ */
+hiw_thread_pool_task* hiw_thread_pool_steal(hiw_thread_pool_worker* const worker)
+{
+	hiw_thread_pool* const pool = worker->pool;
+	for (int i = 1; i < pool->worker_count; ++i)
 	{
-		pool->worker_first = worker;
-		pool->worker_last = worker;
+		hiw_thread_pool_worker* const victim = pool->workers[(worker->index + i) % pool->worker_count];
+		hiw_thread_pool_task* task = hiw_thread_pool_deque_steal(&victim->deque);
+		if (task == NULL)
+			task = hiw_thread_pool_inbox_pop(victim);
+		if (task != NULL)
+			return task;
 	}
-	else
+	return NULL;
+}
+
+/**
+ * @param pool The thread pool
+ * @return true if any worker might have work queued
+ */
+bool hiw_thread_pool_has_work(hiw_thread_pool* const pool)
+{
+	for (int i = 0; i < pool->worker_count; ++i)
 	{
-		worker->prev = pool->worker_last;
-		pool->worker_last->next = worker;
-		pool->worker_last = worker;
+		hiw_thread_pool_worker* const worker = pool->workers[i];
+		if (hiw_thread_pool_deque_has_work(&worker->deque) || hiw_thread_pool_inbox_has_work(&worker->inbox))
+			return true;
 	}
+	return false;
+}
 
-	hiw_thread_critical_sec_exit(&pool->critical_section);
+/**
+ * @brief Find queued work to be executed by the supplied worker, without waiting for work to be pushed
+ * @param worker The worker
+ * @return Work to be executed; NULL if no work was found
+ */
+hiw_thread_pool_task* hiw_thread_pool_find_queued(hiw_thread_pool_worker* const worker)
+{
+	hiw_thread_pool_task* task = hiw_thread_pool_deque_take(&worker->deque);
+	if (task == NULL)
+		task = hiw_thread_pool_inbox_pop(worker);
+	if (task == NULL)
+		task = hiw_thread_pool_steal(worker);
+	return task;
 }
 
 /**
- * @brief Function to be called when work is done and should be returned
- * @param worker Thread pool worker
- * @param work work that's done
+ * @brief Wake up the supplied worker, if it's sleeping
+ * @param worker The worker
  */
-void hiw_thread_pool_work_done(hiw_thread_pool_worker* const worker, hiw_thread_pool_work* const work)
+void hiw_thread_pool_wake(hiw_thread_pool_worker* const worker)
 {
+	if (!atomic_load(&worker->sleeping))
+		return;
 	hiw_thread_critical_sec_enter(&worker->critical_section);
-	if (worker->work_free != NULL)
-		work->next = worker->work_free;
-	worker->work_free = work;
+	hiw_thread_critical_sec_notify_one(&worker->critical_section);
 	hiw_thread_critical_sec_exit(&worker->critical_section);
-	// TODO: If we have a small amount of load on this pool, then allow shrinking the pool
 }
 
 /**
- * @brief Get pending work to be executed by a thread pool worker
- * @param worker The thread pool worker
- * @return A worker to be executed
- *
- * Please note that this function is UNSAFE, which means that you have to lock any appropriate
- * critical sections before calling this function
+ * @brief Wake up one sleeping worker, if any
+ * @param pool The thread pool
  */
-hiw_thread_pool_work* hiw_thread_pool_worker_pop_work_UNSAFE(hiw_thread_pool_worker* const worker)
+void hiw_thread_pool_wake_one(hiw_thread_pool* const pool)
 {
-	hiw_thread_pool_work* const work = worker->work_next;
+	// Pairs with the sleeping worker looking for work after it's marked as sleeping
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&pool->sleeping) == 0)
+		return;
+	for (int i = 0; i < pool->worker_count; ++i)
+	{
+		hiw_thread_pool_worker* const worker = pool->workers[i];
+		if (atomic_load(&worker->sleeping))
+		{
+			hiw_thread_pool_wake(worker);
+			return;
+		}
+	}
+}
 
-	// no work needed
-	if (work == NULL)
-		return NULL;
+/**
+ * @brief Stop the supplied worker, unless the thread pool would have fewer workers than configured
+ * @param worker The worker that's been idle
+ * @return true if the worker is stopped and it's thread should exit
+ */
+bool hiw_thread_pool_retire(hiw_thread_pool_worker* const worker)
+{
+	hiw_thread_pool* const pool = worker->pool;
+	hiw_thread_critical_sec_enter(&pool->critical_section);
+	if (!atomic_load(&pool->running) || atomic_load(&pool->active_count) <= pool->config.count)
+	{
+		hiw_thread_critical_sec_exit(&pool->critical_section);
+		return false;
+	}
+	atomic_store(&worker->active, false);
+	atomic_fetch_sub(&pool->active_count, 1);
 
-	// only one work item exists
-	if (work->next == NULL)
+	// Work might have been pushed to the worker before it was deactivated
+	if (hiw_thread_pool_deque_has_work(&worker->deque) || hiw_thread_pool_inbox_has_work(&worker->inbox))
 	{
-		worker->work_next = NULL;
-		worker->work_last = NULL;
+		atomic_fetch_add(&pool->active_count, 1);
+		atomic_store(&worker->active, true);
+		hiw_thread_critical_sec_exit(&pool->critical_section);
+		return false;
 	}
-	else
+
+	// The previously stopped worker has exited, or is about to, so it's thread is joined to release it's resources
+	if (pool->retired != NULL)
+		hiw_thread_wait(pool->retired->thread, pool->config.worker_timeout);
+	pool->retired = worker;
+	hiw_thread_critical_sec_exit(&pool->critical_section);
+	log_debugf("hiw_thread_pool(%p) stopped idle worker %d", pool, worker->index);
+	return true;
+}
+
+/**
+ * @brief Find work to be executed by the supplied worker. The worker's own work is executed first and then work
+ *        stolen from other workers. The worker sleeps until work is pushed if none is found, and stops if the thread
+ *        pool is allowed to shrink and no work is pushed during the configured idle time
+ * @param worker The worker
+ * @return Work to be executed; NULL if the thread pool is stopped and there's no more work, or if the worker is
+ *         stopped
+ */
+hiw_thread_pool_task* hiw_thread_pool_find_work(hiw_thread_pool_worker* const worker)
+{
+	hiw_thread_pool* const pool = worker->pool;
+	bool woken = false;
+	while (1)
 	{
-		worker->work_next = work->next;
+		hiw_thread_pool_task* const task = hiw_thread_pool_find_queued(worker);
+		if (task != NULL)
+		{
+			// Work pushed in a batch only wakes up one worker, so a worker that's woken up wakes up the next one if
+			// there's more work
+			if (woken && hiw_thread_pool_has_work(pool))
+				hiw_thread_pool_wake_one(pool);
+			return task;
+		}
+
+		// The worker is marked as sleeping before looking for work one last time, so that pushed work is either
+		// seen here or the pushing thread sees that the worker is sleeping
+		hiw_thread_critical_sec_enter(&worker->critical_section);
+		atomic_store(&worker->sleeping, true);
+		atomic_fetch_add(&pool->sleeping, 1);
+
+		// Work pushed from now on is not waiting for a worker
+		if (atomic_load_explicit(&pool->busy_since, memory_order_relaxed) != 0)
+			atomic_store_explicit(&pool->busy_since, 0, memory_order_relaxed);
+
+		bool idle = false;
+		if (!hiw_thread_pool_has_work(pool))
+		{
+			// Stop running the worker logic when there's no more work
+			if (!atomic_load(&pool->running))
+			{
+				atomic_fetch_sub(&pool->sleeping, 1);
+				atomic_store(&worker->sleeping, false);
+				hiw_thread_critical_sec_exit(&worker->critical_section);
+				return NULL;
+			}
+			const int timeout = pool->config.allow_shrink ? pool->config.idle_timeout : INFINITE;
+			const hiw_tick_t start = hiw_get_tick_count();
+			hiw_thread_critical_sec_wait(&worker->critical_section, timeout);
+			idle = timeout != INFINITE && hiw_get_tick_count() - start >= (hiw_tick_t)timeout;
+			woken = true;
+		}
+		atomic_fetch_sub(&pool->sleeping, 1);
+		atomic_store(&worker->sleeping, false);
+		hiw_thread_critical_sec_exit(&worker->critical_section);
+		if (idle && hiw_thread_pool_retire(worker))
+			return NULL;
 	}
+}
 
-	return work;
+/**
+ * @brief Function called when a worker takes a task from the thread pool's queues, if the queues are bounded
+ * @param pool The thread pool
+ */
+void hiw_thread_pool_dequeued(hiw_thread_pool* const pool)
+{
+	atomic_fetch_sub(&pool->queued, 1);
+	if (atomic_load(&pool->blocked) == 0)
+		return;
+	hiw_thread_critical_sec_enter(&pool->backpressure);
+	hiw_thread_critical_sec_notify_one(&pool->backpressure);
+	hiw_thread_critical_sec_exit(&pool->backpressure);
+}
+
+/**
+ * @brief Function to be called when a task owned by the thread pool is done
+ * @param worker Thread pool worker that executed the task
+ * @param task task that's done
+ */
+void hiw_thread_pool_task_done(hiw_thread_pool_worker* const worker, hiw_thread_pool_task* const task)
+{
+	if (worker->task_free_count >= HIW_THREAD_POOL_MAX_FREE_TASKS)
+	{
+		free(task);
+		return;
+	}
+	task->next = worker->task_free;
+	worker->task_free = task;
+	worker->task_free_count++;
+}
+
+/**
+ * @brief Execute a task taken from the thread pool's queues
+ * @param worker The worker executing the task
+ * @param task The task
+ */
+void hiw_thread_pool_run(hiw_thread_pool_worker* const worker, hiw_thread_pool_task* const task)
+{
+	log_debugf("[t:%p] running work", worker->thread);
+	if (worker->pool->config.capacity > 0)
+		hiw_thread_pool_dequeued(worker->pool);
+
+	// The task is not touched after the function is called, unless it's owned by the thread pool
+	const bool owned = hiw_bit_test(task->flags, hiw_thread_pool_task_flags_owned);
+	hiw_thread_set_userdata(worker->thread, task->data);
+	task->func(worker->thread);
+	if (owned)
+		hiw_thread_pool_task_done(worker, task);
 }
 
 /**
@@ -514,15 +1116,13 @@ void hiw_thread_pool_func(hiw_thread* const t)
 	hiw_thread_pool* const pool = worker->pool;
 
 	// make sure that the thread pool is available as a context value on the thread
-	hiw_thread_context value = {.key = &HIW_THREAD_POOL_KEY, .value = pool};
-	hiw_thread_context_push(t, &value);
+	hiw_thread_context_set(t, hiw_thread_context_key_pool, pool);
 
 	log_debugf("[t:%p] initializing worker thread", t);
 	pool->config.on_start(t);
 
 	log_debugf("[t:%p] shutting down", t);
-	hiw_thread_critical_sec_exit(&worker->critical_section);
-	hiw_thread_context_pop(worker->thread);
+	hiw_thread_context_set(worker->thread, hiw_thread_context_key_pool, NULL);
 }
 
 void hiw_thread_pool_worker_main(hiw_thread* const t)
@@ -533,59 +1133,36 @@ void hiw_thread_pool_worker_main(hiw_thread* const t)
 		log_errorf("[t:%p] thread worker is not in it's appropriate state", t);
 		return;
 	}
+	hiw_thread_pool_current = worker;
 
-	while (1)
-	{
-		hiw_thread_critical_sec_enter(&worker->critical_section);
-		const bool current_running = worker->running;
-
-		// check if we should do work
-		if (worker->work_next == NULL && current_running)
-		{
-			// TODO allow for customized timeout
-			hiw_thread_critical_sec_wait(&worker->critical_section, INFINITE);
-		}
-
-		if (!current_running)
-		{
-			// Stop running the worker logic when there's no more work.
-			if (worker->work_next == NULL)
-			{
-				hiw_thread_critical_sec_exit(&worker->critical_section);
-				break;
-			}
-		}
-
-		// get work to executed by this worker
-		hiw_thread_pool_work* const work = hiw_thread_pool_worker_pop_work_UNSAFE(worker);
-		hiw_thread_critical_sec_exit(&worker->critical_section);
+	hiw_thread_pool_task* task;
+	while ((task = hiw_thread_pool_find_work(worker)) != NULL)
+		hiw_thread_pool_run(worker, task);
 
-		// run work if exists
-		if (work)
-		{
-			log_debugf("[t:%p] running work", t);
-			hiw_thread_set_userdata(t, work->data);
-			work->func(t);
-			hiw_thread_pool_work_done(worker, work);
-		}
-	}
+	hiw_thread_pool_current = NULL;
+	hiw_thread_set_userdata(t, worker);
 }
 
 /**
  * @brief Create a new worker
  * @param pool The thread pool this worker is associated with
+ * @param index The index of the worker in the thread pool
  * @return A new worker
  */
-hiw_thread_pool_worker* hiw_thread_pool_worker_new(hiw_thread_pool* const pool)
+hiw_thread_pool_worker* hiw_thread_pool_worker_new(hiw_thread_pool* const pool, const int index)
 {
 	assert(pool != NULL && "expected 'pool' to exist");
 
 	hiw_thread_pool_worker* const worker = hiw_malloc(sizeof(hiw_thread_pool_worker));
 	worker->pool = pool;
 	worker->thread = hiw_thread_new(hiw_thread_pool_func);
-	worker->work_next = worker->work_last = NULL;
-	worker->work_free = NULL;
-	worker->prev = worker->next = NULL;
+	worker->index = index;
+	atomic_init(&worker->active, false);
+	hiw_thread_pool_deque_init(&worker->deque);
+	hiw_thread_pool_inbox_init(&worker->inbox);
+	worker->task_free = NULL;
+	worker->task_free_count = 0;
+	atomic_init(&worker->sleeping, false);
 	hiw_thread_critical_sec_init(&worker->critical_section);
 	hiw_thread_set_userdata(worker->thread, worker);
 
@@ -594,29 +1171,8 @@ hiw_thread_pool_worker* hiw_thread_pool_worker_new(hiw_thread_pool* const pool)
 }
 
 /**
- * @brief Stop the worker from running
- * @param worker The worker
- */
-void hiw_thread_pool_worker_stop(hiw_thread_pool_worker* const worker)
-{
-	// Mark the worker as non-running and notify is so that it'll notice the change
-	// so that it will shut down
-	hiw_thread_critical_sec_enter(&worker->critical_section);
-	if (worker->running)
-	{
-		worker->running = false;
-		hiw_thread_critical_sec_notify_one(&worker->critical_section);
-		hiw_thread_critical_sec_exit(&worker->critical_section);
-		hiw_thread_wait(worker->thread, worker->pool->config.worker_timeout);
-	}
-	else
-	{
-		hiw_thread_critical_sec_exit(&worker->critical_section);
-	}
-}
-
-/**
- * @brief Cleanup the supplier workers internal memory and then free al it's memory
+ * @brief Cleanup the supplier workers internal memory and then free al it's memory. The worker is expected to be
+ *        stopped
  * @param worker The worker to be deleted
  */
 void hiw_thread_pool_worker_delete(hiw_thread_pool_worker* const worker)
@@ -624,43 +1180,56 @@ void hiw_thread_pool_worker_delete(hiw_thread_pool_worker* const worker)
 	assert(worker != NULL && "expected 'worker' to exist");
 
 	log_debugf("hiw_thread_pool_worker(%p) destroying", worker);
-	hiw_thread_pool_worker_stop(worker);
+	hiw_thread_delete(worker->thread);
 
-	// cleanup cached work memory
-	hiw_thread_pool_work* work = worker->work_free;
-	while (work != NULL)
+	// cleanup cached task memory
+	hiw_thread_pool_task* task = worker->task_free;
+	while (task != NULL)
 	{
-		hiw_thread_pool_work* const next = work->next;
-		free(work);
-		work = next;
+		hiw_thread_pool_task* const next = task->next;
+		free(task);
+		task = next;
 	}
 
+	hiw_thread_pool_deque_release(&worker->deque);
 	hiw_thread_critical_sec_release(&worker->critical_section);
-	hiw_thread_delete(worker->thread);
 	log_debugf("hiw_thread_pool_worker(%p) destroyed", worker);
 	free(worker);
 }
 
 hiw_thread_pool* hiw_thread_pool_new(const hiw_thread_pool_config* config)
 {
-	// TODO add support for shrinking thread count
-	assert(config->allow_shrink == false && "shrinking the threads are not supported yet");
-	// TODO add support for increasing thread count
-	assert(config->max_count == config->count && "increasing thread count dynamically are not supported yet");
+	assert(config->count >= 0 && "expected 'count' to be zero or more");
 
 	hiw_thread_pool* const impl = hiw_malloc(sizeof(hiw_thread_pool));
 	impl->config = *config;
 	if (impl->config.on_start == NULL)
 		impl->config.on_start = hiw_thread_pool_do_nothing;
-	impl->worker_first = NULL;
-	impl->worker_last = NULL;
-
+	if (impl->config.max_count < impl->config.count)
+		impl->config.max_count = impl->config.count;
+	atomic_init(&impl->next_worker, 0);
+	atomic_init(&impl->sleeping, 0);
+	atomic_init(&impl->running, false);
+	atomic_init(&impl->active_count, 0);
+	atomic_init(&impl->busy_since, 0);
+	atomic_init(&impl->queued, 0);
+	atomic_init(&impl->blocked, 0);
+	hiw_thread_critical_sec_init(&impl->backpressure);
+	atomic_init(&impl->waiting, 0);
+	hiw_thread_critical_sec_init(&impl->completion);
+	atomic_flag_clear(&impl->growing);
+	impl->retired = NULL;
 	hiw_thread_critical_sec_init(&impl->critical_section);
 
-	for (int i = 0; i < impl->config.count; ++i)
+	// Workers are created up-front for the maximum number of threads, but only started when they are needed
+	impl->worker_count = impl->config.max_count;
+	impl->workers = hiw_malloc(sizeof(hiw_thread_pool_worker*) * (impl->worker_count > 0 ? impl->worker_count : 1));
+	for (int i = 0; i < impl->worker_count; ++i)
 	{
-		hiw_thread_pool_worker* const worker = hiw_thread_pool_worker_new(impl);
-		hiw_thread_pool_add_worker(impl, worker);
+		hiw_thread_pool_worker* const worker = hiw_thread_pool_worker_new(impl, i);
+		if (impl->config.cpu_count > 0)
+			hiw_thread_set_cpu(worker->thread, impl->config.cpus[i % impl->config.cpu_count]);
+		impl->workers[i] = worker;
 	}
 
 	return impl;
@@ -670,89 +1239,531 @@ void hiw_thread_pool_delete(hiw_thread_pool* const pool)
 {
 	log_debugf("hiw_thread_pool(%p) shutting down thread pool", pool);
 
-	// Iterate through all workers and wait for them to shut down
-	hiw_thread_pool_worker* worker = pool->worker_first;
-	while (worker != NULL)
+	// Tell all workers to shut down when there's no more work, and wake up the ones that are sleeping. The critical
+	// section makes sure that no worker is being started or stopped at the same time
+	hiw_thread_critical_sec_enter(&pool->critical_section);
+	atomic_store(&pool->running, false);
+	hiw_thread_critical_sec_exit(&pool->critical_section);
+	hiw_thread_critical_sec_enter(&pool->backpressure);
+	hiw_thread_critical_sec_notify_all(&pool->backpressure);
+	hiw_thread_critical_sec_exit(&pool->backpressure);
+	for (int i = 0; i < pool->worker_count; ++i)
 	{
-		hiw_thread_pool_worker* const next = worker->next;
-		hiw_thread_pool_worker_stop(worker);
-		hiw_thread_pool_worker_delete(worker);
-		worker = next;
+		hiw_thread_pool_worker* const worker = pool->workers[i];
+		hiw_thread_critical_sec_enter(&worker->critical_section);
+		hiw_thread_critical_sec_notify_all(&worker->critical_section);
+		hiw_thread_critical_sec_exit(&worker->critical_section);
 	}
 
+	// Wait for all workers to shut down, including the most recently stopped one
+	for (int i = 0; i < pool->worker_count; ++i)
+		hiw_thread_wait(pool->workers[i]->thread, pool->config.worker_timeout);
+	for (int i = 0; i < pool->worker_count; ++i)
+		hiw_thread_pool_worker_delete(pool->workers[i]);
 	hiw_thread_critical_sec_release(&pool->critical_section);
+	hiw_thread_critical_sec_release(&pool->backpressure);
+	hiw_thread_critical_sec_release(&pool->completion);
+	free(pool->workers);
 	free(pool);
 }
 
+/**
+ * @brief Start one more worker, if the thread pool is allowed to grow. Nothing happens if another thread is
+ *        already starting a worker
+ * @param pool The thread pool
+ */
+void hiw_thread_pool_grow(hiw_thread_pool* const pool)
+{
+	if (atomic_flag_test_and_set(&pool->growing))
+		return;
+	hiw_thread_critical_sec_enter(&pool->critical_section);
+	if (atomic_load(&pool->running) && atomic_load(&pool->active_count) < pool->worker_count)
+	{
+		for (int i = 0; i < pool->worker_count; ++i)
+		{
+			hiw_thread_pool_worker* const worker = pool->workers[i];
+			if (atomic_load(&worker->active))
+				continue;
+
+			// The thread of a stopped worker is joined before it's started again
+			if (pool->retired == worker)
+			{
+				hiw_thread_wait(worker->thread, pool->config.worker_timeout);
+				pool->retired = NULL;
+			}
+			atomic_store(&worker->active, true);
+			atomic_fetch_add(&pool->active_count, 1);
+			if (!hiw_thread_start(worker->thread))
+			{
+				log_errorf("hiw_thread_pool(%p) could not start worker %d", pool, i);
+				atomic_fetch_sub(&pool->active_count, 1);
+				atomic_store(&worker->active, false);
+			}
+			else
+				log_debugf("hiw_thread_pool(%p) started worker %d", pool, i);
+			break;
+		}
+	}
+	hiw_thread_critical_sec_exit(&pool->critical_section);
+	atomic_flag_clear(&pool->growing);
+}
+
+/**
+ * @brief Function called when work is pushed while no worker is idle. The thread pool grows if work has been waiting
+ *        for a worker for longer than the configured latency
+ * @param pool The thread pool
+ */
+void hiw_thread_pool_saturated(hiw_thread_pool* const pool)
+{
+	if (atomic_load_explicit(&pool->active_count, memory_order_relaxed) == 0 || pool->config.grow_latency <= 0)
+	{
+		hiw_thread_pool_grow(pool);
+		return;
+	}
+
+	const hiw_tick_t now = hiw_get_tick_count();
+	hiw_tick_t since = atomic_load_explicit(&pool->busy_since, memory_order_relaxed);
+	if (since == 0)
+	{
+		atomic_compare_exchange_strong(&pool->busy_since, &since, now);
+		return;
+	}
+	if (now < since + (hiw_tick_t)pool->config.grow_latency)
+		return;
+
+	// The next worker is started if work is still waiting after another period of latency
+	if (atomic_compare_exchange_strong(&pool->busy_since, &since, now))
+		hiw_thread_pool_grow(pool);
+}
+
 bool hiw_thread_pool_start(hiw_thread_pool* const pool)
 {
 	log_infof("hiw_thread_pool(%p) starting", pool);
 
-	hiw_thread_pool_worker* worker = pool->worker_first;
-	while (worker != NULL)
+	atomic_store(&pool->running, true);
+	for (int i = 0; i < pool->config.count; ++i)
 	{
-		worker->running = true;
+		hiw_thread_pool_worker* const worker = pool->workers[i];
+		atomic_store(&worker->active, true);
+		atomic_fetch_add(&pool->active_count, 1);
 		if (!hiw_thread_start(worker->thread))
 			return false;
-		worker = worker->next;
 	}
+
+	// Work pushed before the thread pool was started needs a worker
+	if (pool->config.count == 0 && hiw_thread_pool_has_work(pool))
+		hiw_thread_pool_grow(pool);
 	log_infof("hiw_thread_pool(%p) started", pool);
 	return true;
 }
 
 /**
- * @param worker The worker
- * @return Create new work memory or reuse cached work memory
- *
- * Please note that this function is UNSAFE, which means that you have to lock any appropriate
- * critical sections before calling this function
- */
-hiw_thread_pool_work* hiw_thread_pool_work_new_UNSAFE(hiw_thread_pool_worker* const worker, hiw_thread_fn func,
-													  void* data)
-{
-	// try to get free work memory
-	hiw_thread_pool_work* work = worker->work_free;
-	if (work == NULL)
-		work = hiw_malloc(sizeof(hiw_thread_pool_work));
+ * @brief Queue tasks that are linked together
+ * @param pool The thread pool
+ * @param first The first task
+ * @param last The last task
+ */
+void hiw_thread_pool_queue(hiw_thread_pool* const pool, hiw_thread_pool_task* first, hiw_thread_pool_task* const last)
+{
+	// Work pushed by a worker is put in it's own deque, where idle workers can steal it
+	hiw_thread_pool_worker* const current = hiw_thread_pool_current;
+	if (current != NULL && current->pool == pool)
+	{
+		while (1)
+		{
+			// The task might be executed, and it's memory reused, as soon as it's pushed
+			hiw_thread_pool_task* const next = first == last ? NULL : first->next;
+			hiw_thread_pool_deque_push(&current->deque, first);
+			if (next == NULL)
+				break;
+			first = next;
+		}
+		hiw_thread_pool_wake_one(pool);
+	}
 	else
-		worker->work_next = work->next;
-	work->func = func;
-	work->data = data;
-	work->next = NULL;
-	return work;
+	{
+		// Work pushed by other threads is given to a sleeping worker, if any, and otherwise to the running workers in
+		// turn. Work given to a worker that's stopping is stolen by the other workers
+		const unsigned int turn = atomic_fetch_add_explicit(&pool->next_worker, 1, memory_order_relaxed);
+		const bool sleeping = atomic_load_explicit(&pool->sleeping, memory_order_relaxed) > 0;
+		hiw_thread_pool_worker* worker = NULL;
+		for (int i = 0; i < pool->worker_count; ++i)
+		{
+			hiw_thread_pool_worker* const candidate = pool->workers[(turn + i) % pool->worker_count];
+			if (!atomic_load_explicit(&candidate->active, memory_order_relaxed))
+				continue;
+			if (worker == NULL)
+				worker = candidate;
+			if (!sleeping || atomic_load_explicit(&candidate->sleeping, memory_order_relaxed))
+			{
+				worker = candidate;
+				break;
+			}
+		}
+		if (worker == NULL)
+			worker = pool->workers[turn % pool->worker_count];
+		hiw_thread_pool_inbox_push_chain(&worker->inbox, first, last);
+
+		// The worker might have gone to sleep before the task was pushed
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load(&worker->sleeping))
+			hiw_thread_pool_wake(worker);
+		else
+			hiw_thread_pool_wake_one(pool);
+	}
+
+	// The pushed work is waiting in a queue if no worker is idle
+	if (atomic_load_explicit(&pool->sleeping, memory_order_relaxed) == 0 &&
+		atomic_load_explicit(&pool->active_count, memory_order_relaxed) < pool->worker_count)
+		hiw_thread_pool_saturated(pool);
 }
 
-void hiw_thread_pool_push(hiw_thread_pool* const pool, hiw_thread_fn func, void* data)
+/**
+ * @brief Reserve room in the thread pool's queues
+ * @param pool The thread pool
+ * @param count The number of tasks
+ * @return The number of tasks there's room for, at most count
+ */
+int hiw_thread_pool_reserve(hiw_thread_pool* const pool, const int count)
 {
-	assert(pool != NULL && "expected 'pool' to exist");
-	assert(pool->worker_first != NULL && "expected 'worker_first' to exist");
+	if (pool->config.capacity <= 0)
+		return count;
+	int queued = atomic_load(&pool->queued);
+	while (1)
+	{
+		const int room = pool->config.capacity - queued;
+		if (room <= 0)
+			return 0;
+		const int reserved = count < room ? count : room;
+		if (atomic_compare_exchange_weak(&pool->queued, &queued, queued + reserved))
+			return reserved;
+	}
+}
 
-	// Get the first worker and move it to the end
-	hiw_thread_critical_sec_enter(&pool->critical_section);
-	hiw_thread_pool_worker* const worker = pool->worker_first;
-	pool->worker_first = worker->next;
-	pool->worker_first->prev = NULL;
-	pool->worker_last->next = worker;
-	worker->prev = pool->worker_last;
-	pool->worker_last = worker;
-	hiw_thread_critical_sec_exit(&pool->critical_section);
+/**
+ * @brief Reserve room for one task in the thread pool's queues, and wait for room if the queues are full
+ * @param pool The thread pool
+ * @param timeout The number of milliseconds to wait for room
+ * @return true if room was reserved
+ */
+bool hiw_thread_pool_reserve_wait(hiw_thread_pool* const pool, const int timeout)
+{
+	if (hiw_thread_pool_reserve(pool, 1) == 1)
+		return true;
+	if (timeout <= 0)
+		return false;
 
-	// Get a work from the worker and add it to be worked
-	hiw_thread_critical_sec_enter(&worker->critical_section);
-	hiw_thread_pool_work* const work = hiw_thread_pool_work_new_UNSAFE(worker, func, data);
-	if (worker->work_last == NULL)
+	// The thread is marked as blocked before trying again, so that workers taking work from the queues either make
+	// room before it's seen here or see that a thread is blocked
+	const hiw_tick_t deadline = hiw_get_tick_count() + (hiw_tick_t)timeout;
+	bool reserved = false;
+	hiw_thread_critical_sec_enter(&pool->backpressure);
+	atomic_fetch_add(&pool->blocked, 1);
+	while (atomic_load(&pool->running))
 	{
-		worker->work_next = worker->work_last = work;
+		if (hiw_thread_pool_reserve(pool, 1) == 1)
+		{
+			reserved = true;
+			break;
+		}
+		const hiw_tick_t now = hiw_get_tick_count();
+		if (now >= deadline)
+			break;
+		hiw_thread_critical_sec_wait(&pool->backpressure, (int)(deadline - now));
+	}
+	atomic_fetch_sub(&pool->blocked, 1);
+	hiw_thread_critical_sec_exit(&pool->backpressure);
+	return reserved;
+}
+
+/**
+ * @brief Create a task owned by the thread pool. Workers reuse the memory of finished tasks
+ * @param func The function to be called
+ * @param data User data associated with the call
+ * @return A new task
+ */
+hiw_thread_pool_task* hiw_thread_pool_task_new(hiw_thread_fn func, void* data)
+{
+	hiw_thread_pool_worker* const current = hiw_thread_pool_current;
+	hiw_thread_pool_task* task;
+	if (current != NULL && current->task_free != NULL)
+	{
+		task = current->task_free;
+		current->task_free = task->next;
+		current->task_free_count--;
 	}
 	else
 	{
-		worker->work_last->next = work;
+		task = hiw_malloc(sizeof(hiw_thread_pool_task));
 	}
-	hiw_thread_critical_sec_notify_one(&worker->critical_section);
-	hiw_thread_critical_sec_exit(&worker->critical_section);
+	task->func = func;
+	task->data = data;
+	task->flags = hiw_thread_pool_task_flags_owned;
+	return task;
+}
+
+void hiw_thread_pool_push_task(hiw_thread_pool* const pool, hiw_thread_pool_task* const task)
+{
+	assert(pool != NULL && "expected 'pool' to exist");
+	assert(task != NULL && "expected 'task' to exist");
+	assert(pool->worker_count > 0 && "expected the pool to be allowed to have workers");
+	if (pool->config.capacity > 0)
+		atomic_fetch_add(&pool->queued, 1);
+	task->flags = 0;
+	hiw_thread_pool_queue(pool, task, task);
+}
+
+bool hiw_thread_pool_push_task_timeout(hiw_thread_pool* const pool, hiw_thread_pool_task* const task,
+									   const int timeout)
+{
+	assert(pool != NULL && "expected 'pool' to exist");
+	assert(task != NULL && "expected 'task' to exist");
+	assert(pool->worker_count > 0 && "expected the pool to be allowed to have workers");
+	if (!hiw_thread_pool_reserve_wait(pool, timeout))
+		return false;
+	task->flags = 0;
+	hiw_thread_pool_queue(pool, task, task);
+	return true;
+}
+
+int hiw_thread_pool_push_batch(hiw_thread_pool* const pool, hiw_thread_pool_task* const tasks, const int count)
+{
+	assert(pool != NULL && "expected 'pool' to exist");
+	assert(tasks != NULL && "expected 'tasks' to exist");
+	assert(pool->worker_count > 0 && "expected the pool to be allowed to have workers");
+	if (count <= 0)
+		return 0;
+	const int reserved = hiw_thread_pool_reserve(pool, count);
+	if (reserved == 0)
+		return 0;
+	for (int i = 0; i < reserved; ++i)
+	{
+		tasks[i].flags = 0;
+		tasks[i].next = i + 1 < reserved ? &tasks[i + 1] : NULL;
+	}
+	hiw_thread_pool_queue(pool, &tasks[0], &tasks[reserved - 1]);
+	return reserved;
+}
+
+void hiw_thread_pool_push(hiw_thread_pool* const pool, hiw_thread_fn func, void* data)
+{
+	assert(pool != NULL && "expected 'pool' to exist");
+	assert(pool->worker_count > 0 && "expected the pool to be allowed to have workers");
+	if (pool->config.capacity > 0)
+		atomic_fetch_add(&pool->queued, 1);
+	hiw_thread_pool_task* const task = hiw_thread_pool_task_new(func, data);
+	hiw_thread_pool_queue(pool, task, task);
+}
+
+bool hiw_thread_pool_push_timeout(hiw_thread_pool* const pool, hiw_thread_fn func, void* data, const int timeout)
+{
+	assert(pool != NULL && "expected 'pool' to exist");
+	assert(pool->worker_count > 0 && "expected the pool to be allowed to have workers");
+	if (!hiw_thread_pool_reserve_wait(pool, timeout))
+		return false;
+	hiw_thread_pool_task* const task = hiw_thread_pool_task_new(func, data);
+	hiw_thread_pool_queue(pool, task, task);
+	return true;
+}
+
+bool hiw_thread_pool_try_push(hiw_thread_pool* const pool, hiw_thread_fn func, void* data)
+{
+	return hiw_thread_pool_push_timeout(pool, func, data, 0);
 }
 
 hiw_thread_pool* hiw_thread_pool_get(const hiw_thread* const t)
 {
-	return hiw_thread_context_find(t, &HIW_THREAD_POOL_KEY);
+	return hiw_thread_context_get(t, hiw_thread_context_key_pool);
+}
+
+// the interval, in milliseconds, in which a worker that's waiting for a task to be done looks for other work to execute
+#if !defined(HIW_THREAD_POOL_HELP_INTERVAL)
+#define HIW_THREAD_POOL_HELP_INTERVAL (1)
+#endif
+
+#define hiw_thread_pool_handle_state(handle) ((atomic_int*)&(handle)->state)
+#define hiw_thread_pool_wait_group_count(group) ((atomic_int*)&(group)->count)
+
+/**
+ * @brief Wake up the threads waiting for tasks to be done
+ * @param pool The thread pool
+ */
+void hiw_thread_pool_notify_done(hiw_thread_pool* const pool)
+{
+	// Pairs with the waiting thread checking the value after it's marked as waiting
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&pool->waiting) == 0)
+		return;
+	hiw_thread_critical_sec_enter(&pool->completion);
+	hiw_thread_critical_sec_notify_all(&pool->completion);
+	hiw_thread_critical_sec_exit(&pool->completion);
+}
+
+/**
+ * @brief Wait until the supplied value is set to the target value by a task. A thread pool worker executes other work
+ *        while waiting, so that the thread pool doesn't run out of workers while the task is still queued
+ * @param pool The thread pool running the task
+ * @param value The value
+ * @param target The target value
+ * @param timeout The number of milliseconds to wait
+ * @return true if the value was set to the target value before the timeout
+ */
+bool hiw_thread_pool_wait_until(hiw_thread_pool* const pool, atomic_int* const value, const int target,
+								const int timeout)
+{
+	if (atomic_load_explicit(value, memory_order_acquire) == target)
+		return true;
+
+	hiw_thread_pool_worker* const current = hiw_thread_pool_current;
+	const bool help = current != NULL && current->pool == pool;
+	const hiw_tick_t deadline = timeout == INFINITE ? 0 : hiw_get_tick_count() + (hiw_tick_t)timeout;
+	while (1)
+	{
+		if (help)
+		{
+			hiw_thread_pool_task* const task = hiw_thread_pool_find_queued(current);
+			if (task != NULL)
+			{
+				void* const data = hiw_thread_get_userdata(current->thread);
+				hiw_thread_pool_run(current, task);
+				hiw_thread_set_userdata(current->thread, data);
+				if (atomic_load_explicit(value, memory_order_acquire) == target)
+					return true;
+				continue;
+			}
+		}
+
+		int wait = INFINITE;
+		if (timeout != INFINITE)
+		{
+			const hiw_tick_t now = hiw_get_tick_count();
+			if (now >= deadline)
+				return false;
+			wait = (int)(deadline - now);
+		}
+		if (help && wait > HIW_THREAD_POOL_HELP_INTERVAL)
+			wait = HIW_THREAD_POOL_HELP_INTERVAL;
+
+		// The thread is marked as waiting before checking the value again, so that the task either sets the value
+		// before it's seen here or sees that a thread is waiting
+		hiw_thread_critical_sec_enter(&pool->completion);
+		atomic_fetch_add(&pool->waiting, 1);
+		const bool done = atomic_load(value) == target;
+		if (!done)
+			hiw_thread_critical_sec_wait(&pool->completion, wait);
+		atomic_fetch_sub(&pool->waiting, 1);
+		hiw_thread_critical_sec_exit(&pool->completion);
+		if (done || atomic_load_explicit(value, memory_order_acquire) == target)
+			return true;
+	}
+}
+
+void hiw_thread_pool_wait_group_init(hiw_thread_pool_wait_group* const group, hiw_thread_pool* const pool)
+{
+	assert(group != NULL && "expected 'group' to exist");
+	group->pool = pool;
+	atomic_init(hiw_thread_pool_wait_group_count(group), 0);
+}
+
+void hiw_thread_pool_wait_group_add(hiw_thread_pool_wait_group* const group, const int count)
+{
+	atomic_fetch_add(hiw_thread_pool_wait_group_count(group), count);
+}
+
+void hiw_thread_pool_wait_group_done(hiw_thread_pool_wait_group* const group)
+{
+	// The group might be released by the waiting thread as soon as the count reaches zero
+	hiw_thread_pool* const pool = group->pool;
+	if (atomic_fetch_sub(hiw_thread_pool_wait_group_count(group), 1) == 1)
+		hiw_thread_pool_notify_done(pool);
+}
+
+void hiw_thread_pool_wait_group_wait(hiw_thread_pool_wait_group* const group)
+{
+	hiw_thread_pool_wait_until(group->pool, hiw_thread_pool_wait_group_count(group), 0, INFINITE);
+}
+
+bool hiw_thread_pool_wait_group_wait_timeout(hiw_thread_pool_wait_group* const group, const int timeout)
+{
+	return hiw_thread_pool_wait_until(group->pool, hiw_thread_pool_wait_group_count(group), 0,
+									  timeout < 0 ? 0 : timeout);
+}
+
+/**
+ * @brief function used by a thread pool worker to execute work submitted with a handle
+ * @param t the thread
+ */
+void hiw_thread_pool_handle_func(hiw_thread* const t)
+{
+	hiw_thread_pool_handle* const handle = hiw_thread_get_userdata(t);
+	hiw_thread_pool* const pool = handle->pool;
+	hiw_thread_pool_wait_group* const group = handle->group;
+	hiw_thread_set_userdata(t, handle->data);
+	handle->result = handle->func(t);
+
+	// The handle, and the group, might be released by the waiting thread as soon as they are done
+	atomic_store_explicit(hiw_thread_pool_handle_state(handle), 1, memory_order_release);
+	if (group != NULL)
+		atomic_fetch_sub(hiw_thread_pool_wait_group_count(group), 1);
+	hiw_thread_pool_notify_done(pool);
+}
+
+/**
+ * @brief Push work that's executed using the supplied handle
+ * @param pool The thread pool
+ * @param group The wait group the work is part of; NULL if none
+ * @param handle The handle
+ * @param func The function to be called
+ * @param data User data associated with the call
+ */
+void hiw_thread_pool_handle_push(hiw_thread_pool* const pool, hiw_thread_pool_wait_group* const group,
+								 hiw_thread_pool_handle* const handle, hiw_thread_pool_result_fn func, void* const data)
+{
+	assert(handle != NULL && "expected 'handle' to exist");
+	assert(func != NULL && "expected 'func' to exist");
+	handle->task.func = hiw_thread_pool_handle_func;
+	handle->task.data = handle;
+	handle->func = func;
+	handle->data = data;
+	handle->result = NULL;
+	handle->pool = pool;
+	handle->group = group;
+	atomic_init(hiw_thread_pool_handle_state(handle), 0);
+	hiw_thread_pool_push_task(pool, &handle->task);
+}
+
+void hiw_thread_pool_submit(hiw_thread_pool* const pool, hiw_thread_pool_handle* const handle,
+							hiw_thread_pool_result_fn func, void* const data)
+{
+	hiw_thread_pool_handle_push(pool, NULL, handle, func, data);
+}
+
+void hiw_thread_pool_wait_group_submit(hiw_thread_pool_wait_group* const group, hiw_thread_pool_handle* const handle,
+									   hiw_thread_pool_result_fn func, void* const data)
+{
+	assert(group != NULL && "expected 'group' to exist");
+	hiw_thread_pool_wait_group_add(group, 1);
+	hiw_thread_pool_handle_push(group->pool, group, handle, func, data);
+}
+
+bool hiw_thread_pool_handle_is_done(const hiw_thread_pool_handle* const handle)
+{
+	return atomic_load_explicit(hiw_thread_pool_handle_state(handle), memory_order_acquire) == 1;
+}
+
+void* hiw_thread_pool_handle_result(const hiw_thread_pool_handle* const handle)
+{
+	return hiw_thread_pool_handle_is_done(handle) ? handle->result : NULL;
+}
+
+void* hiw_thread_pool_handle_wait(hiw_thread_pool_handle* const handle)
+{
+	hiw_thread_pool_wait_until(handle->pool, hiw_thread_pool_handle_state(handle), 1, INFINITE);
+	return handle->result;
+}
+
+bool hiw_thread_pool_handle_wait_timeout(hiw_thread_pool_handle* const handle, const int timeout)
+{
+	return hiw_thread_pool_wait_until(handle->pool, hiw_thread_pool_handle_state(handle), 1,
+									  timeout < 0 ? 0 : timeout);
 }
@@ -0,0 +1,219 @@
+//
+// Part of the highway project, under the MIT License
+// See the LICENSE file in the project root for license terms
+//
+
+#include "hiw_timer.h"
+#include <assert.h>
+
+#if defined(HIW_WINDOWS)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// number of bits used for the slot index in each level
+#define HIW_TIMER_SLOT_BITS (6)
+
+// mask for the slot index in each level
+#define HIW_TIMER_SLOT_MASK (HIW_TIMER_SLOTS - 1)
+
+/**
+ * Timer wheel instance. Each level is a ring of slots, where each slot is a linked list of timers. A timer is put in
+ * the lowest level that covers the time until it expires. When the lowest level has turned a full lap, the timers in
+ * the next slot of the level above are moved down
+ */
+struct hiw_timer_wheel
+{
+	// the next tick to be processed
+	unsigned long long current;
+
+	// the timers, where each slot is the sentinel of a circular linked list
+	hiw_timer_link slots[HIW_TIMER_LEVELS][HIW_TIMER_SLOTS];
+};
+
+unsigned long long hiw_timer_now()
+{
+#if defined(HIW_WINDOWS)
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+hiw_timer_wheel* hiw_timer_wheel_new(const unsigned long long now)
+{
+	hiw_timer_wheel* const w = hiw_malloc(sizeof(hiw_timer_wheel));
+	// The current tick is already processed, so that no timer expires before its timeout
+	w->current = now / HIW_TIMER_RESOLUTION + 1;
+	for (int level = 0; level < HIW_TIMER_LEVELS; ++level)
+	{
+		for (int i = 0; i < HIW_TIMER_SLOTS; ++i)
+		{
+			hiw_timer_link* const slot = &w->slots[level][i];
+			slot->prev = slot->next = slot;
+		}
+	}
+	return w;
+}
+
+void hiw_timer_wheel_delete(hiw_timer_wheel* const w)
+{
+	assert(w != NULL && "expected 'w' to exist");
+	if (w == NULL)
+		return;
+
+	// Detach all timers, so that cancelling them later doesn't touch the released memory
+	for (int level = 0; level < HIW_TIMER_LEVELS; ++level)
+	{
+		for (int i = 0; i < HIW_TIMER_SLOTS; ++i)
+		{
+			hiw_timer_link* const slot = &w->slots[level][i];
+			while (slot->next != slot)
+				hiw_timer_cancel((hiw_timer*)slot->next);
+		}
+	}
+	free(w);
+}
+
+/**
+ * @brief Put the timer in the slot that covers the time until it expires
+ */
+void hiw_internal_timer_wheel_place(hiw_timer_wheel* const w, hiw_timer* const t)
+{
+	if (t->expires < w->current)
+		t->expires = w->current;
+
+	unsigned long long delta = t->expires - w->current;
+	int level = 0;
+	while (level < HIW_TIMER_LEVELS - 1 && delta >= 1ULL << (HIW_TIMER_SLOT_BITS * (level + 1)))
+		level++;
+
+	// Timers beyond the range of the wheel are put in the last slot of the highest level
+	const unsigned long long max_delta = (1ULL << (HIW_TIMER_SLOT_BITS * HIW_TIMER_LEVELS)) - 1;
+	if (delta > max_delta)
+	{
+		delta = max_delta;
+		t->expires = w->current + delta;
+	}
+
+	const int index = (int)(t->expires >> (HIW_TIMER_SLOT_BITS * level)) & HIW_TIMER_SLOT_MASK;
+	hiw_timer_link* const slot = &w->slots[level][index];
+	t->link.prev = slot->prev;
+	t->link.next = slot;
+	slot->prev->next = &t->link;
+	slot->prev = &t->link;
+}
+
+void hiw_timer_wheel_add(hiw_timer_wheel* const w, hiw_timer* const t, const unsigned int timeout)
+{
+	assert(w != NULL && "expected 'w' to exist");
+	assert(t != NULL && "expected 't' to exist");
+	if (w == NULL || t == NULL)
+		return;
+
+	hiw_timer_cancel(t);
+	t->expires = w->current + (timeout + HIW_TIMER_RESOLUTION - 1) / HIW_TIMER_RESOLUTION;
+	hiw_internal_timer_wheel_place(w, t);
+}
+
+void hiw_timer_cancel(hiw_timer* const t)
+{
+	assert(t != NULL && "expected 't' to exist");
+	if (t == NULL || t->link.next == NULL)
+		return;
+	t->link.prev->next = t->link.next;
+	t->link.next->prev = t->link.prev;
+	t->link.prev = t->link.next = NULL;
+}
+
+bool hiw_timer_is_armed(const hiw_timer* const t) { return t != NULL && t->link.next != NULL; }
+
+/**
+ * @brief Move the timers in the slot of the supplied level, that's due for the current tick, to the levels below
+ * @return The index of the slot
+ */
+int hiw_internal_timer_wheel_cascade(hiw_timer_wheel* const w, const int level)
+{
+	const int index = (int)(w->current >> (HIW_TIMER_SLOT_BITS * level)) & HIW_TIMER_SLOT_MASK;
+	hiw_timer_link* const slot = &w->slots[level][index];
+	while (slot->next != slot)
+	{
+		hiw_timer* const t = (hiw_timer*)slot->next;
+		hiw_timer_cancel(t);
+		hiw_internal_timer_wheel_place(w, t);
+	}
+	return index;
+}
+
+int hiw_timer_wheel_advance(hiw_timer_wheel* const w, const unsigned long long now)
+{
+	assert(w != NULL && "expected 'w' to exist");
+	if (w == NULL)
+		return 0;
+
+	int expired = 0;
+	const unsigned long long target = now / HIW_TIMER_RESOLUTION;
+	while (w->current <= target)
+	{
+		// Move timers from the levels above when the level below has turned a full lap
+		const int index = (int)(w->current & HIW_TIMER_SLOT_MASK);
+		if (index == 0)
+		{
+			for (int level = 1; level < HIW_TIMER_LEVELS; ++level)
+			{
+				if (hiw_internal_timer_wheel_cascade(w, level) != 0)
+					break;
+			}
+		}
+
+		// The expired timers are moved to a separate list first, since a timer function is allowed to add or cancel
+		// any timer
+		hiw_timer_link* const slot = &w->slots[0][index];
+		hiw_timer_link expired_timers = {.prev = &expired_timers, .next = &expired_timers};
+		if (slot->next != slot)
+		{
+			expired_timers.next = slot->next;
+			expired_timers.prev = slot->prev;
+			slot->next->prev = &expired_timers;
+			slot->prev->next = &expired_timers;
+			slot->prev = slot->next = slot;
+		}
+		w->current++;
+
+		while (expired_timers.next != &expired_timers)
+		{
+			hiw_timer* const t = (hiw_timer*)expired_timers.next;
+			hiw_timer_cancel(t);
+			expired++;
+			if (t->func != NULL)
+				t->func(t);
+		}
+	}
+	return expired;
+}
+
+int hiw_timer_wheel_next_timeout(const hiw_timer_wheel* const w, const int max)
+{
+	assert(w != NULL && "expected 'w' to exist");
+	if (w == NULL)
+		return max;
+
+	// Find the next slot with timers in the lowest level. The wheel has to be advanced when the lowest level has
+	// turned a full lap, since timers might be moved down from the levels above
+	int ticks = 0;
+	for (; ticks < HIW_TIMER_SLOTS; ++ticks)
+	{
+		const unsigned long long tick = w->current + ticks;
+		if (ticks > 0 && (tick & HIW_TIMER_SLOT_MASK) == 0)
+			break;
+		const hiw_timer_link* const slot = &w->slots[0][tick & HIW_TIMER_SLOT_MASK];
+		if (slot->next != slot)
+			break;
+	}
+
+	const long long timeout = (long long)(ticks + 1) * HIW_TIMER_RESOLUTION;
+	return timeout < max ? (int)timeout : max;
+}
@@ -0,0 +1,655 @@
+//
+// Part of the highway project, under the MIT License
+// See the LICENSE file in the project root for license terms
+//
+
+#include "hiw_uring.h"
+#include "hiw_logger.h"
+#include <assert.h>
+#include <errno.h>
+
+#if defined(HIW_LINUX)
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// The completion belongs to the multishot accept
+#define HIW_URING_OP_ACCEPT (1)
+
+// The completion belongs to the current recv or send
+#define HIW_URING_OP_IO (2)
+
+// The completion belongs to a cancel or timeout request, and can be ignored
+#define HIW_URING_OP_IGNORE (3)
+
+// The completion belongs to the timeout of a waiting accept
+#define HIW_URING_OP_ACCEPT_TIMEOUT (4)
+
+/**
+ * Ring instance
+ */
+struct hiw_uring
+{
+	// the io_uring file descriptor
+	int fd;
+
+	// memory mapped submission queue ring
+	void* sq_ptr;
+	size_t sq_size;
+
+	// memory mapped completion queue ring. Might be the same memory as the submission queue ring
+	void* cq_ptr;
+	size_t cq_size;
+
+	// submission queue entries
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+
+	// submission queue ring properties
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+
+	// the tail of the submission queue entries prepared, but not yet submitted
+	unsigned int sq_local_tail;
+
+	// completion queue ring properties
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	struct io_uring_cqe* cqes;
+	unsigned int cq_mask;
+
+	// registered buffers
+	hiw_memory_view buffers[HIW_URING_MAX_BUFFERS];
+	int buffer_count;
+
+	// can registered buffers be used together with sockets
+	bool fixed_supported;
+
+	// is multishot accept supported by the kernel
+	bool multishot_supported;
+
+	// the server socket the accept is armed for
+	SOCKET accept_socket;
+
+	// is an accept armed
+	bool accept_armed;
+
+	// is a cancel of the armed accept requested
+	bool accept_cancelling;
+
+	// the error of the last accept, if any
+	int accept_error;
+
+	// is a timeout armed for a waiting accept
+	bool accept_timer_armed;
+
+	// did the armed accept timeout expire
+	bool accept_timed_out;
+
+	// the accept timeout. Kept alive until the timeout is submitted
+	struct __kernel_timespec accept_timeout;
+
+	// sockets accepted but not yet returned to the caller
+	SOCKET* accepted;
+	int accepted_first;
+	int accepted_count;
+	int accepted_capacity;
+
+	// result of the current recv or send
+	bool io_done;
+	int io_result;
+};
+
+int hiw_internal_uring_sys_setup(const unsigned int entries, struct io_uring_params* const p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int hiw_internal_uring_sys_enter(const int fd, const unsigned int to_submit, const unsigned int min_complete,
+							   const unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int hiw_internal_uring_sys_register(const int fd, const unsigned int opcode, const void* const arg,
+								  const unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+void hiw_internal_uring_unmap(hiw_uring* const r)
+{
+	if (r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_size);
+	if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED)
+		munmap(r->sq_ptr, r->sq_size);
+}
+
+hiw_uring* hiw_uring_new(const unsigned int entries)
+{
+	// Prefer telling the kernel that only one thread is submitting work, but fall back to the default
+	// behaviour on older kernels
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	int fd = hiw_internal_uring_sys_setup(entries, &p);
+	if (fd < 0 && errno == EINVAL)
+	{
+		memset(&p, 0, sizeof(p));
+		fd = hiw_internal_uring_sys_setup(entries, &p);
+	}
+	if (fd < 0)
+	{
+		log_warnf("io_uring is not available: error(%d)", errno);
+		return NULL;
+	}
+
+	hiw_uring* const r = hiw_malloc(sizeof(hiw_uring));
+	memset(r, 0, sizeof(hiw_uring));
+	r->fd = fd;
+	r->fixed_supported = true;
+	r->multishot_supported = true;
+	r->accept_socket = INVALID_SOCKET;
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (hiw_bit_test(p.features, IORING_FEAT_SINGLE_MMAP))
+	{
+		if (r->cq_size > r->sq_size)
+			r->sq_size = r->cq_size;
+		r->cq_size = r->sq_size;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (hiw_bit_test(p.features, IORING_FEAT_SINGLE_MMAP))
+		r->cq_ptr = r->sq_ptr;
+	else
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		log_errorf("could not map io_uring memory: error(%d)", errno);
+		hiw_internal_uring_unmap(r);
+		close(fd);
+		free(r);
+		return NULL;
+	}
+
+	char* const sq = r->sq_ptr;
+	r->sq_head = (unsigned int*)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+	r->sq_array = (unsigned int*)(sq + p.sq_off.array);
+	r->sq_mask = *(unsigned int*)(sq + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_local_tail = *r->sq_tail;
+
+	char* const cq = r->cq_ptr;
+	r->cq_head = (unsigned int*)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	r->cq_mask = *(unsigned int*)(cq + p.cq_off.ring_mask);
+
+	log_debugf("hiw_uring(%p) created with %u entries", r, p.sq_entries);
+	return r;
+}
+
+void hiw_uring_delete(hiw_uring* const r)
+{
+	assert(r != NULL && "expected 'r' to exist");
+	if (r == NULL)
+		return;
+
+	// close sockets that are accepted but never handed to the caller
+	for (int i = 0; i < r->accepted_count; ++i)
+		hiw_socket_release(r->accepted[(r->accepted_first + i) % r->accepted_capacity]);
+	if (r->accepted != NULL)
+		free(r->accepted);
+
+	// closing the ring cancels all pending operations
+	hiw_internal_uring_unmap(r);
+	close(r->fd);
+	log_debugf("hiw_uring(%p) deleted", r);
+	free(r);
+}
+
+bool hiw_uring_register_buffers(hiw_uring* const r, const hiw_memory_view* const buffers, const int count)
+{
+	assert(r != NULL && "expected 'r' to exist");
+	if (count > HIW_URING_MAX_BUFFERS || r->buffer_count > 0)
+		return false;
+
+	struct iovec iov[HIW_URING_MAX_BUFFERS];
+	for (int i = 0; i < count; ++i)
+		iov[i] = (struct iovec){.iov_base = (void*)buffers[i].begin, .iov_len = buffers[i].length};
+
+	if (hiw_internal_uring_sys_register(r->fd, IORING_REGISTER_BUFFERS, iov, count) < 0)
+	{
+		log_warnf("hiw_uring(%p) could not register buffers: error(%d)", r, errno);
+		return false;
+	}
+
+	for (int i = 0; i < count; ++i)
+		r->buffers[i] = buffers[i];
+	r->buffer_count = count;
+	return true;
+}
+
+/**
+ * @brief Submit all prepared submission queue entries and wait for the supplied number of completions
+ */
+bool hiw_internal_uring_submit(hiw_uring* const r, const unsigned int wait_nr)
+{
+	// make the prepared entries visible to the kernel
+	atomic_store_explicit((_Atomic unsigned int*)r->sq_tail, r->sq_local_tail, memory_order_release);
+	const unsigned int to_submit =
+		r->sq_local_tail - atomic_load_explicit((_Atomic unsigned int*)r->sq_head, memory_order_acquire);
+
+	while (1)
+	{
+		const int ret =
+			hiw_internal_uring_sys_enter(r->fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+		if (ret >= 0)
+			return true;
+		if (errno == EINTR)
+			continue;
+		log_errorf("hiw_uring(%p) could not submit work: error(%d)", r, errno);
+		return false;
+	}
+}
+
+/**
+ * @brief Get a free submission queue entry. Submits already prepared entries if the queue is full
+ */
+struct io_uring_sqe* hiw_internal_uring_get_sqe(hiw_uring* const r)
+{
+	const unsigned int head = atomic_load_explicit((_Atomic unsigned int*)r->sq_head, memory_order_acquire);
+	if (r->sq_local_tail - head >= r->sq_entries)
+	{
+		if (!hiw_internal_uring_submit(r, 0))
+			return NULL;
+	}
+
+	const unsigned int index = r->sq_local_tail & r->sq_mask;
+	struct io_uring_sqe* const sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->sq_array[index] = index;
+	r->sq_local_tail++;
+	return sqe;
+}
+
+/**
+ * @brief Put an accepted socket at the end of the accepted sockets
+ */
+void hiw_internal_uring_accepted_push(hiw_uring* const r, const SOCKET s)
+{
+	if (r->accepted_count == r->accepted_capacity)
+	{
+		const int new_capacity = r->accepted_capacity == 0 ? 8 : r->accepted_capacity * 2;
+		SOCKET* const new_memory = hiw_malloc((int)sizeof(SOCKET) * new_capacity);
+		for (int i = 0; i < r->accepted_count; ++i)
+			new_memory[i] = r->accepted[(r->accepted_first + i) % r->accepted_capacity];
+		if (r->accepted != NULL)
+			free(r->accepted);
+		r->accepted = new_memory;
+		r->accepted_first = 0;
+		r->accepted_capacity = new_capacity;
+	}
+	r->accepted[(r->accepted_first + r->accepted_count) % r->accepted_capacity] = s;
+	r->accepted_count++;
+}
+
+/**
+ * @brief Process all completions
+ */
+void hiw_internal_uring_reap(hiw_uring* const r)
+{
+	unsigned int head = *r->cq_head;
+	const unsigned int tail = atomic_load_explicit((_Atomic unsigned int*)r->cq_tail, memory_order_acquire);
+	for (; head != tail; ++head)
+	{
+		const struct io_uring_cqe* const cqe = &r->cqes[head & r->cq_mask];
+		switch (cqe->user_data)
+		{
+		case HIW_URING_OP_ACCEPT:
+			if (cqe->res >= 0)
+				hiw_internal_uring_accepted_push(r, cqe->res);
+			else if (cqe->res != -ECANCELED)
+				r->accept_error = -cqe->res;
+			if (!hiw_bit_test(cqe->flags, IORING_CQE_F_MORE))
+			{
+				r->accept_armed = false;
+				r->accept_cancelling = false;
+			}
+			break;
+		case HIW_URING_OP_IO:
+			r->io_done = true;
+			r->io_result = cqe->res;
+			break;
+		case HIW_URING_OP_ACCEPT_TIMEOUT:
+			r->accept_timer_armed = false;
+			r->accept_timed_out = cqe->res == -ETIME;
+			break;
+		default:
+			break;
+		}
+	}
+	atomic_store_explicit((_Atomic unsigned int*)r->cq_head, head, memory_order_release);
+}
+
+/**
+ * @brief Arm an accept on the supplied server socket
+ */
+bool hiw_internal_uring_arm_accept(hiw_uring* const r, const SOCKET server_socket)
+{
+	struct io_uring_sqe* const sqe = hiw_internal_uring_get_sqe(r);
+	if (sqe == NULL)
+		return false;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = server_socket;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	if (r->multishot_supported)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = HIW_URING_OP_ACCEPT;
+	r->accept_socket = server_socket;
+	r->accept_armed = true;
+	r->accept_cancelling = false;
+	r->accept_error = 0;
+	return true;
+}
+
+/**
+ * @brief Prepare a cancel of the armed accept. The cancel is submitted together with the next operation
+ */
+void hiw_internal_uring_cancel_accept(hiw_uring* const r)
+{
+	if (!r->accept_armed || r->accept_cancelling)
+		return;
+	struct io_uring_sqe* const sqe = hiw_internal_uring_get_sqe(r);
+	if (sqe == NULL)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = HIW_URING_OP_ACCEPT;
+	sqe->user_data = HIW_URING_OP_IGNORE;
+	r->accept_cancelling = true;
+}
+
+/**
+ * @brief Arm a timeout that wakes up a waiting accept
+ */
+bool hiw_internal_uring_arm_accept_timeout(hiw_uring* const r, const unsigned int timeout)
+{
+	struct io_uring_sqe* const sqe = hiw_internal_uring_get_sqe(r);
+	if (sqe == NULL)
+		return false;
+	r->accept_timeout.tv_sec = timeout / 1000;
+	r->accept_timeout.tv_nsec = (long long)(timeout % 1000) * 1000000;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long long)&r->accept_timeout;
+	sqe->len = 1;
+	sqe->user_data = HIW_URING_OP_ACCEPT_TIMEOUT;
+	r->accept_timer_armed = true;
+	return true;
+}
+
+SOCKET hiw_uring_accept(hiw_uring* const r, const SOCKET server_socket, const unsigned int timeout)
+{
+	assert(r != NULL && "expected 'r' to exist");
+
+	// A timeout left from an earlier accept is reused. If it expires early, then the caller sees a shorter timeout
+	r->accept_timed_out = false;
+	while (r->accepted_count == 0)
+	{
+		if (!r->accept_armed || r->accept_socket != server_socket)
+		{
+			if (!hiw_internal_uring_arm_accept(r, server_socket))
+				return INVALID_SOCKET;
+		}
+		if (timeout > 0 && !r->accept_timer_armed)
+		{
+			if (!hiw_internal_uring_arm_accept_timeout(r, timeout))
+				return INVALID_SOCKET;
+		}
+
+		if (!hiw_internal_uring_submit(r, 1))
+			return INVALID_SOCKET;
+		hiw_internal_uring_reap(r);
+
+		if (r->accepted_count == 0 && r->accept_error != 0)
+		{
+			// multishot accept was added in linux 5.19. Try again without it if the kernel rejects it
+			if (r->accept_error == EINVAL && r->multishot_supported)
+			{
+				log_debugf("hiw_uring(%p) multishot accept is not supported", r);
+				r->multishot_supported = false;
+				r->accept_error = 0;
+				continue;
+			}
+			errno = r->accept_error;
+			r->accept_error = 0;
+			return INVALID_SOCKET;
+		}
+
+		// The armed accept is kept, so that clients arriving before the next call are still accepted
+		if (r->accepted_count == 0 && r->accept_timed_out)
+		{
+			r->accept_timed_out = false;
+			errno = ETIME;
+			return INVALID_SOCKET;
+		}
+	}
+
+	const SOCKET s = r->accepted[r->accepted_first];
+	r->accepted_first = (r->accepted_first + 1) % r->accepted_capacity;
+	r->accepted_count--;
+
+	// The caller is about to serve the new client. Stop accepting more clients on this ring, so that they
+	// are accepted by a servlet thread that's waiting for them instead
+	if (r->accepted_count == 0)
+		hiw_internal_uring_cancel_accept(r);
+	return s;
+}
+
+/**
+ * @return The index of the registered buffer that contains the supplied memory; -1 if none
+ */
+int hiw_internal_uring_find_buffer(const hiw_uring* const r, const char* const ptr, const int len)
+{
+	if (!r->fixed_supported)
+		return -1;
+	for (int i = 0; i < r->buffer_count; ++i)
+	{
+		const char* const begin = r->buffers[i].begin;
+		if (ptr >= begin && ptr + len <= begin + r->buffers[i].length)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * @brief Submit a prepared recv or send, and wait for it to complete
+ */
+int hiw_internal_uring_io(hiw_uring* const r, struct io_uring_sqe* const sqe, const unsigned int timeout)
+{
+	sqe->user_data = HIW_URING_OP_IO;
+
+	struct __kernel_timespec ts;
+	if (timeout > 0)
+	{
+		sqe->flags |= IOSQE_IO_LINK;
+		struct io_uring_sqe* const tsqe = hiw_internal_uring_get_sqe(r);
+		if (tsqe == NULL)
+			return -1;
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+		tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+		tsqe->addr = (unsigned long long)&ts;
+		tsqe->len = 1;
+		tsqe->user_data = HIW_URING_OP_IGNORE;
+	}
+
+	r->io_done = false;
+	while (!r->io_done)
+	{
+		if (!hiw_internal_uring_submit(r, 1))
+			return -1;
+		hiw_internal_uring_reap(r);
+	}
+
+	if (r->io_result < 0)
+	{
+		log_debugf("hiw_uring(%p) operation failed: error(%d)", r, -r->io_result);
+		errno = r->io_result == -ECANCELED ? ETIMEDOUT : -r->io_result;
+		return -1;
+	}
+	return r->io_result;
+}
+
+int hiw_uring_recv(hiw_uring* const r, const SOCKET s, char* const dest, const int len, const unsigned int timeout)
+{
+	assert(r != NULL && "expected 'r' to exist");
+	assert(dest != NULL && "expected 'dest' to exist");
+	if (dest == NULL)
+		return -1;
+	if (len == 0)
+		return 0;
+
+	const int buffer = hiw_internal_uring_find_buffer(r, dest, len);
+	struct io_uring_sqe* const sqe = hiw_internal_uring_get_sqe(r);
+	if (sqe == NULL)
+		return -1;
+	sqe->fd = s;
+	sqe->addr = (unsigned long long)dest;
+	sqe->len = len;
+	if (buffer >= 0)
+	{
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = buffer;
+	}
+	else
+	{
+		sqe->opcode = IORING_OP_RECV;
+	}
+
+	const int ret = hiw_internal_uring_io(r, sqe, timeout);
+	if (ret < 0 && buffer >= 0 && errno == EINVAL)
+	{
+		// fixed buffers are not supported for sockets by this kernel
+		r->fixed_supported = false;
+		return hiw_uring_recv(r, s, dest, len, timeout);
+	}
+	return ret;
+}
+
+int hiw_uring_send(hiw_uring* const r, const SOCKET s, const char* const src, const int len,
+				   const unsigned int timeout)
+{
+	assert(r != NULL && "expected 'r' to exist");
+	assert(src != NULL && "expected 'src' to exist");
+	if (src == NULL)
+		return -1;
+	if (len == 0)
+		return 0;
+
+	const int buffer = hiw_internal_uring_find_buffer(r, src, len);
+	struct io_uring_sqe* const sqe = hiw_internal_uring_get_sqe(r);
+	if (sqe == NULL)
+		return -1;
+	sqe->fd = s;
+	sqe->addr = (unsigned long long)src;
+	sqe->len = len;
+	if (buffer >= 0)
+	{
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->buf_index = buffer;
+	}
+	else
+	{
+		sqe->opcode = IORING_OP_SEND;
+		sqe->msg_flags = HIW_SOCKET_SEND_FLAGS;
+	}
+
+	const int ret = hiw_internal_uring_io(r, sqe, timeout);
+	if (ret < 0 && buffer >= 0 && errno == EINVAL)
+	{
+		// fixed buffers are not supported for sockets by this kernel
+		r->fixed_supported = false;
+		return hiw_uring_send(r, s, src, len, timeout);
+	}
+	return ret;
+}
+
+int hiw_uring_sendv(hiw_uring* const r, const SOCKET s, const hiw_memory_view* const views, const int count,
+					const bool more, const unsigned int timeout)
+{
+	assert(r != NULL && "expected 'r' to exist");
+	assert(views != NULL && "expected 'views' to exist");
+	assert(count <= HIW_SOCKET_MAX_SEND_VIEWS && "expected at most HIW_SOCKET_MAX_SEND_VIEWS views");
+	if (views == NULL || count > HIW_SOCKET_MAX_SEND_VIEWS)
+		return -1;
+	if (count == 0)
+		return 0;
+
+	// The message must be kept alive until the operation is completed
+	struct iovec iov[HIW_SOCKET_MAX_SEND_VIEWS];
+	for (int i = 0; i < count; ++i)
+		iov[i] = (struct iovec){.iov_base = (void*)views[i].begin, .iov_len = views[i].length};
+	struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+
+	struct io_uring_sqe* const sqe = hiw_internal_uring_get_sqe(r);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = s;
+	sqe->addr = (unsigned long long)&msg;
+	sqe->len = 1;
+	sqe->msg_flags = more ? MSG_MORE | HIW_SOCKET_SEND_FLAGS : HIW_SOCKET_SEND_FLAGS;
+	return hiw_internal_uring_io(r, sqe, timeout);
+}
+
+#else
+
+hiw_uring* hiw_uring_new(const unsigned int entries)
+{
+	log_warn("io_uring is not supported on this platform");
+	return NULL;
+}
+
+void hiw_uring_delete(hiw_uring* const r) {}
+
+bool hiw_uring_register_buffers(hiw_uring* const r, const hiw_memory_view* const buffers, const int count)
+{
+	return false;
+}
+
+SOCKET hiw_uring_accept(hiw_uring* const r, const SOCKET server_socket, const unsigned int timeout)
+{
+	return INVALID_SOCKET;
+}
+
+int hiw_uring_recv(hiw_uring* const r, const SOCKET s, char* const dest, const int len, const unsigned int timeout)
+{
+	return -1;
+}
+
+int hiw_uring_send(hiw_uring* const r, const SOCKET s, const char* const src, const int len,
+				   const unsigned int timeout)
+{
+	return -1;
+}
+
+int hiw_uring_sendv(hiw_uring* const r, const SOCKET s, const hiw_memory_view* const views, const int count,
+					const bool more, const unsigned int timeout)
+{
+	return -1;
+}
+
+#endif
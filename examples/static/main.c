@@ -24,7 +24,10 @@ void on_request(hiw_request* const req, hiw_response* const resp)
 			hiw_response_set_status_code(resp, 200);
 			hiw_response_set_content_length(resp, c->length);
 			hiw_response_set_content_type(resp, c->mime_type);
-			hiw_response_write_body_raw(resp, c->memory, c->length);
+			if (c->fd >= 0)
+				hiw_response_send_file(resp, c->fd, 0, c->length);
+			else
+				hiw_response_write_body_raw(resp, c->memory, c->length);
 			return;
 		}
 	}
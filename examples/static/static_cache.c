@@ -11,12 +11,20 @@
 #include <sys/types.h>
 
 #if defined(_WIN32)
-
+#include <io.h>
+#define dup _dup
+#define fileno _fileno
+#define close _close
+#else
+#include <unistd.h>
 #endif
 
 // default cache capacity
 static const int cache_content_capacity = 64;
 
+// files larger than this are not read into memory. They are kept open and sent directly from the file instead
+static const int cache_max_memory_size = 64 * 1024;
+
 bool static_cache_add(static_cache* cache, const hiw_file* file)
 {
 	log_infof("Caching path: '%.*s', filename: '%.*s', suffix: '%.*s'", file->path.length, file->path.begin,
@@ -38,17 +46,34 @@ bool static_cache_add(static_cache* cache, const hiw_file* file)
 	const int size = ftell(f);
 	fseek(f, 0, SEEK_SET);
 
-	char* buf = hiw_memory_get(&cache->memory, size);
-	if (buf == NULL)
+	char* buf = NULL;
+	int fd = -1;
+	if (size > cache_max_memory_size)
 	{
-		log_error("out of memory");
-		return false;
+		fd = dup(fileno(f));
+		if (fd < 0)
+		{
+			log_errorf("could not keep file '%s' open", file->filename.begin);
+			fclose(f);
+			return false;
+		}
 	}
-
-	if (fread(buf, size, 1, f) != 1)
+	else
 	{
-		log_errorf("failed to read '%s' into memory", file->filename.begin);
-		return false;
+		buf = hiw_memory_get(&cache->memory, size);
+		if (buf == NULL)
+		{
+			log_error("out of memory");
+			fclose(f);
+			return false;
+		}
+
+		if (size > 0 && fread(buf, size, 1, f) != 1)
+		{
+			log_errorf("failed to read '%s' into memory", file->filename.begin);
+			fclose(f);
+			return false;
+		}
 	}
 	fclose(f);
 
@@ -69,6 +94,7 @@ bool static_cache_add(static_cache* cache, const hiw_file* file)
 		.uri = (hiw_string){.begin = filename_copy, .length = filename_length},
 		.mime_type = hiw_mimetype_from_filename((hiw_string){.begin = filename_copy, .length = filename_length}),
 		.memory = buf,
+		.fd = fd,
 		.length = size,
 	};
 
@@ -109,6 +135,11 @@ bool static_cache_init(static_cache* cache, hiw_string base_dir)
 void static_cache_release(static_cache* cache)
 {
 	if (cache->content)
+	{
+		for (int i = 0; i < cache->content_count; ++i)
+			if (cache->content[i].fd >= 0)
+				close(cache->content[i].fd);
 		free(cache->content);
+	}
 	hiw_memory_release(&cache->memory);
 }
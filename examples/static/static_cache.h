@@ -19,9 +19,12 @@ typedef struct static_content
 	// the mime type of the file
 	hiw_string mime_type;
 
-	// memory where the content is located
+	// memory where the content is located; NULL if the content is sent directly from the file
 	const char* memory;
 
+	// the open file, if the content is too large to be kept in memory; -1 otherwise
+	int fd;
+
 	// the length of the memory
 	int length;
 } static_content;
@@ -23,6 +23,20 @@ extern "C" {
 #define HIW_MAX_HEADER_SIZE (8 * 1024)
 #endif
 
+// response body content is buffered together with the response header until the buffered output would exceed this
+// number of bytes. The buffered output is then sent to the client with as few system calls as possible. The output is
+// buffered in HIW_MAX_HEADER_SIZE bytes of memory, so a larger threshold behaves as HIW_MAX_HEADER_SIZE
+#if !defined(HIW_RESPONSE_FLUSH_THRESHOLD)
+#define HIW_RESPONSE_FLUSH_THRESHOLD (4096)
+#endif
+
+// response body content of at least this number of bytes, written with one call, is sent to the client without
+// copying it into the socket buffer. The write waits until the client has acknowledged the content, so that the
+// memory can be reused when the write returns. 0 disables zero-copy sends
+#if !defined(HIW_RESPONSE_ZEROCOPY_THRESHOLD)
+#define HIW_RESPONSE_ZEROCOPY_THRESHOLD (0)
+#endif
+
 // should the server write out the server header
 #if !defined(HIW_WRITE_SERVER_HEADER)
 #define HIW_WRITE_SERVER_HEADER 1
@@ -75,6 +89,22 @@ struct HIW_PUBLIC hiw_filter_chain
 	const hiw_filter* filters;
 };
 
+/**
+ * How the servlet threads are waiting for incoming requests
+ */
+enum HIW_PUBLIC hiw_servlet_mode
+{
+	// Each servlet thread blocks while accepting a new client and while waiting for the client's requests. One
+	// servlet thread serves exactly one client at a time. This is the default value
+	HIW_SERVLET_MODE_BLOCKING = 0,
+
+	// Each servlet thread runs an event loop over non-blocking sockets and serves many clients at the same time. The
+	// filter chain is only invoked when the entire request header is received. Only supported on Linux
+	HIW_SERVLET_MODE_EVENT_LOOP
+};
+
+typedef enum hiw_servlet_mode hiw_servlet_mode;
+
 /**
  * Configuration
  */
@@ -83,6 +113,66 @@ struct HIW_PUBLIC hiw_servlet_config
 	// number of threads
 	int num_accept_threads;
 
+	// how the servlet threads are waiting for incoming requests
+	hiw_servlet_mode mode;
+
+	// Should idle keep-alive connections be handed over to a poller shared by all servlet threads, instead of
+	// keeping a servlet thread waiting for the client's next request. Only used in blocking mode with the socket
+	// I/O backend and only supported on Linux
+	bool park_idle_connections;
+
+	// Should each servlet thread accept clients from it's own server socket bound to the same port. The operating
+	// system then distributes new clients over the servlet threads, instead of all threads waiting for the same
+	// accept queue. Requires SO_REUSEPORT
+	bool shard_server_socket;
+
+	// How long, in milliseconds, an idle keep-alive connection is kept open while waiting for the client's next
+	// request. 0 falls back to the read timeout of the server socket
+	unsigned int keep_alive_timeout;
+
+	// How long, in milliseconds, the client is given to send the entire request header. The request body is not
+	// included, so slow uploads are not affected. 0 disables the deadline
+	unsigned int header_read_timeout;
+
+	// How long, in milliseconds, the client is given to receive the entire response. 0 disables the deadline
+	unsigned int response_write_timeout;
+
+	// How long, in milliseconds, requests that are in-flight when the servlet is stopped are allowed to finish. Idle
+	// connections are closed right away and in-flight connections are closed after their current response. The
+	// connections that are still in-flight when the time is up are forcefully closed
+	unsigned int drain_timeout;
+
+	// The cpus the servlet threads are pinned to. Servlet thread i is pinned to cpus[i % cpu_count], where the
+	// calling thread is servlet thread 0. A pinned thread's request and response memory is allocated from the memory
+	// node local to it's cpu. NULL if the servlet threads are allowed to run on any cpu
+	const int* cpus;
+
+	// The number of cpus in the cpus array
+	int cpu_count;
+
+	// Should a new client be accepted by the servlet thread pinned to the cpu that received the client's packets, so
+	// that the connection, the servlet thread's memory and the network interrupt are kept on one cpu. Requires
+	// shard_server_socket and cpus. Clients are not steered when idle connections are parked, since parked
+	// connections are served by any servlet thread. Only supported on Linux
+	bool steer_connections;
+
+	// The maximum number of responses detached from the servlet threads at the same time, see hiw_servlet_detach. 0
+	// if responses are never detached
+	int max_detached;
+
+	// The thread pool running the detached responses. A thread pool with up to max_detached threads is created by the
+	// servlet if NULL
+	hiw_thread_pool* detach_pool;
+
+	// Should each request be served by a fiber, so that a servlet function waiting for the client yields to the
+	// servlet thread's event loop instead of blocking it. The servlet thread is then free to serve other clients while
+	// a slow client is receiving the response or sending the request body. Only used in event loop mode
+	bool fibers;
+
+	// The stack size, in bytes, of the fibers serving the requests. The request and the response are kept on the
+	// fiber's stack. 0 uses HIW_FIBER_DEFAULT_STACK_SIZE
+	int fiber_stack_size;
+
 	// Generic global user-data
 	void* userdata;
 };
@@ -92,9 +182,59 @@ typedef struct hiw_servlet_config hiw_servlet_config;
 // the default port
 #define HIW_SERVLET_DEFAULT_NUM_ACCEPT_THREADS (8)
 
+// maximum number of events handled by a servlet thread's event loop each time it wakes up
+#if !defined(HIW_SERVLET_MAX_POLL_EVENTS)
+#define HIW_SERVLET_MAX_POLL_EVENTS (64)
+#endif
+
+// how often, in milliseconds, a waiting servlet thread wakes up to see if the server is shutting down
+#if !defined(HIW_SERVLET_POLL_TIMEOUT)
+#define HIW_SERVLET_POLL_TIMEOUT (500)
+#endif
+
+// the default keep-alive timeout, in milliseconds. 0 falls back to the read timeout of the server socket
+#if !defined(HIW_SERVLET_DEFAULT_KEEP_ALIVE_TIMEOUT)
+#define HIW_SERVLET_DEFAULT_KEEP_ALIVE_TIMEOUT (0)
+#endif
+
+// the default request header deadline, in milliseconds. 0 disables the deadline
+#if !defined(HIW_SERVLET_DEFAULT_HEADER_READ_TIMEOUT)
+#define HIW_SERVLET_DEFAULT_HEADER_READ_TIMEOUT (0)
+#endif
+
+// the default response deadline, in milliseconds. 0 disables the deadline
+#if !defined(HIW_SERVLET_DEFAULT_RESPONSE_WRITE_TIMEOUT)
+#define HIW_SERVLET_DEFAULT_RESPONSE_WRITE_TIMEOUT (0)
+#endif
+
+// the default time, in milliseconds, in-flight requests are allowed to finish when the servlet is stopped
+#if !defined(HIW_SERVLET_DEFAULT_DRAIN_TIMEOUT)
+#define HIW_SERVLET_DEFAULT_DRAIN_TIMEOUT (30000)
+#endif
+
+// maximum number of fibers kept by a servlet thread for reuse, after the requests they served are done
+#if !defined(HIW_SERVLET_FIBER_CACHE_SIZE)
+#define HIW_SERVLET_FIBER_CACHE_SIZE (64)
+#endif
+
+// the default maximum number of responses detached from the servlet threads at the same time
+#if !defined(HIW_SERVLET_DEFAULT_MAX_DETACHED)
+#define HIW_SERVLET_DEFAULT_MAX_DETACHED (16)
+#endif
+
 // default configuration
 #define hiw_servlet_config_default                                                                                     \
-	(hiw_servlet_config) { .num_accept_threads = HIW_SERVLET_DEFAULT_NUM_ACCEPT_THREADS, .userdata = NULL }
+	(hiw_servlet_config)                                                                                               \
+	{                                                                                                                  \
+		.num_accept_threads = HIW_SERVLET_DEFAULT_NUM_ACCEPT_THREADS, .mode = HIW_SERVLET_MODE_BLOCKING,               \
+		.park_idle_connections = true, .shard_server_socket = false,                                                   \
+		.keep_alive_timeout = HIW_SERVLET_DEFAULT_KEEP_ALIVE_TIMEOUT,                                                  \
+		.header_read_timeout = HIW_SERVLET_DEFAULT_HEADER_READ_TIMEOUT,                                                \
+		.response_write_timeout = HIW_SERVLET_DEFAULT_RESPONSE_WRITE_TIMEOUT,                                          \
+		.drain_timeout = HIW_SERVLET_DEFAULT_DRAIN_TIMEOUT, .cpus = NULL, .cpu_count = 0,                              \
+		.steer_connections = false, .max_detached = HIW_SERVLET_DEFAULT_MAX_DETACHED, .detach_pool = NULL,           \
+		.fibers = false, .fiber_stack_size = 0, .userdata = NULL                                                       \
+	}
 
 typedef struct hiw_servlet_thread hiw_servlet_thread;
 
@@ -109,6 +249,9 @@ typedef struct hiw_servlet hiw_servlet;
 // A flag that the servlet owns the memory of the server
 #define hiw_servlet_flags_server_owner (1 << 0)
 
+// A flag that the servlet owns the thread pool running the detached responses
+#define hiw_servlet_flags_detach_pool_owner (1 << 1)
+
 enum HIW_PUBLIC hiw_servlet_error
 {
 	// No error
@@ -174,6 +317,20 @@ HIW_PUBLIC extern void hiw_servlet_set_starter_func(hiw_servlet* s, hiw_servlet_
  */
 HIW_PUBLIC extern hiw_servlet_error hiw_servlet_start(hiw_servlet* s, const hiw_servlet_config* config);
 
+/**
+ * Add a listener to the servlet. A listener is another servlet, accepting clients from it's own server, that is
+ * started and stopped together with the supplied servlet. This is useful for a management port, such as health
+ * checks, since the listener uses it's own filter chain and threads and keeps responding even if all threads of
+ * the supplied servlet are busy
+ *
+ * @param s the servlet
+ * @param listener the listener. Ownership is given to the supplied servlet, which deletes it when it's deleted
+ * @param config the listener config. All accept threads are spawned, since the calling thread is used by s. Can be NULL
+ * @return HIW_SERVLET_ERROR_SUCCESS if the listener was added
+ */
+HIW_PUBLIC extern hiw_servlet_error hiw_servlet_add_listener(hiw_servlet* s, hiw_servlet* listener,
+															 const hiw_servlet_config* config);
+
 /**
  * Get the user-data from the supplied filter in a filter chain
  *
@@ -197,6 +354,25 @@ HIW_PUBLIC extern void hiw_filter_chain_next(hiw_request* req, hiw_response* res
  */
 HIW_PUBLIC extern void hiw_servlet_start_filter_chain(hiw_servlet_thread* st);
 
+/**
+ * Detach the response from the servlet thread. The supplied function is called by a thread pool worker with the same
+ * request and response, and the servlet thread goes back to serving other clients while a large, or slow, response
+ * is produced. The caller is expected to return right after this function is called, without using the request or the
+ * response again.
+ *
+ * The function is called right away by the calling thread instead if the response can't be detached, for example if
+ * max_detached responses are already detached, or if the response has already told the client that the connection is
+ * kept alive while the connection can't be reused. A detached connection is closed when the response is done, unless
+ * the servlet parks idle connections. Requests that the client has pipelined after the detached one are discarded, and
+ * the connection is closed
+ *
+ * @param req the request
+ * @param resp the response
+ * @param func the function producing the response
+ * @return true if the response is detached
+ */
+HIW_PUBLIC extern bool hiw_servlet_detach(hiw_request* req, hiw_response* resp, hiw_servlet_fn func);
+
 /**
  * Get the thread associated with the supplied request
  *
@@ -254,6 +430,20 @@ HIW_PUBLIC extern bool hiw_response_write_header(hiw_response* resp, hiw_header
  */
 HIW_PUBLIC extern bool hiw_response_write_body_raw(hiw_response* resp, const char* src, int n);
 
+/**
+ * @brief send the content of a file to the client. The content is sent directly from the file to the socket, without
+ *        being copied into the response memory
+ * @param resp The response
+ * @param fd The file descriptor of an open file
+ * @param offset Where in the file to start sending from
+ * @param length The number of bytes to send
+ * @return true if sending the file content was successful
+ *
+ * The content-length header is set to length, if no content-length header is written before this function is called.
+ * Please note that this will forcefully send all headers. The file is not closed
+ */
+HIW_PUBLIC extern bool hiw_response_send_file(hiw_response* resp, int fd, long long offset, int length);
+
 /**
  * @brief write the content-type header to the supplier response
  * @param resp The response
@@ -4,9 +4,15 @@
 //
 
 #include "hiw_servlet.h"
+#include "hiw_fiber.h"
 #include "hiw_logger.h"
+#include "hiw_poller.h"
 #include <assert.h>
 
+typedef struct hiw_servlet_parked hiw_servlet_parked;
+typedef struct hiw_servlet_detached hiw_servlet_detached;
+typedef struct hiw_servlet_active hiw_servlet_active;
+
 /**
  * The servlet is the entry-point of all http requests
  */
@@ -33,6 +39,40 @@ struct hiw_servlet
 
 	// Flags associated with the servlet
 	int flags;
+
+	// Poller, shared by all servlet threads, where idle keep-alive connections are parked while waiting for the
+	// client's next request. NULL if connections are not parked
+	hiw_poller* parking;
+
+	// Critical section protecting the linked list of parked connections
+	hiw_thread_critical_sec* parking_lock;
+
+	// One entry for each server socket shard added to the parking poller
+	hiw_servlet_parked* parking_shards;
+
+	// The connection that has been parked the longest
+	hiw_servlet_parked* parked_first;
+
+	// The connection that was parked most recently
+	hiw_servlet_parked* parked_last;
+
+	// The first listener, which is started and stopped together with this servlet
+	hiw_servlet* listeners;
+
+	// The next listener of the servlet this servlet is a listener for
+	hiw_servlet* next_listener;
+
+	// Thread pool running the detached responses. NULL if responses are never detached
+	hiw_thread_pool* detach_pool;
+
+	// Critical section protecting the linked list of detached responses
+	hiw_thread_critical_sec* detach_lock;
+
+	// The first detached response in a linked list of responses
+	hiw_servlet_detached* detached;
+
+	// The number of detached responses
+	int detached_count;
 };
 
 /**
@@ -49,6 +89,27 @@ struct hiw_servlet_thread
 	// The filter chain used in this servlet thread
 	hiw_filter_chain filter_chain;
 
+	// The server socket shard this thread is accepting new clients from
+	int shard;
+
+	// Clients that are reused by this thread when accepting new clients
+	hiw_client_cache clients;
+
+	// Protects the active requests, whose sockets are shut down by another thread if they are in-flight for too long
+	// when the servlet is stopped
+	hiw_thread_critical_sec* lock;
+
+	// The requests that are currently processed. More than one request is in-flight when the requests are served by
+	// fibers. NULL if no request is in-flight
+	hiw_servlet_active* active;
+
+	// The poller of the thread's event loop. NULL if the thread is not running an event loop
+	hiw_poller* poller;
+
+	// The parked connection of the client whose request is currently processed. NULL if the client is not parked
+	// between requests
+	hiw_servlet_parked* parked;
+
 	// The next thread
 	hiw_servlet_thread* next;
 };
@@ -107,6 +168,10 @@ struct hiw_request
 
 	// How much of the content length is left to be read
 	int content_length_remaining;
+
+	// How many bytes of the request that's already received into the request memory before the
+	// headers are parsed. This is used when the request header is received by an event loop
+	int buffered_length;
 };
 
 // An error has occurred during the writing
@@ -124,6 +189,18 @@ struct hiw_request
 // The status code is written
 #define hiw_internal_response_flag_status_code_set (1 << 4)
 
+// The response deadline is started
+#define hiw_internal_response_flag_deadline_set (1 << 5)
+
+// The buffered output is held back, so that it's sent together with the response of the client's next pipelined request
+#define hiw_internal_response_flag_held (1 << 6)
+
+// The response is detached from the servlet thread
+#define hiw_internal_response_flag_detached (1 << 7)
+
+// The connection is closed when the response is done, regardless of what the servlet asks for
+#define hiw_internal_response_flag_must_close (1 << 8)
+
 struct hiw_response
 {
 	// response headers
@@ -157,6 +234,9 @@ struct hiw_response
 
 	// Keep track of the expected number of bytes left to be sent
 	int content_bytes_left;
+
+	// The number of bytes, at the beginning of the memory, held back for the client's previous pipelined requests
+	int held_length;
 };
 
 void hiw_servlet_start_func_default(hiw_servlet_thread* st);
@@ -199,7 +279,9 @@ void hiw_internal_response_init(hiw_response* const resp, hiw_servlet_thread* co
 	hiw_memory_fixed_init(&resp->memory, resp->memory_fixed, sizeof(resp->memory_fixed));
 	resp->thread = thread;
 	resp->client = NULL;
+	resp->flags = 0;
 	resp->connection_close = true;
+	resp->held_length = 0;
 }
 
 /**
@@ -219,9 +301,28 @@ void hiw_internal_request_reset(hiw_request* req, hiw_client* client)
 	req->connection_close = true;
 	req->content_length = -1;
 	req->content_length_remaining = 0;
+	req->buffered_length = 0;
 	hiw_memory_reset(&req->memory);
 }
 
+/**
+ * Reset a request to be used by the same client's next request. Bytes received after the end of the previous request
+ * belong to requests that the client has pipelined, so they are kept and parsed before anything more is received
+ *
+ * @param req
+ */
+void hiw_internal_request_next(hiw_request* req)
+{
+	// The pipelined bytes are moved to the beginning of the request memory. The copy is done front to back, so it's
+	// safe even if the memory overlaps
+	const int pipelined = req->read_ahead_length;
+	if (pipelined > 0 && req->read_ahead != req->memory.ptr)
+		hiw_std_mempy(req->read_ahead, pipelined, req->memory.ptr, HIW_MAX_HEADER_SIZE);
+
+	hiw_internal_request_reset(req, req->client);
+	req->buffered_length = pipelined;
+}
+
 /**
  * Reset the response for a new client
  *
@@ -231,7 +332,11 @@ void hiw_internal_request_reset(hiw_request* req, hiw_client* client)
 void hiw_internal_response_reset(hiw_response* resp, hiw_client* client)
 {
 	resp->headers.count = 0;
-	hiw_memory_reset(&resp->memory);
+
+	// Output held back for the same client is sent before, or together with, this response
+	if (!hiw_bit_test(resp->flags, hiw_internal_response_flag_held) || resp->client != client)
+		hiw_memory_reset(&resp->memory);
+	resp->held_length = hiw_memory_size(&resp->memory);
 	resp->client = client;
 	resp->flags = 0;
 	resp->connection_close = true;
@@ -249,6 +354,17 @@ hiw_servlet* hiw_servlet_new(hiw_server* const server)
 	s->threads = NULL;
 	s->server = server;
 	s->flags = hiw_servlet_flags_server_owner;
+	s->parking = NULL;
+	s->parking_lock = NULL;
+	s->parking_shards = NULL;
+	s->parked_first = NULL;
+	s->parked_last = NULL;
+	s->listeners = NULL;
+	s->next_listener = NULL;
+	s->detach_pool = NULL;
+	s->detach_lock = NULL;
+	s->detached = NULL;
+	s->detached_count = 0;
 	return s;
 }
 
@@ -262,10 +378,199 @@ void hiw_servlet_thread_delete(hiw_servlet_thread* const st)
 		hiw_thread_delete(st->thread);
 		st->thread = NULL;
 	}
+	if (st->lock != NULL)
+	{
+		hiw_thread_critical_sec_delete(st->lock);
+		st->lock = NULL;
+	}
 	log_infof("hiw_servlet_thread(%p) deleted", st);
 	free(st);
 }
 
+/**
+ * @brief A request that's in-flight in a servlet thread
+ */
+struct hiw_servlet_active
+{
+	// The socket of the client whose request is processed
+	SOCKET socket;
+
+	// The previous in-flight request
+	hiw_servlet_active* prev;
+
+	// The next in-flight request
+	hiw_servlet_active* next;
+};
+
+/**
+ * @brief A keep-alive connection that's parked while waiting for the client's next request. A server socket shard
+ *        added to the parking poller is represented by an entry without a client
+ */
+struct hiw_servlet_parked
+{
+	// The client. NULL if this is a server socket shard
+	hiw_client* client;
+
+	// The server socket shard, if this is not a client
+	int shard;
+
+	// When the connection was parked, in milliseconds
+	unsigned long long parked_at;
+
+	// Is the client socket added to the parking poller
+	bool registered;
+
+	// Is the connection shut down because it's been idle for too long
+	bool expired;
+
+	// The connection parked before this one
+	hiw_servlet_parked* prev;
+
+	// The connection parked after this one
+	hiw_servlet_parked* next;
+};
+
+/**
+ * @brief A response detached from the servlet thread, together with the request and the client, that's produced by a
+ *        thread pool worker
+ */
+struct hiw_servlet_detached
+{
+	// Servlet thread used by the request and the response while they are detached. It's thread is the thread pool
+	// worker producing the response
+	hiw_servlet_thread thread;
+
+	// The request
+	hiw_request request;
+
+	// The response
+	hiw_response response;
+
+	// The function producing the response
+	hiw_servlet_fn func;
+
+	// The parked connection of the client, which is parked again when the response is done. NULL if the connection
+	// is closed when the response is done
+	hiw_servlet_parked* parked;
+
+	// Is the connection closed when the response is done, regardless of what the response says
+	bool must_close;
+
+	// The task pushed to the thread pool
+	hiw_thread_pool_task task;
+
+	// The previous detached response
+	hiw_servlet_detached* prev;
+
+	// The next detached response
+	hiw_servlet_detached* next;
+};
+
+/**
+ * @param s the servlet
+ * @return How long, in milliseconds, an idle keep-alive connection is kept open. 0 if it's kept open forever
+ */
+unsigned int hiw_internal_servlet_keep_alive_timeout(const hiw_servlet* const s)
+{
+	if (s->config.keep_alive_timeout > 0)
+		return s->config.keep_alive_timeout;
+	return hiw_server_get_config(s->server)->socket_config.read_timeout;
+}
+
+/**
+ * @brief Release the poller and all connections that are parked
+ * @param s the servlet
+ */
+void hiw_internal_servlet_parking_release(hiw_servlet* const s)
+{
+	while (s->parked_first != NULL)
+	{
+		hiw_servlet_parked* const next = s->parked_first->next;
+		hiw_client_delete(s->parked_first->client);
+		free(s->parked_first);
+		s->parked_first = next;
+	}
+	s->parked_last = NULL;
+
+	if (s->parking != NULL)
+	{
+		hiw_poller_delete(s->parking);
+		s->parking = NULL;
+	}
+	if (s->parking_lock != NULL)
+	{
+		hiw_thread_critical_sec_delete(s->parking_lock);
+		s->parking_lock = NULL;
+	}
+	if (s->parking_shards != NULL)
+	{
+		free(s->parking_shards);
+		s->parking_shards = NULL;
+	}
+}
+
+/**
+ * @brief Wait for the requests that are in-flight in the servlet threads to finish. Connections that are still
+ *        in-flight when the deadline has passed are shut down, which makes the servlet thread close them
+ * @param s The servlet
+ * @param deadline When to stop waiting, in milliseconds as returned by hiw_timer_now
+ */
+void hiw_internal_servlet_drain(hiw_servlet* const s, const unsigned long long deadline)
+{
+	for (hiw_servlet_thread* st = s->threads; st != NULL; st = st->next)
+	{
+		hiw_thread_critical_sec_enter(st->lock);
+		while (st->active != NULL)
+		{
+			const unsigned long long now = hiw_timer_now();
+			if (now >= deadline)
+			{
+				for (const hiw_servlet_active* active = st->active; active != NULL; active = active->next)
+				{
+					log_warnf("[t:%p] request is still in-flight, forcefully closing the connection", st->thread);
+					hiw_socket_close(active->socket);
+				}
+				break;
+			}
+			hiw_thread_critical_sec_wait(st->lock, (int)(deadline - now));
+		}
+		hiw_thread_critical_sec_exit(st->lock);
+	}
+}
+
+/**
+ * @brief Wait for the detached responses to finish. Connections that are still detached when the deadline has passed
+ *        are shut down, which makes the thread pool worker stop producing the response
+ * @param s The servlet
+ * @param deadline When to stop waiting, in milliseconds as returned by hiw_timer_now
+ */
+void hiw_internal_servlet_detached_drain(hiw_servlet* const s, const unsigned long long deadline)
+{
+	if (s->detach_lock == NULL)
+		return;
+	hiw_thread_critical_sec_enter(s->detach_lock);
+	bool closed = false;
+	while (s->detached != NULL)
+	{
+		const unsigned long long now = hiw_timer_now();
+		if (!closed && now >= deadline)
+		{
+			for (hiw_servlet_detached* d = s->detached; d != NULL; d = d->next)
+			{
+				log_warnf("[c:%p] detached response is still in-flight, forcefully closing the connection",
+						  d->request.client);
+				hiw_socket_close(hiw_client_get_socket(d->request.client));
+			}
+			closed = true;
+		}
+
+		// The thread pool workers are still using the servlet after the connections are shut down, so they are
+		// always waited for
+		hiw_thread_critical_sec_wait(s->detach_lock, closed ? HIW_SERVLET_POLL_TIMEOUT : (int)(deadline - now));
+	}
+	hiw_thread_critical_sec_exit(s->detach_lock);
+}
+
 /**
  * Release a servlets internal resources
  *
@@ -276,6 +581,20 @@ void hiw_servlet_release(hiw_servlet* s)
 	log_infof("hiw_servlet(%p) is releasing is resources", s);
 	hiw_server_stop(s->server);
 
+	// Stop all listeners before waiting for any threads, so that they are shutting down at the same time
+	for (hiw_servlet* listener = s->listeners; listener != NULL; listener = listener->next_listener)
+		hiw_server_stop(listener->server);
+
+	// No new clients are accepted, so give the requests that are in-flight a chance to finish before the threads
+	// are stopped
+	const unsigned long long deadline = hiw_timer_now() + s->config.drain_timeout;
+	hiw_internal_servlet_drain(s, deadline);
+	for (hiw_servlet* listener = s->listeners; listener != NULL; listener = listener->next_listener)
+		hiw_internal_servlet_drain(listener, deadline);
+	hiw_internal_servlet_detached_drain(s, deadline);
+	for (hiw_servlet* listener = s->listeners; listener != NULL; listener = listener->next_listener)
+		hiw_internal_servlet_detached_drain(listener, deadline);
+
 	hiw_servlet_thread* first = s->threads;
 	while (first)
 	{
@@ -284,6 +603,25 @@ void hiw_servlet_release(hiw_servlet* s)
 		first = next;
 	}
 
+	// All servlet threads are stopped, so the parked connections are no longer owned by anyone
+	hiw_internal_servlet_parking_release(s);
+
+	if (s->detach_pool != NULL && hiw_bit_test(s->flags, hiw_servlet_flags_detach_pool_owner))
+		hiw_thread_pool_delete(s->detach_pool);
+	s->detach_pool = NULL;
+	if (s->detach_lock != NULL)
+	{
+		hiw_thread_critical_sec_delete(s->detach_lock);
+		s->detach_lock = NULL;
+	}
+
+	while (s->listeners != NULL)
+	{
+		hiw_servlet* const next = s->listeners->next_listener;
+		hiw_servlet_delete(s->listeners);
+		s->listeners = next;
+	}
+
 	if (hiw_bit_test(s->flags, hiw_servlet_flags_server_owner))
 	{
 		hiw_server_delete(s->server);
@@ -357,6 +695,12 @@ hiw_servlet_thread* hiw_servlet_thread_new(hiw_servlet* const s)
 {
 	hiw_servlet_thread* const st = hiw_malloc(sizeof(hiw_servlet_thread));
 	st->next = NULL;
+	st->shard = 0;
+	st->clients = hiw_client_cache_default;
+	st->lock = hiw_thread_critical_sec_new();
+	st->active = NULL;
+	st->poller = NULL;
+	st->parked = NULL;
 	st->thread = hiw_thread_new(hiw_servlet_func);
 	st->servlet = s;
 	st->filter_chain = s->filter_chain;
@@ -387,13 +731,122 @@ bool hiw_servlet_start_threads(hiw_servlet* const s)
 	return true;
 }
 
-hiw_servlet_error hiw_servlet_start(hiw_servlet* const s, const hiw_servlet_config* config)
+/**
+ * @brief Create the poller where idle connections are parked. The server socket is also added to the poller, so
+ *        that the servlet threads are waiting for both new clients and parked clients at the same time
+ * @param s The servlet
+ * @return true if successful
+ */
+bool hiw_internal_servlet_parking_init(hiw_servlet* const s)
 {
-	assert(s != NULL && "expected 's' to exist");
-	if (s == NULL)
-		return HIW_SERVLET_ERROR_INVALID_ARGUMENT;
-	if (config != NULL)
-		s->config = *config;
+	s->parking = hiw_poller_new();
+	if (s->parking == NULL)
+		return false;
+	s->parking_lock = hiw_thread_critical_sec_new();
+
+	// Any servlet thread accepts clients from any shard. The server sockets are oneshot, so that only one thread
+	// is woken up for each new client
+	const int shard_count = hiw_server_get_shard_count(s->server);
+	s->parking_shards = hiw_malloc(sizeof(hiw_servlet_parked) * shard_count);
+	for (int i = 0; i < shard_count; ++i)
+	{
+		hiw_servlet_parked* const entry = &s->parking_shards[i];
+		*entry = (hiw_servlet_parked){.client = NULL, .shard = i, .registered = true};
+
+		const SOCKET server_socket = hiw_server_get_shard_socket(s->server, i);
+		if (!hiw_socket_set_nonblocking(server_socket, true) ||
+			!hiw_poller_add(s->parking, server_socket, hiw_poller_flags_read | hiw_poller_flags_oneshot, entry))
+		{
+			hiw_internal_servlet_parking_release(s);
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Prepare the server sockets and spawn the servlet threads
+ * @param s The servlet
+ * @param first_shard The shard used by the first spawned thread. Shards before this one are served by threads that
+ *                    are not spawned by the servlet
+ * @return HIW_SERVLET_ERROR_SUCCESS if all threads are spawned
+ */
+hiw_servlet_error hiw_internal_servlet_spawn(hiw_servlet* const s, const int first_shard)
+{
+	// Each spawned servlet thread gets it's own shard
+	const int extra_shards = s->config.num_accept_threads + first_shard - 1;
+	if (s->config.shard_server_socket && extra_shards > 0 &&
+		hiw_server_is_error(hiw_server_add_shards(s->server, extra_shards)))
+	{
+		log_warnf("hiw_servlet(%p) could not shard the server socket, all threads are sharing the same socket", s);
+		s->config.shard_server_socket = false;
+	}
+
+	// The event loop requires non-blocking server sockets
+	if (s->config.mode == HIW_SERVLET_MODE_EVENT_LOOP)
+	{
+#if defined(HIW_LINUX)
+		for (int i = 0; i < hiw_server_get_shard_count(s->server); ++i)
+		{
+			if (!hiw_socket_set_nonblocking(hiw_server_get_shard_socket(s->server, i), true))
+				return HIW_SERVLET_ERROR_INVALID_ARGUMENT;
+		}
+#else
+		log_warnf("hiw_servlet(%p) event loop is not supported on this platform, using blocking mode", s);
+		s->config.mode = HIW_SERVLET_MODE_BLOCKING;
+#endif
+	}
+
+	// Idle connections are parked in a poller shared by all servlet threads. Clients accepted using io_uring are
+	// bound to the accepting thread's ring, so they can't be served by another thread
+	if (s->config.mode == HIW_SERVLET_MODE_BLOCKING && s->config.park_idle_connections &&
+		hiw_server_get_config(s->server)->io_backend == HIW_SERVER_IO_BACKEND_SOCKET)
+	{
+#if defined(HIW_LINUX)
+		if (!hiw_internal_servlet_parking_init(s))
+			return HIW_SERVLET_ERROR_INVALID_ARGUMENT;
+#else
+		log_warnf("hiw_servlet(%p) parking idle connections is not supported on this platform", s);
+#endif
+	}
+
+	// Fibers yield to the event loop, so there's nothing to yield to in blocking mode
+	if (s->config.fibers && s->config.mode != HIW_SERVLET_MODE_EVENT_LOOP)
+	{
+		log_warnf("hiw_servlet(%p) requests are only served by fibers in event loop mode", s);
+		s->config.fibers = false;
+	}
+
+	// New clients are steered to the shard of the servlet thread pinned to the cpu that received them
+	if (s->config.steer_connections)
+	{
+		if (!s->config.shard_server_socket || s->config.cpu_count <= 0 || s->parking != NULL)
+			log_warnf("hiw_servlet(%p) clients are only steered by cpu for sharded and pinned servlet threads that "
+					  "don't park idle connections",
+					  s);
+		else if (hiw_server_is_error(hiw_server_steer_shards(s->server, s->config.cpus, s->config.cpu_count)))
+			log_warnf("hiw_servlet(%p) could not steer clients by cpu", s);
+	}
+
+	// Detached responses are produced by a thread pool, which grows and shrinks with the number of detached responses
+	// unless the thread pool is supplied
+	if (s->config.max_detached > 0)
+	{
+		s->detach_lock = hiw_thread_critical_sec_new();
+		s->detach_pool = s->config.detach_pool;
+		if (s->detach_pool == NULL)
+		{
+			hiw_thread_pool_config pool_config = hiw_thread_pool_config_default;
+			pool_config.count = 0;
+			pool_config.max_count = s->config.max_detached;
+			pool_config.allow_shrink = true;
+			pool_config.grow_latency = 0;
+			s->detach_pool = hiw_thread_pool_new(&pool_config);
+			s->flags |= hiw_servlet_flags_detach_pool_owner;
+			if (!hiw_thread_pool_start(s->detach_pool))
+				return HIW_SERVLET_ERROR_THREADS;
+		}
+	}
 
 	log_infof("hiw_servlet(%p) is spawning %d threads", s, s->config.num_accept_threads);
 
@@ -402,6 +855,10 @@ hiw_servlet_error hiw_servlet_start(hiw_servlet* const s, const hiw_servlet_conf
 	for (int i = 0; i < s->config.num_accept_threads; ++i)
 	{
 		hiw_servlet_thread* const st = hiw_servlet_thread_new(s);
+		if (s->config.shard_server_socket)
+			st->shard = i + first_shard;
+		if (s->config.cpu_count > 0)
+			hiw_thread_set_cpu(st->thread, s->config.cpus[(i + first_shard) % s->config.cpu_count]);
 
 		if (s->threads == NULL)
 		{
@@ -416,13 +873,63 @@ hiw_servlet_error hiw_servlet_start(hiw_servlet* const s, const hiw_servlet_conf
 
 	if (!hiw_servlet_start_threads(s))
 		return HIW_SERVLET_ERROR_THREADS;
+	return HIW_SERVLET_ERROR_SUCCESS;
+}
+
+hiw_servlet_error hiw_servlet_add_listener(hiw_servlet* const s, hiw_servlet* const listener,
+										   const hiw_servlet_config* const config)
+{
+	assert(s != NULL && "expected 's' to exist");
+	assert(listener != NULL && "expected 'listener' to exist");
+	if (s == NULL || listener == NULL || listener == s)
+		return HIW_SERVLET_ERROR_INVALID_ARGUMENT;
+	if (config != NULL)
+		listener->config = *config;
+
+	// A listener has no calling thread of it's own, so at least one thread has to be spawned
+	if (listener->config.num_accept_threads <= 0)
+		listener->config.num_accept_threads = 1;
+
+	hiw_servlet** last = &s->listeners;
+	while (*last != NULL)
+		last = &(*last)->next_listener;
+	*last = listener;
+	return HIW_SERVLET_ERROR_SUCCESS;
+}
+
+hiw_servlet_error hiw_servlet_start(hiw_servlet* const s, const hiw_servlet_config* config)
+{
+	assert(s != NULL && "expected 's' to exist");
+	if (s == NULL)
+		return HIW_SERVLET_ERROR_INVALID_ARGUMENT;
+	if (config != NULL)
+		s->config = *config;
+
+	// The main servlet thread uses the original server socket
+	hiw_servlet_error err = hiw_internal_servlet_spawn(s, 1);
+	if (err != HIW_SERVLET_ERROR_SUCCESS)
+		return err;
+
+	// The listeners are only served by their own threads
+	for (hiw_servlet* listener = s->listeners; listener != NULL; listener = listener->next_listener)
+	{
+		log_infof("hiw_servlet(%p) is starting listener hiw_servlet(%p)", s, listener);
+		err = hiw_internal_servlet_spawn(listener, 0);
+		if (err != HIW_SERVLET_ERROR_SUCCESS)
+			return err;
+	}
 
 	// Start the main thread servlet. It blocks in hiw_thread_start until the servlet is shutting down
 	hiw_servlet_thread main_servlet_thread = {
-		.servlet = s, .thread = hiw_thread_main(), .filter_chain = s->filter_chain, .next = NULL};
+		.servlet = s, .thread = hiw_thread_main(), .filter_chain = s->filter_chain, .shard = 0,
+		.clients = hiw_client_cache_default, .lock = hiw_thread_critical_sec_new(), .active = NULL,
+		.poller = NULL, .parked = NULL, .next = NULL};
 	hiw_thread_set_userdata(main_servlet_thread.thread, &main_servlet_thread);
 	hiw_thread_set_func(main_servlet_thread.thread, hiw_servlet_func);
+	if (s->config.cpu_count > 0)
+		hiw_thread_set_cpu(main_servlet_thread.thread, s->config.cpus[0]);
 	hiw_thread_start(main_servlet_thread.thread);
+	hiw_thread_critical_sec_delete(main_servlet_thread.lock);
 
 	return HIW_SERVLET_ERROR_SUCCESS;
 }
@@ -446,6 +953,29 @@ void hiw_filter_chain_next(hiw_request* req, hiw_response* resp, const hiw_filte
 	}
 }
 
+/**
+ * @brief Check if the supplied buffer contains the entire request header, i.e. the header-body separator
+ * @param buf The buffer
+ * @param offset Where to start searching. Bytes before this offset are already known to not be the end of the header
+ * @param length The number of bytes in the buffer
+ * @return true if the header-body separator is found
+ */
+bool hiw_internal_request_header_complete(const char* const buf, int offset, const int length)
+{
+	if (offset < 1)
+		offset = 1;
+	for (int i = offset; i < length; ++i)
+	{
+		if (buf[i] != '\n')
+			continue;
+		if (buf[i - 1] == '\n')
+			return true;
+		if (i >= 2 && buf[i - 1] == '\r' && buf[i - 2] == '\n')
+			return true;
+	}
+	return false;
+}
+
 bool hiw_internal_request_parse_status_line(hiw_request* req, hiw_string line)
 {
 	// Check to see if the status line is valid
@@ -481,6 +1011,14 @@ bool hiw_internal_request_read_headers(hiw_request* req)
 
 	req->headers.count = 0;
 
+	// The client is given a limited time to send the entire header. Nothing has to be received if the header is
+	// already buffered by an event loop, or pipelined after the previous request
+	const unsigned int header_read_timeout = req->thread->servlet->config.header_read_timeout;
+	const bool deadline = header_read_timeout > 0 &&
+						  !hiw_internal_request_header_complete(req->memory.ptr, 0, req->buffered_length);
+	if (deadline)
+		hiw_client_set_read_deadline(req->client, header_read_timeout);
+
 	// headers are read in the following way:
 	//
 	// 1. Read a chunk of data
@@ -492,24 +1030,16 @@ bool hiw_internal_request_read_headers(hiw_request* req)
 	//    so that the one reading the buffer can read it in a sequential order
 
 	hiw_memory* const memory = &req->memory;
-	int bytes_read = 0;
+	int bytes_read = req->buffered_length;
 	char* pos = hiw_memory_get(memory, HIW_MAX_HEADER_SIZE);
 	hiw_string status_line;
 
-	// Read a chunk of data, with the maximum of MAX_HEADER_SIZE bytes
+	// Read a chunk of data, with the maximum of MAX_HEADER_SIZE bytes. Data that's already buffered
+	// is parsed before anything is received from the client
 	while (1)
 	{
-		const int count = hiw_client_recv(req->client, pos + bytes_read, HIW_MAX_HEADER_SIZE - bytes_read);
-		if (count <= 0)
-		{
-			log_infof("[t:%p][c:%p] client closed connection", req->thread, req->client);
-			return false;
-		}
-
-		bytes_read += count;
-
 		// try to read the status line, which is in the beginning of the http request
-		if (hiw_string_readline(&(hiw_string){.begin = memory->ptr, .length = count}, &status_line))
+		if (hiw_string_readline(&(hiw_string){.begin = memory->ptr, .length = bytes_read}, &status_line))
 			break;
 
 		// if we've read as much data the header is allowed to read from, and we still haven't gotten a
@@ -519,6 +1049,15 @@ bool hiw_internal_request_read_headers(hiw_request* req)
 			log_infof("[t:%p][c:%p] invalid status line header", req->thread, req->client);
 			return false;
 		}
+
+		const int count = hiw_client_recv(req->client, pos + bytes_read, HIW_MAX_HEADER_SIZE - bytes_read);
+		if (count <= 0)
+		{
+			log_infof("[t:%p][c:%p] client closed connection", req->thread, req->client);
+			return false;
+		}
+
+		bytes_read += count;
 	}
 
 	// try to parse the status line, which is the first line in the request buffer
@@ -626,9 +1165,8 @@ bool hiw_internal_request_read_headers(hiw_request* req)
 			return false;
 		}
 
-		// read more data from the socket and try to parse the headers again
-		assert(pos < memory->ptr + capacity_left);
-		const int count = hiw_client_recv(req->client, pos, capacity_left);
+		// read more data from the socket, after the data we've already received, and try to parse the headers again
+		const int count = hiw_client_recv(req->client, memory->ptr + bytes_read, capacity_left);
 		if (count <= 0)
 		{
 			log_errorf("[t:%p][c:%p] failed to read the rest of the data from client", req->thread, req->client);
@@ -637,6 +1175,9 @@ bool hiw_internal_request_read_headers(hiw_request* req)
 		bytes_read += count;
 	}
 done:
+	// The request body is read without a deadline, so that slow uploads are not affected
+	if (deadline)
+		hiw_client_set_read_deadline(req->client, 0);
 	req->connection_close = header_connection_close;
 	req->content_length = header_content_length;
 	req->content_length_remaining = req->content_length;
@@ -653,47 +1194,141 @@ bool hiw_internal_response_write_raw(hiw_response* const resp, const char* src,
 }
 
 /**
- * Flush all headers. This is really only used if the servlet isn't sending a body
+ * Send the buffered response output, followed by the supplied memory, to the client
  *
  * @param resp The response
- * @return true if headers was successfully flushed
+ * @param src Memory sent after the buffered output. Can be NULL
+ * @param n The number of bytes in src
+ * @param more true if more data is sent to the client for this response
+ * @return true if successful
  */
-bool hiw_response_flush_headers(hiw_response* const resp)
+bool hiw_internal_response_flush(hiw_response* const resp, const char* const src, const int n, const bool more)
 {
-	// Headers are already sent?
-	if (hiw_bit_test(resp->flags, hiw_internal_response_flag_headers_sent))
-		return true;
-
-	if (resp->status_code == 0)
-	{
-		log_errorf("[t:%p][c:%p] no status code has been set for the response", resp->thread, resp->client);
-		return false;
-	}
-
-	// If no content-length is set then set it to 0
-	if (!hiw_bit_test(resp->flags, hiw_internal_response_flag_content_length_set))
+	// The client is given a limited time to receive the response, starting when the first part of it is sent
+	if (!hiw_bit_test(resp->flags, hiw_internal_response_flag_deadline_set))
 	{
-		if (!hiw_response_set_content_length(resp, 0))
+		const unsigned int response_write_timeout = resp->thread->servlet->config.response_write_timeout;
+		if (response_write_timeout > 0)
 		{
-			return hiw_internal_response_error(resp);
+			hiw_client_set_write_deadline(resp->client, response_write_timeout);
+			resp->flags |= hiw_internal_response_flag_deadline_set;
 		}
 	}
 
-	// Set the connection response header if not set
-	if (!hiw_bit_test(resp->flags, hiw_internal_response_flag_connection_set))
+#if HIW_RESPONSE_ZEROCOPY_THRESHOLD > 0
+	// Large blocks are sent without being copied. What's buffered is sent first, since zero-copy sends can't be
+	// combined with the buffered memory
+	if (n >= HIW_RESPONSE_ZEROCOPY_THRESHOLD)
 	{
-		if (!hiw_response_set_connection_close(resp, resp->connection_close))
+		if (!hiw_internal_response_flush(resp, NULL, 0, true))
+			return false;
+		const int sent = hiw_client_sendall_zerocopy(resp->client, src, n);
+		if (sent != n)
 		{
+			log_errorf("[t:%p][c:%p] expected to send %d bytes to the client but sent %d", resp->thread, resp->client,
+					   n, sent);
 			return hiw_internal_response_error(resp);
 		}
+		return true;
 	}
+#endif
 
+	hiw_memory_view views[2];
+	int count = 0;
+	const int buffered = hiw_memory_size(&resp->memory);
+	if (buffered > 0)
+		views[count++] = (hiw_memory_view){.begin = resp->memory.ptr, .length = buffered};
+	if (n > 0)
+		views[count++] = (hiw_memory_view){.begin = src, .length = n};
+	if (count == 0)
+		return true;
 
-#if HIW_WRITE_SERVER_HEADER == 1
-#if HIW_WRITE_SERVER_VERSION == 1
-	const hiw_string server_header_name = hiw_string_const("Server");
-	const hiw_string server_header_value = hiw_string_const("Highway " HIGHWAY_VERSION);
-#else
+	// A single block is sent as-is, which allows the I/O backend to send directly from registered memory
+	const int total = buffered + n;
+	const int sent = count == 1 && !more ? hiw_client_sendall(resp->client, views[0].begin, views[0].length)
+								: hiw_client_sendallv(resp->client, views, count, more);
+	if (sent != total)
+	{
+		log_errorf("[t:%p][c:%p] expected to send %d bytes to the client but sent %d", resp->thread, resp->client,
+				   total, sent);
+		return hiw_internal_response_error(resp);
+	}
+	hiw_memory_reset(&resp->memory);
+	resp->held_length = 0;
+	return true;
+}
+
+/**
+ * Make room for the supplied number of bytes in the response's fixed memory. Output held back for the client's
+ * previous pipelined requests is sent first, if it's taking up the room
+ *
+ * @param resp The response
+ * @param n The number of bytes
+ * @return true if there's room for the bytes
+ */
+bool hiw_internal_response_reserve(hiw_response* const resp, const int n)
+{
+	if (hiw_memory_capacity(&resp->memory) - hiw_memory_size(&resp->memory) >= n)
+		return true;
+	if (resp->held_length > 0)
+	{
+		if (!hiw_internal_response_flush(resp, NULL, 0, true))
+			return false;
+		if (hiw_memory_capacity(&resp->memory) >= n)
+			return true;
+	}
+	log_errorf("[t:%p][c:%p] response header is larger than the maximum allowed size of %d bytes", resp->thread,
+			   resp->client, HIW_MAX_HEADER_SIZE);
+	return hiw_internal_response_error(resp);
+}
+
+/**
+ * Write the header block. The header block is buffered, so that it's sent to the client together with the first
+ * part of the body
+ *
+ * @param resp The response
+ * @return true if headers was successfully flushed
+ */
+bool hiw_response_flush_headers(hiw_response* const resp)
+{
+	// Headers are already sent?
+	if (hiw_bit_test(resp->flags, hiw_internal_response_flag_headers_sent))
+		return true;
+
+	if (resp->status_code == 0)
+	{
+		log_errorf("[t:%p][c:%p] no status code has been set for the response", resp->thread, resp->client);
+		return false;
+	}
+
+	// If no content-length is set then set it to 0
+	if (!hiw_bit_test(resp->flags, hiw_internal_response_flag_content_length_set))
+	{
+		if (!hiw_response_set_content_length(resp, 0))
+		{
+			return hiw_internal_response_error(resp);
+		}
+	}
+
+	// Tell the client to not send any more requests on this connection if the servlet is stopping
+	if (!hiw_server_is_running(resp->thread->servlet->server))
+		resp->connection_close = true;
+
+	// Set the connection response header if not set
+	if (!hiw_bit_test(resp->flags, hiw_internal_response_flag_connection_set))
+	{
+		if (!hiw_response_set_connection_close(resp, resp->connection_close))
+		{
+			return hiw_internal_response_error(resp);
+		}
+	}
+
+
+#if HIW_WRITE_SERVER_HEADER == 1
+#if HIW_WRITE_SERVER_VERSION == 1
+	const hiw_string server_header_name = hiw_string_const("Server");
+	const hiw_string server_header_value = hiw_string_const("Highway " HIGHWAY_VERSION);
+#else
 	const hiw_string server_header_name = hiw_string_const("Server" HIGHWAY_VERSION);
 	const hiw_string server_header_value = hiw_string_const("Highway");
 #endif
@@ -701,108 +1336,1332 @@ bool hiw_response_flush_headers(hiw_response* const resp)
 	{
 		return hiw_internal_response_error(resp);
 	}
-#endif
+#endif
+
+	// write the header body separator
+	if (!hiw_internal_response_reserve(resp, 2) || !hiw_internal_response_write_raw(resp, "\r\n", 2))
+	{
+		log_errorf("[t:%p][c:%p] could not write header body separator", resp->thread, resp->client);
+		return hiw_internal_response_error(resp);
+	}
+
+	resp->flags |= hiw_internal_response_flag_headers_sent;
+	return true;
+}
+
+/**
+ * Complete the response after the servlet function has returned. The rest of the response is sent, and the connection
+ * is checked so that it can be reused
+ *
+ * @param st The servlet thread
+ * @param request The request
+ * @param response The response
+ * @return true if the connection should be kept alive
+ */
+bool hiw_internal_servlet_complete(const hiw_servlet_thread* const st, hiw_request* const request,
+								   hiw_response* const response)
+{
+	// Verify that we've read all content from the client. If not, then the client sent a Content-Length header
+	// that's larger than what the servlet read
+	if (request->content_length_remaining > 0)
+	{
+		log_errorf("[t:%p][c:%p] client sent %d bytes but only read %d bytes, connection will forcefully close",
+				   request->thread, request->client, request->content_length, request->content_length_remaining);
+		return false;
+	}
+
+	// Flush headers if they aren't flushed already
+	if (!hiw_response_flush_headers(response))
+		return false;
+
+	// The client has pipelined it's next request, so the output is held back and sent together with the next response.
+	// A burst of small pipelined requests is then answered using one write
+	const bool hold = !response->connection_close && hiw_server_is_running(st->servlet->server) &&
+					  response->content_bytes_left == 0 &&
+					  hiw_memory_size(&response->memory) < HIW_RESPONSE_FLUSH_THRESHOLD &&
+					  hiw_internal_request_header_complete(request->read_ahead, 0, request->read_ahead_length);
+	if (hold)
+		response->flags |= hiw_internal_response_flag_held;
+	else if (!hiw_internal_response_flush(response, NULL, 0, false))
+		return false;
+
+	// If we haven't written all the memory to the client, then warn about it and then close the connection
+	if (response->content_bytes_left > 0)
+	{
+		log_errorf("[t:%p][c:%p] bytes left to write to the client, connection will forcefully close",
+				   request->thread, request->client);
+		return false;
+	}
+
+	// The deadline only applies to this response. A connection that's closed doesn't need it removed
+	if (hiw_bit_test(response->flags, hiw_internal_response_flag_deadline_set))
+		hiw_client_set_write_deadline(response->client, 0);
+
+	// reuse connection if possible. A connection with held back output is always reused, since the output is sent
+	// with the next response
+	return hold || (!response->connection_close && hiw_server_is_running(st->servlet->server));
+}
+
+/**
+ * Process one request from the client associated with the request. The request is expected to be reset
+ * before this function is called
+ *
+ * @param st The servlet thread
+ * @param request The request
+ * @param response The response
+ * @return true if the connection should be kept alive
+ */
+bool hiw_internal_servlet_process(hiw_servlet_thread* const st, hiw_request* const request,
+								  hiw_response* const response)
+{
+	hiw_internal_response_reset(response, request->client);
+
+	// read all headers. Responses held back for the client's previous pipelined requests are still sent
+	if (!hiw_internal_request_read_headers(request))
+	{
+		hiw_internal_response_flush(response, NULL, 0, false);
+		return false;
+	}
+	log_infof("[t:%p][c:%p] %.*s %.*s", request->thread, request->client, request->method.length,
+			  request->method.begin, request->uri.length, request->uri.begin);
+
+	response->connection_close = request->connection_close;
+
+	// Iterate over all filters and then, eventually, get to the actual servlet function!
+	if (st->filter_chain.filters != NULL)
+		st->filter_chain.filters->func(request, response, &st->filter_chain);
+	else if (st->servlet->servlet_func != NULL)
+		st->servlet->servlet_func(request, response);
+
+	// The response is completed by the thread pool worker it's detached to
+	if (hiw_bit_test(response->flags, hiw_internal_response_flag_detached))
+		return false;
+	return hiw_internal_servlet_complete(st, request, response);
+}
+
+/**
+ * @brief Track a request as in-flight in the supplied servlet thread
+ * @param st The servlet thread
+ * @param active The in-flight request
+ */
+void hiw_internal_servlet_active_add(hiw_servlet_thread* const st, hiw_servlet_active* const active)
+{
+	hiw_thread_critical_sec_enter(st->lock);
+	active->prev = NULL;
+	active->next = st->active;
+	if (st->active != NULL)
+		st->active->prev = active;
+	st->active = active;
+	hiw_thread_critical_sec_exit(st->lock);
+}
+
+/**
+ * @brief Stop tracking a request as in-flight. The socket is only closed after it's no longer active, so that a
+ *        draining servlet never shuts down a socket that's reused by another connection
+ * @param st The servlet thread
+ * @param active The in-flight request
+ */
+void hiw_internal_servlet_active_remove(hiw_servlet_thread* const st, hiw_servlet_active* const active)
+{
+	hiw_thread_critical_sec_enter(st->lock);
+	if (active->prev != NULL)
+		active->prev->next = active->next;
+	else
+		st->active = active->next;
+	if (active->next != NULL)
+		active->next->prev = active->prev;
+	hiw_thread_critical_sec_notify_all(st->lock);
+	hiw_thread_critical_sec_exit(st->lock);
+}
+
+/**
+ * Process one request while it's tracked as in-flight, so that the request is allowed to finish if the servlet is
+ * stopped while it's processed
+ *
+ * @param st The servlet thread
+ * @param request The request
+ * @param response The response
+ * @return true if the connection should be kept alive
+ */
+bool hiw_internal_servlet_serve(hiw_servlet_thread* const st, hiw_request* const request,
+								hiw_response* const response)
+{
+	hiw_servlet_active active = {.socket = hiw_client_get_socket(request->client), .prev = NULL, .next = NULL};
+	hiw_internal_servlet_active_add(st, &active);
+	const bool keep_alive = hiw_internal_servlet_process(st, request, response);
+	hiw_internal_servlet_active_remove(st, &active);
+	return keep_alive;
+}
+
+/**
+ * Wait for the client's next request
+ *
+ * @param st The servlet thread
+ * @param client The client
+ * @return false if the client has been idle for longer than the keep-alive timeout, or if the servlet is stopping
+ */
+bool hiw_internal_servlet_keep_alive(const hiw_servlet_thread* const st, const hiw_client* const client)
+{
+	const unsigned int timeout = hiw_internal_servlet_keep_alive_timeout(st->servlet);
+	const unsigned long long deadline = timeout > 0 ? hiw_timer_now() + timeout : 0;
+
+	// Wait a limited time at once, so that an idle connection is closed soon after the servlet is stopped
+	while (hiw_server_is_running(st->servlet->server))
+	{
+		unsigned int wait = HIW_SERVLET_POLL_TIMEOUT;
+		if (deadline > 0)
+		{
+			const unsigned long long now = hiw_timer_now();
+			if (now >= deadline)
+			{
+				log_debugf("[t:%p][c:%p] idle for more than %u ms", st->thread, client, timeout);
+				return false;
+			}
+			if (deadline - now < wait)
+				wait = (unsigned int)(deadline - now);
+		}
+		if (hiw_socket_wait(hiw_client_get_socket(client), false, wait))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Accept clients and serve one client at a time
+ *
+ * @param st The servlet thread
+ * @param request The request used by this thread
+ * @param response The response used by this thread
+ */
+void hiw_internal_servlet_blocking_loop(hiw_servlet_thread* const st, hiw_request* const request,
+										hiw_response* const response)
+{
+	// Each thread owns it's own ring, if the io_uring backend is used. The request and response memory
+	// is registered with the ring, so that the headers are received and sent without mapping the memory
+	hiw_uring* ring = NULL;
+	if (hiw_server_get_config(st->servlet->server)->io_backend == HIW_SERVER_IO_BACKEND_URING)
+	{
+		ring = hiw_uring_new(HIW_URING_DEFAULT_ENTRIES);
+		if (ring == NULL)
+		{
+			log_warnf("[t:%p] io_uring is not available, falling back to the socket backend", st->thread);
+		}
+		else
+		{
+			const hiw_memory_view buffers[] = {
+				{.begin = request->memory_fixed, .length = sizeof(request->memory_fixed)},
+				{.begin = response->memory_fixed, .length = sizeof(response->memory_fixed)}};
+			hiw_uring_register_buffers(ring, buffers, 2);
+		}
+	}
+
+	// allow the thread to be running for as long as the server is running
+	while (hiw_server_is_running(st->servlet->server))
+	{
+		// Blocking accept for new clients. Makes use of the OS's interrupts instead of polling and having to
+		// take race-condition into consideration. Will return NULL if:
+		// 1. accept timeout happened, which is okay and can be ignored
+		// 2. the server socket is closed, which only happens when the server is stopped
+		hiw_client* const client =
+			ring != NULL ? hiw_server_accept_uring(st->servlet->server, st->shard, ring, &st->clients)
+						 : hiw_server_accept_shard(st->servlet->server, st->shard, &st->clients);
+		if (client == NULL)
+		{
+			log_infof("[t:%p] client accept failed", st->thread);
+			continue; // continue will go back up, and if the server is no longer running then exit!
+		}
+		log_infof("[t:%p][c:%p] %s connected", st->thread, client, hiw_client_get_address(client));
+
+		// Requests pipelined by the client are already received, so there's no need to wait for them
+		bool detached = false;
+		hiw_internal_request_reset(request, client);
+		while (request->buffered_length > 0 || hiw_internal_servlet_keep_alive(st, client))
+		{
+			hiw_client_set_idle(client, false);
+			if (!hiw_internal_servlet_serve(st, request, response))
+			{
+				detached = hiw_bit_test(response->flags, hiw_internal_response_flag_detached);
+				break;
+			}
+			hiw_internal_request_next(request);
+
+			// The connection might be evicted while waiting for the client's next request
+			hiw_client_set_idle(client, true);
+		}
+
+		// A detached connection is owned by the thread pool worker producing the response
+		if (detached)
+			continue;
+		log_infof("[t:%p][c:%p] disconnected", st->thread, client);
+		hiw_client_recycle(client, &st->clients);
+	}
+
+	if (ring != NULL)
+		hiw_uring_delete(ring);
+}
+
+/**
+ * @brief Remove the supplied connection from the linked list of parked connections
+ * @param s The servlet
+ * @param parked The parked connection
+ */
+void hiw_internal_servlet_unpark(hiw_servlet* const s, hiw_servlet_parked* const parked)
+{
+	hiw_thread_critical_sec_enter(s->parking_lock);
+	if (parked->prev != NULL)
+		parked->prev->next = parked->next;
+	else
+		s->parked_first = parked->next;
+	if (parked->next != NULL)
+		parked->next->prev = parked->prev;
+	else
+		s->parked_last = parked->prev;
+	hiw_thread_critical_sec_exit(s->parking_lock);
+	parked->prev = parked->next = NULL;
+}
+
+/**
+ * @brief Park the supplied connection until the client sends it's next request
+ * @param s The servlet
+ * @param parked The connection
+ * @return true if the connection is parked
+ */
+bool hiw_internal_servlet_park(hiw_servlet* const s, hiw_servlet_parked* const parked)
+{
+	parked->parked_at = hiw_timer_now();
+	parked->expired = false;
+
+	// The connection is added to the list before the socket is armed, since any servlet thread might pick it up
+	// as soon as the socket is armed
+	hiw_thread_critical_sec_enter(s->parking_lock);
+	parked->prev = s->parked_last;
+	parked->next = NULL;
+	if (s->parked_last != NULL)
+		s->parked_last->next = parked;
+	else
+		s->parked_first = parked;
+	s->parked_last = parked;
+	hiw_thread_critical_sec_exit(s->parking_lock);
+
+	const SOCKET socket = hiw_client_get_socket(parked->client);
+	const int flags = hiw_poller_flags_read | hiw_poller_flags_oneshot;
+	const bool registered = parked->registered;
+	parked->registered = true;
+	if (registered ? hiw_poller_modify(s->parking, socket, flags, parked)
+				   : hiw_poller_add(s->parking, socket, flags, parked))
+		return true;
+
+	parked->registered = registered;
+	hiw_internal_servlet_unpark(s, parked);
+	return false;
+}
+
+/**
+ * @brief Shut down the connections that have been parked for longer than the keep-alive timeout. A shut down connection
+ *        becomes readable, which wakes up a servlet thread that then closes the connection
+ * @param s The servlet
+ */
+void hiw_internal_servlet_parking_expire(hiw_servlet* const s)
+{
+	const unsigned int timeout = hiw_internal_servlet_keep_alive_timeout(s);
+	if (timeout == 0)
+		return;
+
+	const unsigned long long now = hiw_timer_now();
+	hiw_thread_critical_sec_enter(s->parking_lock);
+	for (hiw_servlet_parked* parked = s->parked_first; parked != NULL && now - parked->parked_at >= timeout;
+		 parked = parked->next)
+	{
+		if (parked->expired)
+			continue;
+		log_debugf("[c:%p] idle for more than %u ms", parked->client, timeout);
+		hiw_socket_close(hiw_client_get_socket(parked->client));
+		parked->expired = true;
+	}
+	hiw_thread_critical_sec_exit(s->parking_lock);
+}
+
+/**
+ * @brief Shut down all parked connections. Parked connections are idle, so they are shut down right away when the
+ *        servlet is stopped
+ * @param s The servlet
+ */
+void hiw_internal_servlet_parking_close(hiw_servlet* const s)
+{
+	hiw_thread_critical_sec_enter(s->parking_lock);
+	for (hiw_servlet_parked* parked = s->parked_first; parked != NULL; parked = parked->next)
+	{
+		if (parked->expired)
+			continue;
+		hiw_socket_close(hiw_client_get_socket(parked->client));
+		parked->expired = true;
+	}
+	hiw_thread_critical_sec_exit(s->parking_lock);
+}
+
+/**
+ * Accept new clients and serve both new and parked clients, one client at a time. A keep-alive connection is
+ * parked when the client has not yet sent it's next request, so that the thread is free to serve other clients
+ *
+ * @param st The servlet thread
+ * @param request The request used by this thread
+ * @param response The response used by this thread
+ */
+void hiw_internal_servlet_parking_loop(hiw_servlet_thread* const st, hiw_request* const request,
+									   hiw_response* const response)
+{
+	hiw_servlet* const s = st->servlet;
+	hiw_server* const server = s->server;
+
+	// allow the thread to be running for as long as the server is running
+	while (hiw_server_is_running(server))
+	{
+		hiw_poller_event event;
+		const int count = hiw_poller_wait(s->parking, &event, 1, HIW_SERVLET_POLL_TIMEOUT);
+		if (count < 0)
+			break;
+		if (count == 0)
+		{
+			hiw_internal_servlet_parking_expire(s);
+			continue;
+		}
+
+		hiw_servlet_parked* parked = event.data;
+
+		// The server socket shards are the only entries without a client
+		if (parked->client == NULL)
+		{
+			// Re-arm the server socket as soon as the client is accepted, so that other threads are accepting
+			// new clients while this thread is serving the client
+			const int shard = parked->shard;
+			hiw_client* const client = hiw_server_accept_shard(server, shard, &st->clients);
+			if (hiw_server_is_running(server))
+				hiw_poller_modify(s->parking, hiw_server_get_shard_socket(server, shard),
+								  hiw_poller_flags_read | hiw_poller_flags_oneshot, parked);
+			if (client == NULL)
+				continue;
+			log_infof("[t:%p][c:%p] %s connected", st->thread, client, hiw_client_get_address(client));
+
+			parked = hiw_malloc(sizeof(hiw_servlet_parked));
+			parked->client = client;
+			parked->shard = 0;
+			parked->registered = false;
+			parked->expired = false;
+			parked->prev = parked->next = NULL;
+
+			// Don't wait for the new client's first request if it's not received yet
+			if (!hiw_socket_readable(hiw_client_get_socket(client)))
+			{
+				if (hiw_internal_servlet_park(s, parked))
+					continue;
+				hiw_client_recycle(client, &st->clients);
+				free(parked);
+				continue;
+			}
+		}
+		else
+		{
+			hiw_internal_servlet_unpark(s, parked);
+			hiw_client_set_idle(parked->client, false);
+		}
+
+		// Serve the client for as long as it has more requests for us
+		hiw_client* const client = parked->client;
+		bool keep_alive;
+		st->parked = parked;
+		hiw_internal_request_reset(request, client);
+		do
+		{
+			keep_alive = hiw_internal_servlet_serve(st, request, response);
+			hiw_internal_request_next(request);
+		} while (keep_alive &&
+				 (request->buffered_length > 0 || hiw_socket_readable(hiw_client_get_socket(client))));
+
+		// A detached connection is owned, and parked again, by the thread pool worker producing the response
+		if (st->parked == NULL)
+			continue;
+		st->parked = NULL;
+
+		// The connection is marked as idle before it's parked, since any servlet thread might pick it up as soon as
+		// it's parked
+		if (keep_alive)
+			hiw_client_set_idle(client, true);
+		if (keep_alive && hiw_internal_servlet_park(s, parked))
+			continue;
+
+		log_infof("[t:%p][c:%p] disconnected", st->thread, client);
+		hiw_client_recycle(client, &st->clients);
+		free(parked);
+	}
+
+	// Don't keep the idle connections waiting until all threads have stopped
+	hiw_internal_servlet_parking_close(s);
+}
+
+/**
+ * @brief A connection owned by a servlet thread running an event loop
+ */
+typedef struct hiw_servlet_connection hiw_servlet_connection;
+typedef struct hiw_servlet_fibers hiw_servlet_fibers;
+
+struct hiw_servlet_connection
+{
+	// The client
+	hiw_client* client;
+
+	// Memory for a request header that's only partially received. Allocated when needed
+	char* buffer;
+
+	// Number of bytes in the buffer
+	int buffer_length;
+
+	// Closes the connection if the client is idle, or is sending the request header, for too long
+	hiw_timer timer;
+
+	// Is the client sending a request header
+	bool reading;
+
+	// The fiber serving the client's requests. NULL if no request is in-flight
+	hiw_fiber* fiber;
+
+	// The fibers of the servlet thread owning the connection. NULL if the requests are not served by fibers
+	hiw_servlet_fibers* fibers;
+
+	// Is the client's socket re-armed for the fiber while the fiber is suspended
+	bool rearmed;
+
+	// Is the fiber ready to be resumed without waiting for the client's socket
+	bool ready;
+
+	// Should the connection be kept alive when the fiber is done
+	bool keep_alive;
+
+	// The next connection whose fiber is ready to be resumed
+	hiw_servlet_connection* next_ready;
+
+	// The previous connection owned by the same thread
+	hiw_servlet_connection* prev;
+
+	// The next connection owned by the same thread
+	hiw_servlet_connection* next;
+};
+
+/**
+ * @brief The fibers of a servlet thread running an event loop. Each in-flight request is served by it's own fiber, and
+ *        a fiber waiting for it's client is suspended until the event loop sees that the client's socket is ready
+ */
+struct hiw_servlet_fibers
+{
+	// The servlet thread
+	hiw_servlet_thread* thread;
+
+	// The poller of the thread's event loop
+	hiw_poller* poller;
+
+	// The timer wheel of the thread's event loop
+	hiw_timer_wheel* timers;
+
+	// The first connection whose fiber is ready to be resumed
+	hiw_servlet_connection* ready;
+
+	// The request header received by the event loop. It's copied by a new fiber before the fiber serves it's first
+	// request
+	const char* header;
+
+	// The number of bytes in the request header
+	int header_length;
+
+	// Fibers that are done, and that are kept for reuse
+	hiw_fiber* cache[HIW_SERVLET_FIBER_CACHE_SIZE];
+
+	// The number of fibers kept for reuse
+	int cache_count;
+};
+
+/**
+ * @brief Close the connection and release it's memory
+ * @param st The servlet thread
+ * @param head The first connection in the thread's linked list of connections
+ * @param conn The connection
+ */
+void hiw_internal_servlet_connection_delete(hiw_servlet_thread* const st, hiw_servlet_connection** const head,
+											hiw_servlet_connection* const conn)
+{
+	log_debugf("[c:%p] disconnected", conn->client);
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		*head = conn->next;
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+	hiw_timer_cancel(&conn->timer);
+
+	// A suspended fiber is never resumed again, so the request it's serving is dropped. The request is tracked as
+	// in-flight on the fiber's stack, and only the servlet thread itself is changing it's in-flight requests
+	if (conn->fiber != NULL)
+	{
+		const SOCKET socket = hiw_client_get_socket(conn->client);
+		for (hiw_servlet_active* active = st->active; active != NULL; active = active->next)
+		{
+			if (active->socket == socket)
+			{
+				hiw_internal_servlet_active_remove(st, active);
+				break;
+			}
+		}
+		hiw_fiber_delete(conn->fiber);
+	}
+
+	// Closing the socket automatically removes it from the poller. A detached connection is owned by the thread pool
+	// worker producing the response
+	if (conn->client != NULL)
+		hiw_client_recycle(conn->client, &st->clients);
+	if (conn->buffer != NULL)
+		free(conn->buffer);
+	free(conn);
+}
+
+/**
+ * @brief Called when a connection has been idle, or has been sending the request header, for too long
+ * @param t The connection's timer
+ */
+void hiw_internal_servlet_connection_expired(hiw_timer* const t)
+{
+	const hiw_servlet_connection* const conn = t->data;
+	log_debugf("[c:%p] %s timed out", conn->client, conn->reading ? "request header" : "idle connection");
+
+	// A shut down socket becomes readable, which makes the event loop delete the connection
+	hiw_socket_close(hiw_client_get_socket(conn->client));
+}
+
+/**
+ * @brief Arm the timer of the supplied connection. The header read timeout is used while the client is sending the
+ *        request header, if set, and the keep-alive timeout otherwise
+ * @param st The servlet thread
+ * @param timers The thread's timer wheel
+ * @param conn The connection
+ * @param reading Is the client sending a request header
+ */
+void hiw_internal_servlet_connection_arm(const hiw_servlet_thread* const st, hiw_timer_wheel* const timers,
+										 hiw_servlet_connection* const conn, const bool reading)
+{
+	conn->reading = reading;
+	hiw_client_set_idle(conn->client, !reading);
+	unsigned int timeout = reading ? st->servlet->config.header_read_timeout : 0;
+	if (timeout == 0)
+	{
+		// The idle timer keeps running while the header is received, if there's no header read timeout
+		if (reading && hiw_timer_is_armed(&conn->timer))
+			return;
+		timeout = hiw_internal_servlet_keep_alive_timeout(st->servlet);
+	}
+	if (timeout > 0)
+		hiw_timer_wheel_add(timers, &conn->timer, timeout);
+	else
+		hiw_timer_cancel(&conn->timer);
+}
 
-	// write the header body separator
-	if (!hiw_internal_response_write_raw(resp, "\r\n", 2))
+/**
+ * @brief Accept all pending clients and add them to the thread's poller
+ * @param st The servlet thread
+ * @param poller The poller
+ * @param timers The thread's timer wheel
+ * @param fibers The thread's fibers. NULL if the requests are not served by fibers
+ * @param head The first connection in the thread's linked list of connections
+ */
+void hiw_internal_servlet_event_loop_accept(hiw_servlet_thread* const st, hiw_poller* const poller,
+											hiw_timer_wheel* const timers, hiw_servlet_fibers* const fibers,
+											hiw_servlet_connection** const head)
+{
+	// Accept a limited number of clients each time, so that other threads get a chance to accept clients
+	for (int i = 0; i < HIW_SERVLET_MAX_POLL_EVENTS; ++i)
 	{
-		log_errorf("[t:%p][c:%p] could not write header body separator", resp->thread, resp->client);
-		return hiw_internal_response_error(resp);
+		hiw_client* const client = hiw_server_accept_shard(st->servlet->server, st->shard, &st->clients);
+		if (client == NULL)
+			return;
+
+		if (!hiw_client_set_nonblocking(client, true))
+		{
+			hiw_client_recycle(client, &st->clients);
+			continue;
+		}
+
+		hiw_servlet_connection* const conn = hiw_malloc(sizeof(hiw_servlet_connection));
+		conn->client = client;
+		conn->buffer = NULL;
+		conn->buffer_length = 0;
+		conn->timer = hiw_timer_init(hiw_internal_servlet_connection_expired, conn);
+		conn->fiber = NULL;
+		conn->fibers = fibers;
+		conn->rearmed = false;
+		conn->ready = false;
+		conn->keep_alive = false;
+		conn->next_ready = NULL;
+		conn->prev = NULL;
+		conn->next = *head;
+		if (*head != NULL)
+			(*head)->prev = conn;
+		*head = conn;
+
+		if (!hiw_poller_add(poller, hiw_client_get_socket(client), hiw_poller_flags_read, conn))
+		{
+			hiw_internal_servlet_connection_delete(st, head, conn);
+			continue;
+		}
+		hiw_internal_servlet_connection_arm(st, timers, conn, true);
+		log_debugf("[t:%p][c:%p] %s connected", st->thread, client, hiw_client_get_address(client));
 	}
+}
 
-	// Send the entire header block
-	const int total_header_size = hiw_memory_size(&resp->memory);
-	if (hiw_client_sendall(resp->client, resp->memory.ptr, total_header_size) != total_header_size)
+/**
+ * @brief Serve the requests received from the connection, for as long as their entire header is received
+ * @param st The servlet thread
+ * @param timers The thread's timer wheel
+ * @param conn The connection
+ * @param request The request, which contains at least one entire request header
+ * @param response The response
+ * @return true if the connection should be kept alive
+ */
+bool hiw_internal_servlet_event_loop_serve(hiw_servlet_thread* const st, hiw_timer_wheel* const timers,
+										   hiw_servlet_connection* const conn, hiw_request* const request,
+										   hiw_response* const response)
+{
+	// Serve the requests the client has pipelined after this one, for as long as their entire header is received
+	do
 	{
-		log_errorf("[t:%p][c:%p] could not write all data to the client", resp->thread, resp->client);
-		return hiw_internal_response_error(resp);
+		if (!hiw_internal_servlet_serve(st, request, response))
+		{
+			if (hiw_bit_test(response->flags, hiw_internal_response_flag_detached))
+				conn->client = NULL;
+			return false;
+		}
+		hiw_internal_request_next(request);
+	} while (hiw_internal_request_header_complete(request->memory.ptr, 0, request->buffered_length));
+
+	// Keep the partial header of the next pipelined request until the rest of it is received
+	if (request->buffered_length > 0)
+	{
+		conn->buffer = hiw_malloc(HIW_MAX_HEADER_SIZE);
+		hiw_std_mempy(request->memory.ptr, request->buffered_length, conn->buffer, HIW_MAX_HEADER_SIZE);
+		conn->buffer_length = request->buffered_length;
+		hiw_internal_servlet_connection_arm(st, timers, conn, true);
+		return true;
 	}
-	resp->flags |= hiw_internal_response_flag_headers_sent;
+	hiw_internal_servlet_connection_arm(st, timers, conn, false);
 	return true;
 }
 
-void hiw_servlet_start_filter_chain(hiw_servlet_thread* st)
+/**
+ * @brief Serve the requests of the connection whose fiber is running
+ * @param f The fiber
+ */
+void hiw_internal_servlet_fiber_func(hiw_fiber* const f)
 {
-	log_debugf("hiw_thread(%p) start listening to incoming requests in thread", st->thread);
+	hiw_servlet_connection* const conn = hiw_fiber_get_data(f);
+	hiw_servlet_fibers* const fibers = conn->fibers;
+	hiw_servlet_thread* const st = fibers->thread;
 
+	// The request and the response are kept on the fiber's stack, so that each in-flight request has it's own
 	hiw_request request;
 	hiw_internal_request_init(&request, st);
 	hiw_response response;
 	hiw_internal_response_init(&response, st);
 
-	// allow the thread to be running for as long as the server is running
-	while (hiw_server_is_running(st->servlet->server))
+	hiw_internal_request_reset(&request, conn->client);
+	hiw_std_mempy(fibers->header, fibers->header_length, request.memory.ptr, HIW_MAX_HEADER_SIZE);
+	request.buffered_length = fibers->header_length;
+	conn->keep_alive = hiw_internal_servlet_event_loop_serve(st, fibers->timers, conn, &request, &response);
+}
+
+/**
+ * @brief Called when a fiber has been waiting for it's client for too long
+ * @param t The connection's timer
+ */
+void hiw_internal_servlet_fiber_expired(hiw_timer* const t)
+{
+	hiw_servlet_connection* const conn = t->data;
+	log_debugf("[c:%p] timed out while waiting for the client", conn->client);
+
+	// The fiber is resumed by the event loop, so that it's not resumed while the timer wheel is advanced
+	hiw_fiber_timeout(conn->fiber);
+	conn->ready = true;
+	conn->next_ready = conn->fibers->ready;
+	conn->fibers->ready = conn;
+}
+
+/**
+ * @brief Start a fiber that serves the request header received by the event loop
+ * @param conn The connection
+ * @param request The request used by the event loop, which contains the request header
+ * @return true if the fiber is started; false if the request has to be served by the event loop itself
+ */
+bool hiw_internal_servlet_fiber_start(hiw_servlet_connection* const conn, const hiw_request* const request)
+{
+	hiw_servlet_fibers* const fibers = conn->fibers;
+	if (fibers->cache_count > 0)
 	{
-		// Blocking accept for new clients. Makes use of the OS's interrupts instead of polling and having to
-		// take race-condition into consideration. Will return NULL if:
-		// 1. accept timeout happened, which is okay and can be ignored
-		// 2. the server socket is closed, which only happens when the server is stopped
-		// TODO: Consider reusing clients instead of malloc and free
+		conn->fiber = fibers->cache[--fibers->cache_count];
+		hiw_fiber_reset(conn->fiber, hiw_internal_servlet_fiber_func, conn);
+	}
+	else
+	{
+		conn->fiber = hiw_fiber_new(hiw_internal_servlet_fiber_func, conn,
+									fibers->thread->servlet->config.fiber_stack_size);
+		if (conn->fiber == NULL)
+			return false;
+	}
+	fibers->header = request->memory.ptr;
+	fibers->header_length = request->buffered_length;
+	conn->keep_alive = false;
+	return true;
+}
 
-		hiw_client* const client = hiw_server_accept(st->servlet->server);
-		if (client == NULL)
+/**
+ * @brief Resume the fiber of the supplied connection, and run it until it's suspended or done. A suspended fiber is
+ *        resumed again when the client's socket is ready
+ * @param conn The connection
+ * @return false if the connection should be closed
+ */
+bool hiw_internal_servlet_fiber_run(hiw_servlet_connection* const conn)
+{
+	hiw_servlet_fibers* const fibers = conn->fibers;
+	hiw_fiber* const fiber = conn->fiber;
+
+	// The timer is only used for the fiber's wait while the fiber is suspended
+	hiw_timer_cancel(&conn->timer);
+	conn->timer.func = hiw_internal_servlet_connection_expired;
+
+	while (!hiw_fiber_resume(fiber))
+	{
+		SOCKET socket = INVALID_SOCKET;
+		bool write = false;
+		unsigned int timeout = 0;
+		const bool waiting = hiw_fiber_get_wait(fiber, &socket, &write, &timeout);
+		const SOCKET client_socket = hiw_client_get_socket(conn->client);
+
+		// Only the client's socket is watched by the event loop, so waiting for another socket blocks the thread
+		if (waiting && socket != client_socket)
 		{
-			log_infof("[t:%p] client accept failed", request.thread->thread);
-			continue; // continue will go back up, and if the server is no longer running then exit!
+			if (!hiw_socket_wait(socket, write, timeout))
+				hiw_fiber_timeout(fiber);
+			continue;
 		}
-		log_infof("[t:%p][c:%p] %s connected", request.thread->thread, request.client, hiw_client_get_address(client));
-
-	read_retry:
-		hiw_internal_request_reset(&request, client);
-		hiw_internal_response_reset(&response, client);
 
-		// read all headers
-		if (!hiw_internal_request_read_headers(&request))
+		// The client's socket is only reported once while the fiber is suspended. A fiber that has yielded without
+		// waiting is resumed after the events that are already received are handled, and it's socket is only reported
+		// if the client hangs up
+		int flags = hiw_poller_flags_oneshot;
+		if (waiting)
+			flags |= write ? hiw_poller_flags_write : hiw_poller_flags_read;
+		if (!hiw_poller_modify(fibers->poller, client_socket, flags, conn))
+			return false;
+		conn->rearmed = true;
+		if (!waiting)
+		{
+			conn->ready = true;
+			conn->next_ready = fibers->ready;
+			fibers->ready = conn;
+		}
+		else if (timeout > 0)
 		{
-			response.connection_close = true;
-			goto read_abort;
+			conn->timer.func = hiw_internal_servlet_fiber_expired;
+			hiw_timer_wheel_add(fibers->timers, &conn->timer, timeout);
 		}
-		log_infof("[t:%p][c:%p] %.*s %.*s", request.thread, request.client, request.method.length, request.method.begin,
-				  request.uri.length, request.uri.begin);
+		return true;
+	}
+
+	// The fiber is done, so it's kept for the next request
+	conn->fiber = NULL;
+	if (fibers->cache_count < HIW_SERVLET_FIBER_CACHE_SIZE)
+		fibers->cache[fibers->cache_count++] = fiber;
+	else
+		hiw_fiber_delete(fiber);
+
+	// A detached connection is owned by the thread pool worker producing the response
+	if (conn->client == NULL || !conn->keep_alive)
+		return false;
+	if (conn->rearmed &&
+		!hiw_poller_modify(fibers->poller, hiw_client_get_socket(conn->client), hiw_poller_flags_read, conn))
+		return false;
+	conn->rearmed = false;
+	return true;
+}
+
+/**
+ * @brief Resume the fibers that are ready, without waiting for their client's socket
+ * @param fibers The thread's fibers
+ * @param head The first connection in the thread's linked list of connections
+ */
+void hiw_internal_servlet_fibers_resume(hiw_servlet_fibers* const fibers, hiw_servlet_connection** const head)
+{
+	// Fibers that are yielding again are resumed the next time the event loop wakes up
+	hiw_servlet_connection* conn = fibers->ready;
+	fibers->ready = NULL;
+	while (conn != NULL)
+	{
+		hiw_servlet_connection* const next = conn->next_ready;
+		conn->ready = false;
+		conn->next_ready = NULL;
+		if (!hiw_internal_servlet_fiber_run(conn))
+			hiw_internal_servlet_connection_delete(fibers->thread, head, conn);
+		conn = next;
+	}
+}
+
+/**
+ * @brief Create the fibers of a servlet thread running an event loop
+ * @param st The servlet thread
+ * @param poller The poller of the thread's event loop
+ * @param timers The timer wheel of the thread's event loop
+ * @return The thread's fibers; NULL if the requests are not served by fibers
+ */
+hiw_servlet_fibers* hiw_internal_servlet_fibers_new(hiw_servlet_thread* const st, hiw_poller* const poller,
+													hiw_timer_wheel* const timers)
+{
+	if (!st->servlet->config.fibers)
+		return NULL;
+	hiw_servlet_fibers* const fibers = hiw_malloc(sizeof(hiw_servlet_fibers));
+	fibers->thread = st;
+	fibers->poller = poller;
+	fibers->timers = timers;
+	fibers->ready = NULL;
+	fibers->header = NULL;
+	fibers->header_length = 0;
+	fibers->cache_count = 0;
+	return fibers;
+}
+
+/**
+ * @brief Delete the fibers of a servlet thread. The connections using the fibers are expected to be deleted already
+ * @param fibers The thread's fibers
+ */
+void hiw_internal_servlet_fibers_delete(hiw_servlet_fibers* const fibers)
+{
+	if (fibers == NULL)
+		return;
+	for (int i = 0; i < fibers->cache_count; ++i)
+		hiw_fiber_delete(fibers->cache[i]);
+	free(fibers);
+}
+
+/**
+ * @brief Receive data from a readable connection and process the request if the entire header is received
+ * @param st The servlet thread
+ * @param timers The thread's timer wheel
+ * @param conn The connection
+ * @param request The request used by this thread
+ * @param response The response used by this thread
+ * @return true if the connection should be kept alive
+ */
+bool hiw_internal_servlet_event_loop_readable(hiw_servlet_thread* const st, hiw_timer_wheel* const timers,
+											  hiw_servlet_connection* const conn, hiw_request* const request,
+											  hiw_response* const response)
+{
+	hiw_internal_request_reset(request, conn->client);
 
-		response.connection_close = request.connection_close;
+	// Receive the data directly into the request memory, after any data we've previously received
+	char* const buf = request->memory.ptr;
+	const int previous_length = conn->buffer_length;
+	if (previous_length > 0)
+		hiw_std_mempy(conn->buffer, previous_length, buf, HIW_MAX_HEADER_SIZE);
 
-		// Iterate over all filters and then, eventually, get to the actual servlet function!
-		if (st->filter_chain.filters != NULL)
-			st->filter_chain.filters->func(&request, &response, &st->filter_chain);
-		else if (st->servlet->servlet_func != NULL)
-			st->servlet->servlet_func(&request, &response);
+	const int count =
+		hiw_socket_recv(hiw_client_get_socket(conn->client), buf + previous_length, HIW_MAX_HEADER_SIZE - previous_length);
+	if (count < 0 && hiw_socket_would_block())
+		return true;
+	if (count <= 0)
+		return false;
 
-		// Verify that we've read all content from the client. If not, then the client sent a Content-Length header
-		// that's larger than what the servlet read
-		if (request.content_length_remaining > 0)
+	const int length = previous_length + count;
+	if (!hiw_internal_request_header_complete(buf, previous_length - 2, length))
+	{
+		if (length >= HIW_MAX_HEADER_SIZE)
 		{
-			log_errorf("[t:%p][c:%p] client sent %d bytes but only read %d bytes, connection will forcefully close",
-					   request.thread, request.client, request.content_length, request.content_length_remaining);
-			response.connection_close = true;
-			goto read_abort;
+			log_errorf("[t:%p][c:%p] request's header-size is larger than the maximum allowed size of %d bytes",
+					   st->thread, conn->client, HIW_MAX_HEADER_SIZE);
+			return false;
 		}
 
-		// Flush headers if they aren't flushed already
-		if (!hiw_response_flush_headers(&response))
+		// Keep the partial header until more data is received. The header read timeout starts with the first bytes of
+		// the request
+		if (!conn->reading)
+			hiw_internal_servlet_connection_arm(st, timers, conn, true);
+		if (conn->buffer == NULL)
+			conn->buffer = hiw_malloc(HIW_MAX_HEADER_SIZE);
+		hiw_std_mempy(buf, length, conn->buffer, HIW_MAX_HEADER_SIZE);
+		conn->buffer_length = length;
+		return true;
+	}
+
+	// The entire header is received. Idle connections should not keep the header memory
+	if (conn->buffer != NULL)
+	{
+		free(conn->buffer);
+		conn->buffer = NULL;
+	}
+	conn->buffer_length = 0;
+
+	request->buffered_length = length;
+	hiw_timer_cancel(&conn->timer);
+	hiw_client_set_idle(conn->client, false);
+	if (conn->fibers != NULL && hiw_internal_servlet_fiber_start(conn, request))
+		return hiw_internal_servlet_fiber_run(conn);
+	return hiw_internal_servlet_event_loop_serve(st, timers, conn, request, response);
+}
+
+/**
+ * @brief Start draining the event loop. The server socket is removed from the poller and the idle connections are
+ *        closed, so that only the connections receiving a request header, or served by a fiber, are kept
+ * @param st The servlet thread
+ * @param poller The poller
+ * @param server_socket The server socket added to the poller
+ * @param head The first connection in the thread's linked list of connections
+ * @return When the remaining connections are forcefully closed, in milliseconds as returned by hiw_timer_now
+ */
+unsigned long long hiw_internal_servlet_event_loop_drain(hiw_servlet_thread* const st, hiw_poller* const poller,
+														 const SOCKET server_socket,
+														 hiw_servlet_connection** const head)
+{
+	hiw_poller_remove(poller, server_socket);
+	hiw_servlet_connection* conn = *head;
+	while (conn != NULL)
+	{
+		hiw_servlet_connection* const next = conn->next;
+		if (conn->buffer_length == 0 && conn->fiber == NULL)
+			hiw_internal_servlet_connection_delete(st, head, conn);
+		conn = next;
+	}
+	return hiw_timer_now() + st->servlet->config.drain_timeout;
+}
+
+/**
+ * Run an event loop that serves many clients at the same time
+ *
+ * @param st The servlet thread
+ * @param request The request used by this thread
+ * @param response The response used by this thread
+ */
+void hiw_internal_servlet_event_loop(hiw_servlet_thread* const st, hiw_request* const request,
+									 hiw_response* const response)
+{
+	hiw_server* const server = st->servlet->server;
+	hiw_poller* const poller = hiw_poller_new();
+	if (poller == NULL)
+	{
+		log_errorf("[t:%p] could not create the event loop poller", st->thread);
+		return;
+	}
+
+	// Servlet threads might be waiting for the same listening socket. The exclusive flag makes sure that only
+	// one of them wakes up when a new client is connecting
+	const SOCKET server_socket = hiw_server_get_shard_socket(server, st->shard);
+	if (!hiw_poller_add(poller, server_socket, hiw_poller_flags_read | hiw_poller_flags_exclusive, NULL))
+	{
+		log_errorf("[t:%p] could not add the server socket to the event loop", st->thread);
+		hiw_poller_delete(poller);
+		return;
+	}
+	st->poller = poller;
+
+	hiw_servlet_connection* connections = NULL;
+	hiw_poller_event events[HIW_SERVLET_MAX_POLL_EVENTS];
+	hiw_timer_wheel* const timers = hiw_timer_wheel_new(hiw_timer_now());
+	hiw_servlet_fibers* const fibers = hiw_internal_servlet_fibers_new(st, poller, timers);
+	bool draining = false;
+	unsigned long long drain_deadline = 0;
+
+	// allow the thread to be running for as long as the server is running, and then for as long as requests are
+	// in-flight
+	while (1)
+	{
+		int timeout = hiw_timer_wheel_next_timeout(timers, HIW_SERVLET_POLL_TIMEOUT);
+		if (!hiw_server_is_running(server))
 		{
-			response.connection_close = true;
-			goto read_abort;
+			if (!draining)
+			{
+				drain_deadline = hiw_internal_servlet_event_loop_drain(st, poller, server_socket, &connections);
+				draining = true;
+			}
+			const unsigned long long now = hiw_timer_now();
+			if (connections == NULL || now >= drain_deadline)
+				break;
+			if (drain_deadline - now < (unsigned long long)timeout)
+				timeout = (int)(drain_deadline - now);
 		}
 
-		// If we haven't written all the memory to the client, then warn about it and then close the connection
-		if (response.content_bytes_left > 0)
+		// Fibers that are ready are resumed as soon as the events that are already received are handled
+		if (fibers != NULL && fibers->ready != NULL)
+			timeout = 0;
+		const int count = hiw_poller_wait(poller, events, HIW_SERVLET_MAX_POLL_EVENTS, timeout);
+		if (count < 0)
+			break;
+
+		for (int i = 0; i < count; ++i)
 		{
-			log_errorf("[t:%p][c:%p] bytes left to write to the client, connection will forcefully close",
-					   request.thread, request.client);
-			response.connection_close = true;
-			goto read_abort;
+			hiw_servlet_connection* const conn = events[i].data;
+
+			// The server socket is the only socket without a connection
+			if (conn == NULL)
+			{
+				hiw_internal_servlet_event_loop_accept(st, poller, timers, fibers, &connections);
+				continue;
+			}
+
+			// A suspended fiber is resumed when the client's socket is ready, or when the client has hung up
+			if (conn->fiber != NULL)
+			{
+				if (!conn->ready && !hiw_internal_servlet_fiber_run(conn))
+					hiw_internal_servlet_connection_delete(st, &connections, conn);
+				continue;
+			}
+
+			// Data is processed before the hangup, so that a request followed by the client closing it's
+			// write-side of the connection is still served
+			if (!hiw_bit_test(events[i].flags, hiw_poller_flags_read) ||
+				!hiw_internal_servlet_event_loop_readable(st, timers, conn, request, response))
+			{
+				hiw_internal_servlet_connection_delete(st, &connections, conn);
+			}
 		}
 
-		// reuse connection if possible
-		if (!response.connection_close)
-			goto read_retry;
+		// Expired connections are shut down, and deleted when the event loop is woken up by the shutdown
+		hiw_timer_wheel_advance(timers, hiw_timer_now());
+		if (fibers != NULL)
+			hiw_internal_servlet_fibers_resume(fibers, &connections);
+	}
+
+	while (connections != NULL)
+		hiw_internal_servlet_connection_delete(st, &connections, connections);
+	hiw_internal_servlet_fibers_delete(fibers);
+	hiw_timer_wheel_delete(timers);
+	st->poller = NULL;
+	hiw_poller_delete(poller);
+}
+
+/**
+ * @brief Move a string that's pointing into the supplied memory, which has been copied to a new location
+ * @param str The string
+ * @param from The memory that's copied
+ * @param to Where the memory is copied to
+ */
+void hiw_internal_string_move(hiw_string* const str, const char* const from, const char* const to)
+{
+	if (str->begin >= from && str->begin < from + HIW_MAX_HEADER_SIZE)
+		str->begin = to + (str->begin - from);
+}
+
+/**
+ * @brief Move the headers pointing into the supplied memory, which has been copied to a new location
+ * @param headers The headers
+ * @param from The memory that's copied
+ * @param to Where the memory is copied to
+ */
+void hiw_internal_headers_move(hiw_headers* const headers, const char* const from, const char* const to)
+{
+	for (int i = 0; i < headers->count; ++i)
+	{
+		hiw_internal_string_move(&headers->headers[i].name, from, to);
+		hiw_internal_string_move(&headers->headers[i].value, from, to);
+	}
+}
+
+/**
+ * @brief Move the memory object, using fixed memory, to fixed memory that's copied to a new location
+ * @param memory The memory object
+ * @param from The memory that's copied
+ * @param to Where the memory is copied to
+ */
+void hiw_internal_memory_move(hiw_memory* const memory, const char* const from, char* const to)
+{
+	memory->ptr = to + (memory->ptr - from);
+	memory->pos = to + (memory->pos - from);
+	memory->end = to + (memory->end - from);
+}
+
+/**
+ * @brief Move a request, and everything it has received, to a new location
+ * @param dest Where the request is moved to
+ * @param src The request
+ */
+void hiw_internal_request_move(hiw_request* const dest, const hiw_request* const src)
+{
+	*dest = *src;
+	hiw_internal_string_move(&dest->method, src->memory_fixed, dest->memory_fixed);
+	hiw_internal_string_move(&dest->uri, src->memory_fixed, dest->memory_fixed);
+	hiw_internal_headers_move(&dest->headers, src->memory_fixed, dest->memory_fixed);
+	hiw_internal_memory_move(&dest->memory, src->memory_fixed, dest->memory_fixed);
+	dest->read_ahead = dest->memory_fixed + (src->read_ahead - src->memory_fixed);
+}
+
+/**
+ * @brief Move a response, and everything it has buffered, to a new location
+ * @param dest Where the response is moved to
+ * @param src The response
+ * @param req_dest Where the response's request is moved to
+ * @param req_src The response's request. Headers in the response might be pointing into the request's memory
+ */
+void hiw_internal_response_move(hiw_response* const dest, const hiw_response* const src,
+								const hiw_request* const req_dest, const hiw_request* const req_src)
+{
+	*dest = *src;
+	hiw_internal_headers_move(&dest->headers, src->memory_fixed, dest->memory_fixed);
+	hiw_internal_headers_move(&dest->headers, req_src->memory_fixed, req_dest->memory_fixed);
+	hiw_internal_memory_move(&dest->memory, src->memory_fixed, dest->memory_fixed);
+}
 
-	read_abort:
-		log_infof("[t:%p][c:%p] disconnected", request.thread->thread, request.client);
+/**
+ * @brief Produce a detached response in a thread pool worker
+ * @param t The thread pool worker
+ */
+void hiw_internal_servlet_detached_func(hiw_thread* const t)
+{
+	hiw_servlet_detached* const d = hiw_thread_get_userdata(t);
+	hiw_servlet* const s = d->thread.servlet;
+	hiw_client* const client = d->request.client;
+	d->thread.thread = t;
+
+	d->func(&d->request, &d->response);
+
+	// A connection that must close never has it's output held back for a next request, and is never parked
+	if (d->must_close)
+		d->response.connection_close = true;
+	const bool keep_alive =
+		hiw_internal_servlet_complete(&d->thread, &d->request, &d->response) && !d->must_close;
+
+	// The connection is parked before the response is no longer detached, so that it's owned by the parking poller
+	// when the servlet is released
+	if (keep_alive)
+		hiw_client_set_idle(client, true);
+	if (!keep_alive || !hiw_internal_servlet_park(s, d->parked))
+	{
+		log_infof("[t:%p][c:%p] disconnected", t, client);
 		hiw_client_delete(client);
+		if (d->parked != NULL)
+			free(d->parked);
+	}
+
+	hiw_thread_critical_sec_enter(s->detach_lock);
+	if (d->prev != NULL)
+		d->prev->next = d->next;
+	else
+		s->detached = d->next;
+	if (d->next != NULL)
+		d->next->prev = d->prev;
+	s->detached_count--;
+	hiw_thread_critical_sec_notify_all(s->detach_lock);
+	hiw_thread_critical_sec_exit(s->detach_lock);
+	free(d);
+}
+
+bool hiw_servlet_detach(hiw_request* const req, hiw_response* const resp, const hiw_servlet_fn func)
+{
+	assert(req != NULL && "expected 'req' to exist");
+	assert(resp != NULL && "expected 'resp' to exist");
+	assert(func != NULL && "expected 'func' to exist");
+
+	hiw_servlet_thread* const st = req->thread;
+	hiw_servlet* const s = st->servlet;
+
+	// Only parked connections are reused after the response is done. The connection is closed if the client has
+	// pipelined requests, since they are discarded
+	const int content_remaining = req->content_length_remaining > 0 ? req->content_length_remaining : 0;
+	const bool must_close = st->parked == NULL || req->read_ahead_length > content_remaining;
+
+	// Clients accepted using io_uring are bound to the servlet thread's ring. A response that's already detached is
+	// produced by a thread pool worker, which is allowed to block. The client is never told that the connection is
+	// kept alive and then disconnected
+	bool detach = s->detach_pool != NULL && st->lock != NULL &&
+				  hiw_server_get_config(s->server)->io_backend != HIW_SERVER_IO_BACKEND_URING &&
+				  hiw_server_is_running(s->server) &&
+				  !(must_close && hiw_bit_test(resp->flags, hiw_internal_response_flag_connection_set) &&
+					!resp->connection_close);
+	if (detach)
+	{
+		hiw_thread_critical_sec_enter(s->detach_lock);
+		detach = s->detached_count < s->config.max_detached;
+		if (detach)
+			s->detached_count++;
+		hiw_thread_critical_sec_exit(s->detach_lock);
+	}
+	if (!detach)
+	{
+		func(req, resp);
+		return false;
 	}
-	log_infof("[t:%p] shutting down servlet thread", request.thread->thread);
+
+	hiw_servlet_detached* const d = hiw_malloc(sizeof(hiw_servlet_detached));
+	d->thread = *st;
+	d->thread.clients = hiw_client_cache_default;
+	d->thread.lock = NULL;
+	d->thread.active = NULL;
+	d->thread.poller = NULL;
+	d->thread.parked = NULL;
+	d->thread.next = NULL;
+	hiw_internal_request_move(&d->request, req);
+	hiw_internal_response_move(&d->response, resp, &d->request, req);
+	d->request.thread = &d->thread;
+	d->response.thread = &d->thread;
+	d->func = func;
+
+	d->parked = st->parked;
+	st->parked = NULL;
+	d->must_close = must_close;
+	if (must_close)
+	{
+		d->response.connection_close = true;
+		d->response.flags |= hiw_internal_response_flag_must_close;
+	}
+
+	// The worker blocks while receiving and sending, instead of waiting for the event loop
+	if (st->poller != NULL)
+	{
+		hiw_poller_remove(st->poller, hiw_client_get_socket(req->client));
+		hiw_client_set_nonblocking(req->client, false);
+	}
+
+	// The servlet thread's response is no longer sent. Anything written to it after this point is an error
+	resp->flags |= hiw_internal_response_flag_detached | hiw_internal_response_flag_error;
+	hiw_memory_reset(&resp->memory);
+
+	hiw_thread_critical_sec_enter(s->detach_lock);
+	d->prev = NULL;
+	d->next = s->detached;
+	if (s->detached != NULL)
+		s->detached->prev = d;
+	s->detached = d;
+	hiw_thread_critical_sec_exit(s->detach_lock);
+
+	log_debugf("[t:%p][c:%p] response is detached", st->thread, req->client);
+	d->task.func = hiw_internal_servlet_detached_func;
+	d->task.data = d;
+	hiw_thread_pool_push_task(s->detach_pool, &d->task);
+	return true;
+}
+
+void hiw_servlet_start_filter_chain(hiw_servlet_thread* st)
+{
+	log_debugf("hiw_thread(%p) start listening to incoming requests in thread", st->thread);
+
+	hiw_request request;
+	hiw_internal_request_init(&request, st);
+	hiw_response response;
+	hiw_internal_response_init(&response, st);
+
+	switch (st->servlet->config.mode)
+	{
+	case HIW_SERVLET_MODE_EVENT_LOOP:
+		hiw_internal_servlet_event_loop(st, &request, &response);
+		break;
+	case HIW_SERVLET_MODE_BLOCKING:
+	default:
+		if (st->servlet->parking != NULL)
+			hiw_internal_servlet_parking_loop(st, &request, &response);
+		else
+			hiw_internal_servlet_blocking_loop(st, &request, &response);
+		break;
+	}
+	hiw_client_cache_release(&st->clients);
+	log_infof("[t:%p] shutting down servlet thread", st->thread);
 }
 
 hiw_thread* hiw_request_get_thread(const hiw_request* const req)
@@ -864,6 +2723,10 @@ int hiw_request_recv(hiw_request* const req, char* dest, int n)
 
 bool hiw_response_write_status_code(hiw_response* resp)
 {
+	// The longest status line is "HTTP/1.1 418 I'm a teapot\r\n"
+	if (!hiw_internal_response_reserve(resp, hiw_string_const_len("HTTP/1.1 418 I'm a teapot\r\n")))
+		return false;
+
 	int len = hiw_string_const_len("HTTP/1.1 ");
 	char* buf = hiw_memory_get(&resp->memory, len);
 	if (buf == NULL)
@@ -956,6 +2819,9 @@ bool hiw_response_write_header(hiw_response* const resp, const hiw_header header
 		impl->flags |= hiw_internal_response_flag_status_code_set;
 	}
 
+	if (!hiw_internal_response_reserve(impl, header.name.length + 2 + header.value.length + 2))
+		return false;
+
 	// write the header name to the buffer
 	char* dest = hiw_memory_get(&impl->memory, header.name.length);
 	if (dest == NULL)
@@ -1005,13 +2871,20 @@ bool hiw_response_write_body_raw(hiw_response* const resp, const char* src, int
 			return hiw_internal_response_error(resp);
 	}
 
-	// Send the raw data to the client
-	const int sent = hiw_client_sendall(resp->client, src, n);
-	if (sent != n)
+	// Small writes are buffered together with the header block. Larger writes are sent together with what's already
+	// buffered using one system call. The fixed memory is never grown, whatever the threshold is
+	const int buffered = hiw_memory_size(&resp->memory);
+	char* const dest =
+		buffered + n <= HIW_RESPONSE_FLUSH_THRESHOLD && buffered + n <= hiw_memory_capacity(&resp->memory)
+			? hiw_memory_get(&resp->memory, n)
+			: NULL;
+	if (dest != NULL)
 	{
-		log_errorf("[t:%p][c:%p] expected to send %d bytes to the client but sent %d", resp->thread, resp->client, n,
-				   sent);
-		return hiw_internal_response_error(resp);
+		hiw_std_mempy(src, n, dest, n);
+	}
+	else if (!hiw_internal_response_flush(resp, src, n, resp->content_bytes_left > n))
+	{
+		return false;
 	}
 
 	if (resp->content_length > 0)
@@ -1030,6 +2903,49 @@ bool hiw_response_write_body_raw(hiw_response* const resp, const char* src, int
 	return true;
 }
 
+bool hiw_response_send_file(hiw_response* const resp, const int fd, const long long offset, const int length)
+{
+	assert(resp != NULL);
+	if (resp == NULL)
+		return false;
+	assert(fd >= 0 && "expected 'fd' to be a valid file descriptor");
+	if (fd < 0 || offset < 0 || length < 0)
+		return hiw_internal_response_error(resp);
+
+	if (!hiw_bit_test(resp->flags, hiw_internal_response_flag_headers_sent))
+	{
+		// The content-length is the size of the file, unless the servlet has already set the content-length
+		if (!hiw_response_set_content_length(resp, length))
+			return hiw_internal_response_error(resp);
+
+		if (!hiw_response_flush_headers(resp))
+			return hiw_internal_response_error(resp);
+	}
+
+	if (resp->content_length > 0 && length > resp->content_bytes_left)
+	{
+		log_errorf("[t:%p][c:%p] you're trying to send more data to the client than content-length %d allows",
+				   resp->thread, resp->client, resp->content_length);
+		return hiw_internal_response_error(resp);
+	}
+
+	// Send everything that's buffered so far and tell the network stack that the file content follows right after
+	if (!hiw_internal_response_flush(resp, NULL, 0, length > 0))
+		return false;
+
+	const int sent = hiw_client_sendfile(resp->client, fd, offset, length);
+	if (sent != length)
+	{
+		log_errorf("[t:%p][c:%p] expected to send %d bytes from file to the client but sent %d", resp->thread,
+				   resp->client, length, sent);
+		return hiw_internal_response_error(resp);
+	}
+
+	if (resp->content_length > 0)
+		resp->content_bytes_left -= length;
+	return true;
+}
+
 bool hiw_response_set_content_type(hiw_response* const resp, const hiw_string mime_type)
 {
 	const hiw_string content_type_name = hiw_string_const("Content-Type");
@@ -1067,6 +2983,10 @@ bool hiw_response_set_connection_close(hiw_response* resp, bool close)
 	const hiw_string connection_close_keep_alive = hiw_string_const("keep-alive");
 	const hiw_string connection_close_close = hiw_string_const("close");
 
+	// The client is never told that a connection that's about to close is kept alive
+	if (hiw_bit_test(impl->flags, hiw_internal_response_flag_must_close))
+		close = true;
+
 	if (close)
 	{
 		if (!hiw_response_write_header(resp, (hiw_header){.name = connection_name, .value = connection_close_close}))